@@ -0,0 +1,154 @@
+/*
+ * A fixed pool of buffers shared by several MidiFileStream objects.
+ * See MidiBufferPool.h.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ */
+
+#include <MidiBufferPool.h>
+
+MidiBufferPool::MidiBufferPool() {
+  begin(0, 0, 0);
+}
+
+/*
+ * Starts lending from the given memory, with every block free.
+ * Any buffers lent before are forgotten.
+ *  pMemory = the memory to lend.  The caller owns it and must
+ *    keep it while the pool is in use.  Declare it as an array of
+ *    unsigned long, so that buffers can hold any type.
+ *  size = size (bytes) of pMemory.
+ *  blockSize = size (bytes) of each block, rounded up to
+ *    a multiple of sizeof(unsigned long).  Each buffer takes
+ *    whole blocks, so small blocks waste less RAM,
+ *    but the pool has at most MIDI_POOL_MAX_BLOCKS of them.
+ *    Blocks past that are not used.
+ */
+void MidiBufferPool::begin(void *pMemory, int size, int blockSize) {
+  _pMemory = (byte *) pMemory;
+  _blockSize = 0;
+  _numBlocks = 0;
+  if (_pMemory != 0 && size > 0 && blockSize > 0) {
+    _blockSize = ((blockSize + (int) sizeof(unsigned long) - 1) / (int) sizeof(unsigned long))
+        * (int) sizeof(unsigned long);
+    _numBlocks = size / _blockSize;
+    if (_numBlocks > MIDI_POOL_MAX_BLOCKS) {
+      _numBlocks = MIDI_POOL_MAX_BLOCKS;
+    }
+  }
+  _isUsed = 0;
+  _isLast = 0;
+  _numUsed = 0;
+  _highWater = 0;
+  _numFailures = 0;
+}
+
+/*
+ * Lends a buffer: the first run of free blocks that's large enough.
+ *  size = size (bytes) needed.
+ * Returns the buffer, or 0 if there's no run of free blocks
+ * that large (see getFailures()).  Give it back with giveBack().
+ */
+void *MidiBufferPool::borrow(int size) {
+  unsigned long run;  // a bit for each of numNeeded blocks, starting at block 0.
+  int numNeeded;
+  int i;
+
+  if (size <= 0 || _blockSize == 0) {
+    ++_numFailures;
+    return 0;
+  }
+  numNeeded = (size + _blockSize - 1) / _blockSize;
+  if (numNeeded > _numBlocks) {
+    ++_numFailures;
+    return 0;
+  }
+
+  run = ((1UL << (numNeeded - 1)) << 1) - 1;  // two shifts, in case numNeeded is 32.
+  for (i = 0; i + numNeeded <= _numBlocks; ++i) {
+    if ((_isUsed & (run << i)) == 0) {
+      _isUsed |= run << i;
+      _isLast |= 1UL << (i + numNeeded - 1);
+      _numUsed += numNeeded;
+      if (_numUsed > _highWater) {
+        _highWater = _numUsed;
+      }
+      return _pMemory + (long) i * _blockSize;
+    }
+  }
+
+  ++_numFailures;
+  return 0;
+}
+
+/*
+ * Gives back a buffer lent by borrow(), so its blocks can be lent again.
+ *  pBuffer = the buffer.  0, or anything not lent by this pool,
+ *    is ignored.
+ */
+void MidiBufferPool::giveBack(const void *pBuffer) {
+  long offset;
+  int i;
+
+  if (pBuffer == 0 || _blockSize == 0) {
+    return;
+  }
+  offset = (const byte *) pBuffer - _pMemory;
+  if (offset < 0 || offset % _blockSize != 0 || offset / _blockSize >= _numBlocks) {
+    return;
+  }
+  i = (int) (offset / _blockSize);
+
+  // Ignore a block that's free, or that isn't the start of a buffer
+  // (the one before it is lent, and isn't the end of its buffer).
+  if ((_isUsed & (1UL << i)) == 0) {
+    return;
+  }
+  if (i > 0 && (_isUsed & (1UL << (i - 1))) != 0 && (_isLast & (1UL << (i - 1))) == 0) {
+    return;
+  }
+
+  // Free blocks up to and including the one that ends the buffer.
+  for (; i < _numBlocks && (_isUsed & (1UL << i)) != 0; ++i) {
+    _isUsed &= ~(1UL << i);
+    --_numUsed;
+    if ((_isLast & (1UL << i)) != 0) {
+      _isLast &= ~(1UL << i);
+      break;
+    }
+  }
+}
+
+/*
+ * Returns the size (bytes) of each block.
+ */
+int MidiBufferPool::getBlockSize() {
+  return _blockSize;
+}
+
+/*
+ * Returns the number of bytes not lent.
+ * They may not all be in one run of blocks.
+ */
+int MidiBufferPool::getFreeBytes() {
+  return (_numBlocks - _numUsed) * _blockSize;
+}
+
+/*
+ * Returns the most bytes lent at once since begin(),
+ * to help size the pool from real use.
+ */
+int MidiBufferPool::getHighWater() {
+  return _highWater * _blockSize;
+}
+
+/*
+ * Returns the number of borrow() calls since begin()
+ * that found no run of free blocks large enough.
+ */
+unsigned int MidiBufferPool::getFailures() {
+  return _numFailures;
+}
@@ -0,0 +1,68 @@
+#ifndef MidiBufferPool_h
+#define MidiBufferPool_h
+
+#include <Arduino.h>
+
+/*
+ * A fixed pool of buffers shared by several MidiFileStream objects.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ *
+ * A MidiBufferPool divides one array, supplied by the caller,
+ * into equal blocks, and lends runs of blocks as buffers.
+ * A MidiFileStream given the pool (see MidiFileStream::setBufferPool())
+ * borrows its read-ahead and payload buffers in begin()
+ * and gives them back in end(), so that the RAM for buffers is
+ * the size of the pool, however many MidiFileStream objects there are,
+ * and files that aren't open hold none of it.  The caller may
+ * borrow from the pool too, e.g., for the cursors of beginMerge().
+ *
+ * Nothing is allocated, and borrowing and giving back take
+ * a few bit operations per block.  A pool has at most
+ * MIDI_POOL_MAX_BLOCKS blocks.
+ *
+ * To use:
+ *    unsigned long poolMemory[1024 / sizeof(unsigned long)];
+ *    MidiBufferPool pool;
+ *
+ *    pool.begin(poolMemory, sizeof(poolMemory), 64);
+ *    backingFile.setBufferPool(&pool, 512, 41);
+ *    cueFile.setBufferPool(&pool, 256, 41);
+ *    ...
+ *    MidiTrackCursor *pCursors = (MidiTrackCursor *) pool.borrow(4 * sizeof(MidiTrackCursor));
+ *    ...
+ *    pool.giveBack(pCursors);
+ */
+
+/*
+ * The largest number of blocks in a pool:
+ * one bit of an unsigned long per block.
+ */
+const int MIDI_POOL_MAX_BLOCKS = 32;
+
+class MidiBufferPool {
+  private:
+    byte *_pMemory;          // the blocks.
+    int _blockSize;          // size (bytes) of one block.
+    int _numBlocks;          // number of blocks in _pMemory.
+    unsigned long _isUsed;   // a bit per block: if set, the block is lent.
+    unsigned long _isLast;   // a bit per block: if set, the block ends a buffer.
+    int _numUsed;            // number of blocks lent.
+    int _highWater;          // the most blocks lent at once.
+    unsigned int _numFailures; // number of borrow() calls that failed.
+
+  public:
+    MidiBufferPool();
+    void begin(void *pMemory, int size, int blockSize);
+    void *borrow(int size);
+    void giveBack(const void *pBuffer);
+
+    int getBlockSize();
+    int getFreeBytes();
+    int getHighWater();
+    unsigned int getFailures();
+};
+#endif
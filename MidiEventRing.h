@@ -0,0 +1,227 @@
+#ifndef MidiEventRing_h
+#define MidiEventRing_h
+
+#include <Arduino.h>
+#include <MidiFileStream.h>
+
+/*
+ * Interrupt-safe queue of decoded events, from a parser to a player.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ *
+ * A MidiEventRing is a single-producer, single-consumer ring buffer
+ * of MidiTimedEvent.  Typically loop() is the producer, reading events
+ * with MidiFileStream and calling push(), and a timer interrupt routine
+ * is the consumer, calling peek() and pop() to play each event
+ * when it is due.
+ *
+ * Neither side waits for the other or turns off interrupts:
+ * each index is a single byte written by only one side,
+ * so it is read and written atomically, even on AVR.
+ *
+ * SIZE = the number of events the ring holds.
+ *  Must be a power of 2, from 2 to 128.
+ *
+ * To use:
+ *    MidiEventRing<16> ring;
+ *
+ *    ...in loop()...
+ *    while (!ring.isFull() && there are events) {
+ *      midiFile.readEvent();
+ *      midiFile.getTimedEvent(&event);
+ *      ring.push(event);
+ *    }
+ *
+ *    ...in the timer interrupt routine...
+ *    const MidiTimedEvent *pEvent = ring.peek();
+ *    if (pEvent && (long) (now - pEvent->time) >= 0) {
+ *      play *pEvent;
+ *      ring.pop();
+ *    }
+ *
+ * getHighWater() and getUnderruns() help choose SIZE:
+ * if the ring never fills and never runs dry, it is big enough.
+ * The consumer may poll an empty ring as often as it likes: only
+ * running dry, after taking an event, counts as an underrun.
+ */
+template <int SIZE>
+class MidiEventRing {
+  private:
+    MidiTimedEvent _events[SIZE];
+
+    // Free-running indexes; the number of events in the ring is (_head - _tail).
+    volatile byte _head;      // written only by the producer: where the next push() goes.
+    volatile byte _tail;      // written only by the consumer: where the next pop() comes from.
+    volatile boolean _isClosed; // written only by the producer: if true, no more events will come.
+
+    byte _highWater;          // written only by the producer: the most events ever in the ring.
+    volatile unsigned long _underruns; // written only by the consumer: see getUnderruns().
+    boolean _isDry;           // used only by the consumer: if true, the ring was empty when last looked at.
+
+    /*
+     * Keeps the compiler and CPU from moving memory accesses
+     * across this point, so an event is completely written
+     * before the index that publishes it.
+     */
+    static void barrier() {
+#if defined(__AVR__)
+      __asm__ __volatile__ ("" ::: "memory");
+#else
+      __sync_synchronize();
+#endif
+    }
+
+    /*
+     * Consumer: the ring is empty.  Counts an underrun
+     * if it wasn't empty the last time, and close() wasn't called.
+     */
+    void countUnderrun() {
+      if (!_isDry && !_isClosed) {
+        _underruns = _underruns + 1;
+      }
+      _isDry = true;
+    }
+
+    // SIZE must be a power of 2 that fits the byte indexes.
+    typedef char sizeIsPowerOf2[((SIZE & (SIZE - 1)) == 0 && SIZE >= 2 && SIZE <= 128) ? 1 : -1];
+
+  public:
+    MidiEventRing() {
+      clear();
+    }
+
+    /*
+     * Empties the ring and resets the statistics.
+     * Call only while neither side is using the ring.
+     */
+    void clear() {
+      _head = 0;
+      _tail = 0;
+      _isClosed = false;
+      _highWater = 0;
+      _underruns = 0;
+      _isDry = true;  // not yet an underrun: nothing has been taken.
+    }
+
+    /*
+     * Producer: adds a copy of the given event to the ring.
+     * Returns true if successful; false if the ring is full.
+     */
+    boolean push(const MidiTimedEvent& event) {
+      byte head = _head;
+      byte count = (byte) (head - _tail);
+      if (count >= SIZE) {
+        return false;
+      }
+
+      _events[head & (SIZE - 1)] = event;
+      barrier();
+      _head = (byte) (head + 1);
+
+      if (count + 1 > _highWater) {
+        _highWater = (byte) (count + 1);
+      }
+      return true;
+    }
+
+    /*
+     * Producer: says that no more events will be pushed,
+     * so an empty ring is no longer counted as an underrun.
+     */
+    void close() {
+      _isClosed = true;
+    }
+
+    /*
+     * Consumer: returns a pointer to the oldest event in the ring,
+     * without removing it, or 0 if the ring is empty.
+     * Finding the ring empty, after it last had an event,
+     * counts as an underrun, unless close() was called.
+     */
+    const MidiTimedEvent *peek() {
+      byte tail = _tail;
+      if (tail == _head) {
+        countUnderrun();
+        return 0;
+      }
+      _isDry = false;
+      barrier();
+      return &_events[tail & (SIZE - 1)];
+    }
+
+    /*
+     * Consumer: removes the oldest event from the ring.
+     *  pEvent = where to copy the event, or 0 to just discard it.
+     * Returns true if successful; false if the ring is empty.
+     */
+    boolean pop(MidiTimedEvent *pEvent = 0) {
+      byte tail = _tail;
+      if (tail == _head) {
+        countUnderrun();
+        return false;
+      }
+      _isDry = false;
+      barrier();
+      if (pEvent != 0) {
+        *pEvent = _events[tail & (SIZE - 1)];
+      }
+      barrier();
+      _tail = (byte) (tail + 1);
+      return true;
+    }
+
+    /*
+     * Returns the number of events in the ring.
+     * Exact when called by the consumer or producer;
+     * for the other side, the ring may change at any time.
+     */
+    int getCount() {
+      return (byte) (_head - _tail);
+    }
+
+    boolean isEmpty() {
+      return _head == _tail;
+    }
+
+    boolean isFull() {
+      return ((byte) (_head - _tail)) >= SIZE;
+    }
+
+    /*
+     * Returns true if close() has been called
+     * and the consumer has removed every event.
+     */
+    boolean isFinished() {
+      return _isClosed && _head == _tail;
+    }
+
+    /*
+     * Returns the most events that have been in the ring at once.
+     */
+    int getHighWater() {
+      return _highWater;
+    }
+
+    /*
+     * Returns the number of times the consumer found the ring empty,
+     * after it last had an event, before close() was called:
+     * the number of times the producer fell behind.
+     * Safe to call from the producer: re-reads until it gets
+     * a value the consumer didn't change while it was being read.
+     */
+    unsigned long getUnderruns() {
+      unsigned long underruns;
+      do {
+        underruns = _underruns;
+      } while (underruns != _underruns);
+      return underruns;
+    }
+
+    int getSize() {
+      return SIZE;
+    }
+};
+#endif
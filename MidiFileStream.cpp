@@ -8,266 +8,2604 @@
  */
 
 #include <MidiFileStream.h>
+#include <MidiBufferPool.h>
 //#define MIDIFILESTREAM_DEBUG 1
 //#define MIDIFILESTREAM_VERBOSE 1
 
 /*
- * Returns the Midi file format:
- * 0 = single track
- * 1 = simultaneously-played tracks
- *   (or more often, 1 header track and 1 real track)
- * 2 = sequentially-played tracks.
+ * Channel event codes (see CH_*) that have only one parameter.
  */
-int MidiFileStream::getFormat() {
-  return _format;
-}
+static const unsigned int CH_ONE_PARAM_MASK =
+    CH_MASK(CH_PROG_CHANGE) | CH_MASK(CH_CHAN_AFTERTOUCH);
 
 /*
- * Returns the number of tracks in the file,
- * as reported by the file header.
+ * Adds n to the given field of _stats, if MIDIFILESTREAM_STATS
+ * is defined; otherwise does nothing.
  */
-int MidiFileStream::getNumTracks() {
-  return _numTracks;
-}
+#ifdef MIDIFILESTREAM_STATS
+#define MIDIFILESTREAM_COUNT(field, n) (_stats.field += (n))
+#else
+#define MIDIFILESTREAM_COUNT(field, n) ((void) 0)
+#endif
 
 /*
- * Returns the ticks per beat, from the Midi header.
+ * True if the decoding of the given event type (ET_*) is compiled in.
+ * A constant, so the compiler drops the code of the others.
+ * See MIDIFILESTREAM_EVENTS.
  */
-int MidiFileStream::getTicksPerBeat() {
-  return _ticksPerBeat;
-}
+#define MIDIFILESTREAM_DECODES(et) ((MIDIFILESTREAM_EVENTS & ET_MASK(et)) != 0)
 
+#ifdef MIDIFILESTREAM_COMPACT
 /*
- * Returns the number of bytes remaining to be read
- * from the current chunk
+ * The payload buffer used if the caller hasn't supplied one:
+ * room for only the terminating null.
  */
-long MidiFileStream::getChunkBytesLeft() {
-  return _bytesLeft;
+static char noPayload[1];
+#endif
+
+MidiFileStream::MidiFileStream() {
+  _pStream = 0;
+  _pBuffer = 0;
+  _pReadBuffer = 0;
+  _bufferSize = 0;
+#if defined(__AVR__)
+  _pFlash = 0;
+  _flashLength = 0;
+#endif
+  _bufferLength = 0;
+  _bufferIndex = 0;
+  _readBlock = 0;
+  _seekStream = 0;
+  _streamPos = 0;
+  _pPool = 0;
+  _poolReadSize = 0;
+  _poolPayloadSize = 0;
+  _isBorrowed = false;
+#ifdef MIDIFILESTREAM_PREFETCH
+  _startRead = 0;
+  _finishRead = 0;
+  _pPrefetch = 0;
+  _isPrefetching = false;
+#endif
+  _bytesLeft = -1;
+  _format = -1;
+  _numTracks = -1;
+  _ticksPerBeat = 0;
+  _division = 0;
+  _framesPerSecond = 0;
+  _ticksPerFrame = 0;
+  _tempoTicks = 0;
+  _runningStatus = 0;
+  _pCursor = 0;
+  _pMerge = 0;
+  _mergeCount = 0;
+  _mergeTicks = 0;
+  _eventType = ET_UNK;
+  _eventDeltaTicks = -1;
+  _eventTicks = 0;
+  _eventTrack = 0;
+  _nextTrack = 0;
+  clearError();
+  _isResync = false;
+  _resyncBytes = 0;
+  _resyncCount = 0;
+  _eventMask = ET_MASK_ALL & MIDIFILESTREAM_EVENTS;
+  _channelMask = CH_MASK_ALL;
+  _payloadByReference = false;
+  _payloadPosition = 0;
+  _payloadLength = 0;
+  _pTempoPoints = 0;
+  _maxTempoPoints = 0;
+  _numTempoPoints = 0;
+  _tempoIndex = 0;
+  resetTempoMap();
+#ifdef MIDIFILESTREAM_COMPACT
+  _pPayload = noPayload;
+  _payloadSize = sizeof(noPayload);
+#endif
+#ifdef MIDIFILESTREAM_STATS
+  resetStats();
+#endif
 }
 
 /*
- * Returns the number of ticks between the previous event
- * and the current event
+ * Sets an optional read-ahead buffer, so that events are read
+ * from RAM instead of one Stream::read() call per byte.
+ * Call this before calling begin().
+ *  pBuffer = the buffer to use, or 0 to read the stream one byte at a time.
+ *    The caller owns this buffer and must keep it until end() is called.
+ *  bufferSize = size (bytes) of pBuffer.
+ *    A multiple of the SD card sector size (512) works well,
+ *    but smaller buffers (e.g., 64 bytes) also help.
+ *  readBlock = optional function to read a block from the stream,
+ *    such as one that calls File::read(buf, n).
+ *    If 0, the buffer is filled by Stream::readBytes().
  */
-long MidiFileStream::getEventDeltaTicks() {
-  return _eventDeltaTicks;
+void MidiFileStream::setReadBuffer(byte *pBuffer, int bufferSize, readBlock_t readBlock) {
+  cancelPrefetch();
+  _pReadBuffer = pBuffer;
+  _bufferSize = bufferSize;
+  if (_pReadBuffer == 0 || _bufferSize <= 0) {
+    _pReadBuffer = 0;
+    _bufferSize = 0;
+  }
+  _pBuffer = _pReadBuffer;
+  _readBlock = readBlock;
+  _bufferLength = 0;
+  _bufferIndex = 0;
 }
 
 /*
- * Returns the type of the current event.
- * See ET_*.
+ * Sets an optional function that moves the stream to a given position.
+ * Needed by selectTrack() to jump between tracks.
+ * Without it, the stream can only be skipped forward, by reading.
+ * Call this before calling begin().
  */
-event_t MidiFileStream::getEventType() {
-  return _eventType;
+void MidiFileStream::setSeekFunction(seekStream_t seekStream) {
+  _seekStream = seekStream;
 }
 
 /*
- * Returns a pointer to the data of the current event.
- * To Use:
- *  Suppose the event type is ET_KEY_SIGN.
- *  The corresponding _eventData field is keySign.
- *  So, to access the numSharps field of the event:
- *    int nSharps = midiFile.getEventDataP()->keySign.numSharps;
+ * Sets optional functions that read the stream in the background,
+ * so that the next block of the file is read while this one
+ * is decoded, hiding the time a read takes (e.g., an SD card
+ * that now and then takes several milliseconds).
+ * Needs a read-ahead buffer (see setReadBuffer()), which is split
+ * into two halves: while readEvent() reads from one, the other
+ * is being filled.  So make the buffer twice the block size
+ * (e.g., 1024 bytes for 512-byte SD card sectors).
+ *  startRead = starts reading a block, or 0 to read as usual.
+ *  finishRead = waits for that read to finish.
+ *  See startRead_t and finishRead_t.
+ * Without #define MIDIFILESTREAM_PREFETCH, or on an AVR,
+ * this does nothing.
+ * Call this before calling begin().
  */
-union eventData *MidiFileStream::getEventDataP() {
-  return &_eventData;
+void MidiFileStream::setPrefetch(startRead_t startRead, finishRead_t finishRead) {
+#ifdef MIDIFILESTREAM_PREFETCH
+  cancelPrefetch();
+  _startRead = startRead;
+  _finishRead = finishRead;
+  if (_startRead == 0 || _finishRead == 0) {
+    _startRead = 0;
+    _finishRead = 0;
+  }
+#else
+  (void) startRead;
+  (void) finishRead;
+#endif
 }
 
 /*
- * Initialize based on the given, open Midi file stream,
- * and read the Midi file header chunk from that stream.
- * Returns true if successful; false if not successful.
+ * Sets an optional pool to borrow the read-ahead buffer and
+ * (with MIDIFILESTREAM_COMPACT) the payload buffer from,
+ * instead of this object keeping buffers of its own.
+ * begin() borrows the buffers, and end() gives them back,
+ * so several MidiFileStream objects can share a pool
+ * that's smaller than all their buffers together.
+ * If the pool doesn't have room, begin() fails, with ER_BUFFER.
+ * This replaces any setReadBuffer() and setPayloadBuffer() buffers.
+ * Call this before calling begin().
+ *  pPool = the pool, or 0 to stop using one.
+ *    The caller owns the pool and must keep it until end() is called.
+ *  readBufferSize = size (bytes) of the read-ahead buffer,
+ *    or 0 for none.  See setReadBuffer().
+ *  payloadBufferSize = size (bytes) of the payload buffer, or 0 for none.
+ *    See setPayloadBuffer().  Without MIDIFILESTREAM_COMPACT,
+ *    the payload is in the event data, so this is ignored.
+ *  readBlock = optional function to read a block from the stream.
+ *    See setReadBuffer().
  */
-boolean MidiFileStream::begin(Stream& stream) { 
-  _pStream = &stream;
-  _bytesLeft = -1;
-  _format = -1;
-  _numTracks = -1;
-  _ticksPerBeat = 0;
-  _runningStatus = 0;
-  _eventType = ET_UNK;
-  _eventDeltaTicks = -1;
+void MidiFileStream::setBufferPool(MidiBufferPool *pPool, int readBufferSize,
+    int payloadBufferSize, readBlock_t readBlock) {
+  giveBackBuffers();
+  setReadBuffer(0, 0, readBlock);
+#ifdef MIDIFILESTREAM_COMPACT
+  setPayloadBuffer(0, 0);
+#endif
+  _pPool = pPool;
+  _poolReadSize = (readBufferSize > 0) ? readBufferSize : 0;
+  _poolPayloadSize = (payloadBufferSize > 0) ? payloadBufferSize : 0;
+}
 
-  chunk_t chunkType;
- 
-  // Open the header chunk
-  chunkType = openChunk();
-  if (chunkType != CT_MTHD) {
-#ifdef MIDIFILESTREAM_DEBUG
-    Serial.print("Expected chunk type CT_MTHD, instead read type ");
-    Serial.println((int) chunkType);
+/*
+ * Borrows the buffers set by setBufferPool(), for begin().
+ * Gives back any still borrowed first.
+ *  isReadBuffer = true if the file is read through
+ *    the read-ahead buffer, so it needs one.
+ * Returns true if successful, or there's no pool;
+ * false if the pool hasn't room for them.
+ */
+boolean MidiFileStream::borrowBuffers(boolean isReadBuffer) {
+  byte *pReadBuffer;
+#ifdef MIDIFILESTREAM_COMPACT
+  char *pPayload;
 #endif
-    return false;
+
+  giveBackBuffers();
+  if (_pPool == 0) {
+    return true;
   }
-  if (_bytesLeft != 6) {
+  clearError();
+  
+  _isBorrowed = true;
+  if (isReadBuffer && _poolReadSize > 0) {
+    pReadBuffer = (byte *) _pPool->borrow(_poolReadSize);
+    if (pReadBuffer == 0) {
+      giveBackBuffers();
+      setError(ER_BUFFER);
 #ifdef MIDIFILESTREAM_DEBUG
-    Serial.print("Expected chunk length of 6, instead read ");
-    Serial.println(_bytesLeft);
+      Serial.println("No room in the buffer pool for the read-ahead buffer.");
 #endif
-    return false;
+      return false;
+    }
+    setReadBuffer(pReadBuffer, _poolReadSize, _readBlock);
   }
-
-  _format = (int) readFixedLong(2);
-  if (_format < 0) {
+#ifdef MIDIFILESTREAM_COMPACT
+  if (_poolPayloadSize > 0) {
+    pPayload = (char *) _pPool->borrow(_poolPayloadSize);
+    if (pPayload == 0) {
+      giveBackBuffers();
+      setError(ER_BUFFER);
 #ifdef MIDIFILESTREAM_DEBUG
-    Serial.println("Error reading header format");
+      Serial.println("No room in the buffer pool for the payload buffer.");
 #endif
-    return false;
+      return false;
+    }
+    setPayloadBuffer(pPayload, _poolPayloadSize);
   }
-#ifdef MIDIFILESTREAM_VERBOSE
-  Serial.print("Format type: ");
-  Serial.println(_format);
 #endif
+  return true;
+}
 
-  _numTracks = (int) readFixedLong(2);
-  if (_numTracks < 0) {
-#ifdef MIDIFILESTREAM_DEBUG
-    Serial.println("Error reading header number of tracks");
+/*
+ * Gives back to the pool any buffers borrowed by borrowBuffers().
+ */
+void MidiFileStream::giveBackBuffers() {
+  if (!_isBorrowed) {
+    return;
+  }
+  _isBorrowed = false;
+  _pPool->giveBack(_pReadBuffer);
+  setReadBuffer(0, 0, _readBlock);
+#ifdef MIDIFILESTREAM_COMPACT
+  _pPool->giveBack(_pPayload);
+  setPayloadBuffer(0, 0);
 #endif
-    return false;
+}
+
+#ifdef MIDIFILESTREAM_COMPACT
+/*
+ * Sets the buffer that the data of variable-length events
+ * (Sysex and text Meta events) is read into.
+ * The bytes field of those events points to this buffer.
+ * Without a buffer, those events are read with a length of 0.
+ *  pBuffer = the buffer to use, or 0 for none.
+ *    The caller owns this buffer.  Several MidiFileStream objects
+ *    may share one buffer if the caller is finished with
+ *    the data of one event before reading the next.
+ *  bufferSize = size (bytes) of pBuffer,
+ *    including room for the terminating null.
+ */
+void MidiFileStream::setPayloadBuffer(char *pBuffer, int bufferSize) {
+  _pPayload = pBuffer;
+  _payloadSize = bufferSize;
+  if (_pPayload == 0 || _payloadSize <= 0) {
+    _pPayload = noPayload;
+    _payloadSize = sizeof(noPayload);
   }
-#ifdef MIDIFILESTREAM_VERBOSE
-  Serial.print("Number of tracks: ");
-  Serial.println(_numTracks);
+}
 #endif
 
-  _ticksPerBeat = (int) readFixedLong(2);
-  if (_ticksPerBeat < 0) {
+/*
+ * Sets whether readEvent() copies the data of variable-length events
+ * (Sysex and text Meta events) into the event's bytes field.
+ *  byReference = false (the default) to copy the data,
+ *    truncated to fit the bytes field.
+ *    true to copy nothing: the event's length field is set to 0,
+ *    the data is skipped, and readPayload() reads it on demand.
+ * Either way, getPayloadLength() returns the full, untruncated length.
+ */
+void MidiFileStream::setPayloadByReference(boolean byReference) {
+  _payloadByReference = byReference;
+}
+
+/*
+ * Returns the stream position of the data of the current
+ * variable-length event (Sysex or text Meta event).
+ * See getStreamPosition().
+ */
+unsigned long MidiFileStream::getPayloadPosition() {
+  return _payloadPosition;
+}
+
+/*
+ * Returns the full (untruncated) number of data bytes
+ * of the current variable-length event (Sysex or text Meta event),
+ * or 0 if the current event has no variable-length data.
+ */
+long MidiFileStream::getPayloadLength() {
+  return _payloadLength;
+}
+
+/*
+ * Reads part of the data of the current variable-length event
+ * (Sysex or text Meta event), no matter how long that data is
+ * and whether or not it was copied by readEvent().
+ * Does not change the position of the next event to read.
+ *  pDest = the buffer to read into.
+ *    No null terminator is added.
+ *  maxLength = the maximum number of bytes to read.
+ *  offset = the index of the first data byte to read:
+ *    0 = the first byte of the data.
+ * Returns the number of bytes read, or -1 if an error occurs.
+ * Reading data that is no longer in the read-ahead buffer
+ * requires a seek function. See setSeekFunction().
+ */
+long MidiFileStream::readPayload(char *pDest, long maxLength, long offset) {
+  unsigned long resumePosition; // where the next event is.
+  long bytesRead;
+
+  if (offset < 0 || offset >= _payloadLength || maxLength <= 0) {
+    return 0;
+  }
+  if (maxLength > _payloadLength - offset) {
+    maxLength = _payloadLength - offset;
+  }
+  
+  resumePosition = getStreamPosition();
+  if (!seekStream(_payloadPosition + (unsigned long) offset)) {
+    setError(ER_SEEK);
 #ifdef MIDIFILESTREAM_DEBUG
-    Serial.println("Unsupported SMPTE frames-per-second format.");
+    Serial.println("Error seeking to event data");
 #endif
-    return false;
+    return -1;
   }
-#ifdef MIDIFILESTREAM_VERBOSE
-  Serial.print("Ticks per Beat = ");
-  Serial.println(_ticksPerBeat);
-#endif
-  
-  if (_bytesLeft > 0) {
+  bytesRead = readStreamBytes(pDest, maxLength);
+  if (!seekStream(resumePosition)) {
+    setError(ER_SEEK);
 #ifdef MIDIFILESTREAM_DEBUG
-    Serial.print("INTERNAL ERROR: header has ");
-    Serial.print(_bytesLeft);
-    Serial.println(" too many bytes.");
+    Serial.println("Error seeking back from event data");
 #endif
-    return false;
+    return -1;
   }
+  
+  return bytesRead;
+}
 
-  return true;
+/*
+ * Sets an optional table to hold the tempo map:
+ * the tempo changes (ET_TEMPO events) read so far,
+ * used by getEventTimeMicros() and ticksToMicros().
+ *
+ * Without a table, only the latest tempo is kept,
+ * which works if events are read in time order:
+ * a format 0 file, or all tracks merged (see beginMerge()).
+ * With a table, the tempo changes of one track (normally
+ * the first track of a format 1 file) also apply to events
+ * of the other tracks that are read later.
+ * Call this before calling begin().
+ *  pPoints = the table, or 0 for none.
+ *    The caller owns this table.
+ *  maxPoints = the number of elements in pPoints[].
+ *    Tempo changes beyond that are not recorded.
+ */
+void MidiFileStream::setTempoMap(MidiTempoPoint *pPoints, int maxPoints) {
+  _pTempoPoints = pPoints;
+  _maxTempoPoints = maxPoints;
+  if (_pTempoPoints == 0 || _maxTempoPoints <= 0) {
+    _pTempoPoints = 0;
+    _maxTempoPoints = 0;
+  }
+  resetTempoMap();
 }
 
 /*
- * Closes the object.
- * Note: the caller is responsible for closing
- * the corresponding Midi Stream.
+ * Returns the number of tempo changes in the tempo map,
+ * counting the default tempo at the start of the file.
  */
-void MidiFileStream::end() {
-  _pStream = 0;
-  _bytesLeft = -1;
-  _format = -1;
-  _numTracks = -1;
-  _ticksPerBeat = 0;
-  _runningStatus = 0;
-  _eventType = ET_UNK;
-  _eventDeltaTicks = -1;
- 
+int MidiFileStream::getTempoPointCount() {
+  if (_pTempoPoints == 0) {
+    return 1;
+  }
+  return _numTempoPoints;
 }
 
 /*
- * Reads the chunk type and (if the chunk exists) its length.
- * sets the length of the chunk, _bytesLeft.
- * Returns the chunk type. See CT_*.
+ * Returns the time, in microseconds from the start of the file,
+ * of the given absolute ticks, based on the tempo changes read so far.
+ * Like micros(), the time wraps around after about 70 minutes.
  */
-chunk_t MidiFileStream::openChunk() {
-  const char mthd[] = { 'M', 'T', 'h', 'd' };
-  const char mtrk[] = { 'M', 'T', 'r', 'k' };
-  char sig[4]; // chunk signature
-  int bint;
-  int i;
+unsigned long MidiFileStream::ticksToMicros(unsigned long ticks) {
+  MidiTempoPoint *pPoint;
+  unsigned long long product;
 
-  _bytesLeft = -1;
-  _runningStatus = 0;
-  _eventType = ET_UNK;
-  _eventDeltaTicks = -1;
-  
-  // Read the chunk signature
-  for (i = 0; i < 4; ++i) {
-    bint = _pStream->read();
-    sig[i] = (char) bint;
-    if (bint < 0) {
-      if (i == 0) {
-        return CT_END;
-      } else {
-#ifdef MIDIFILESTREAM_DEBUG
-        Serial.println("End of file reading a chunk header.");
-#endif
-        return CT_UNK;
-      }
-    }
+  pPoint = findTempoPoint(ticks);
+  if (ticks < pPoint->ticks) {
+    return pPoint->micros;
+  }
+  product = (unsigned long long) (ticks - pPoint->ticks) * pPoint->uSecPerTick;
+  return pPoint->micros + (unsigned long) (product >> pPoint->shift);
+}
+
+/*
+ * Returns the time of the current event, in microseconds
+ * from the start of the file. See ticksToMicros().
+ */
+unsigned long MidiFileStream::getEventTimeMicros() {
+  return ticksToMicros(_eventTicks);
+}
+
+/*
+ * Empties the tempo map, leaving only the default tempo
+ * at the start of the file.
+ */
+void MidiFileStream::resetTempoMap() {
+  MidiTempoPoint *pPoint;
+
+  pPoint = &_tempoPoint;
+  if (_pTempoPoints != 0) {
+    pPoint = &_pTempoPoints[0];
   }
+  _numTempoPoints = 1;
+  _tempoIndex = 0;
   
-  // Read chunk length
-  _bytesLeft = 4;  // hack so readFixedLong() can work.
-  _bytesLeft = readFixedLong(4);
-  if (_bytesLeft < 0) {
-#ifdef MIDIFILESTREAM_DEBUG
-    Serial.println("Error reading chunk length.");
-#endif
-    return CT_UNK;
+  pPoint->ticks = 0;
+  pPoint->micros = 0;
+  if (_framesPerSecond == 0) {
+    setTempoPoint(pPoint, 0, MIDI_DEFAULT_USEC_PER_BEAT);
+  } else {
+    // SMPTE time: _tempoTicks ticks per second (per 1.001 s at 29.97 frames per second).
+    setTempoPoint(pPoint, 0, (_framesPerSecond == 29) ? 1001000L : 1000000L);
   }
+}
 
-  // See if it's a header chunk
-  for (i = 0; i < 4; ++i) {
-    if (sig[i] != mthd[i]) {
-      break;
-    }
+/*
+ * Sets the tempo of the given tempo map point.
+ *  pPoint = the point to set. Its ticks must be set.
+ *  pPrevious = the point before it in the map, used to calculate
+ *    pPoint->micros, or 0 to leave pPoint->micros as it is.
+ *  uSecPerBeat = the new tempo.
+ */
+void MidiFileStream::setTempoPoint(MidiTempoPoint *pPoint, MidiTempoPoint *pPrevious,
+    long uSecPerBeat) {
+  unsigned long long product;
+  unsigned long long uSecPerTick;
+  int shift;
+
+  if (pPrevious != 0 && _tempoTicks > 0) {
+    // Calculate exactly, so errors don't build up from tempo to tempo.
+    product = (unsigned long long) (pPoint->ticks - pPrevious->ticks)
+      * (unsigned long) pPrevious->uSecPerBeat;
+    pPoint->micros = pPrevious->micros
+      + (unsigned long) (product / (unsigned long) _tempoTicks);
   }
-  if (i == 4) {
-    return CT_MTHD;
+  
+  pPoint->uSecPerBeat = uSecPerBeat;
+  pPoint->uSecPerTick = 0;
+  pPoint->shift = 0;
+  if (_tempoTicks == 0) {
+    return;
   }
   
-  // See if it's a track chunk
-  for (i = 0; i < 4; ++i) {
-    if (sig[i] != mtrk[i]) {
+  // Use as many fraction bits as fit in an unsigned long.
+  for (shift = MIDI_TEMPO_SHIFT; shift > 0; --shift) {
+    uSecPerTick = ((unsigned long long) uSecPerBeat << shift)
+      / (unsigned long) _tempoTicks;
+    if (uSecPerTick <= 0xFFFFFFFFULL) {
       break;
     }
   }
-  if (i == 4) {
-    return CT_MTRK;
+  if (shift == 0) {
+    uSecPerTick = (unsigned long) uSecPerBeat / (unsigned long) _tempoTicks;
+  }
+  pPoint->uSecPerTick = (unsigned long) uSecPerTick;
+  pPoint->shift = (byte) shift;
+}
+
+/*
+ * Adds a tempo change to the tempo map.
+ *  ticks = absolute ticks of the change.
+ *  uSecPerBeat = the new tempo.
+ */
+void MidiFileStream::addTempoPoint(unsigned long ticks, long uSecPerBeat) {
+  MidiTempoPoint previous;
+  MidiTempoPoint *pPoint;
+  int i;
+
+  if (_framesPerSecond != 0) {
+    return;  // SMPTE time doesn't depend on the tempo.
   }
   
-  // Unknown chunk type.
-#ifdef MIDIFILESTREAM_DEBUG
-  Serial.print("Unknown chunk signature:");
-  for (i = 0; i < 4; ++i) {
-    Serial.print(" ");
-    Serial.print(((int) sig[i]) & 0xFF, HEX);
+  if (_pTempoPoints == 0) {
+    // No table: replace the single, latest tempo.
+    if (ticks < _tempoPoint.ticks) {
+      return;  // out of order; we can't use it.
+    }
+    previous = _tempoPoint;
+    _tempoPoint.ticks = ticks;
+    setTempoPoint(&_tempoPoint, &previous, uSecPerBeat);
+    return;
   }
-  Serial.println();
+  
+  pPoint = findTempoPoint(ticks);
+  i = (int) (pPoint - _pTempoPoints);
+  if (pPoint->ticks == ticks) {
+    if (pPoint->uSecPerBeat == uSecPerBeat) {
+      return;  // e.g., the same track read again.
+    }
+  } else {
+    // Insert a new point after pPoint.
+    if (_numTempoPoints >= _maxTempoPoints) {
+#ifdef MIDIFILESTREAM_DEBUG
+      Serial.println("Tempo map full; tempo change ignored.");
 #endif
-  return CT_UNK;
+      return;
+    }
+    ++i;
+    memmove(&_pTempoPoints[i + 1], &_pTempoPoints[i],
+      (size_t) (_numTempoPoints - i) * sizeof(MidiTempoPoint));
+    ++_numTempoPoints;
+    _pTempoPoints[i].ticks = ticks;
+  }
   
+  // Set this point and recalculate the times of those after it.
+  setTempoPoint(&_pTempoPoints[i], (i > 0) ? &_pTempoPoints[i - 1] : 0, uSecPerBeat);
+  for (++i; i < _numTempoPoints; ++i) {
+    setTempoPoint(&_pTempoPoints[i], &_pTempoPoints[i - 1], _pTempoPoints[i].uSecPerBeat);
+  }
 }
 
 /*
- * Read the next event in the track (if any).
- * Sets _eventType, _eventDeltaTicks, and _eventData.
- * Returns ET_UNK for an error,
- * ET_END for the end of track data (not an End of Track event),
- * or an ET_* value.
+ * Returns the tempo map point in effect at the given absolute ticks.
+ * Starts looking from the most recently used point,
+ * so reading events in order costs little.
  */
-event_t MidiFileStream::readEvent() {
+MidiTempoPoint *MidiFileStream::findTempoPoint(unsigned long ticks) {
+  if (_pTempoPoints == 0) {
+    return &_tempoPoint;
+  }
+  
+  while (_tempoIndex + 1 < _numTempoPoints
+      && _pTempoPoints[_tempoIndex + 1].ticks <= ticks) {
+    ++_tempoIndex;
+  }
+  while (_tempoIndex > 0 && _pTempoPoints[_tempoIndex].ticks > ticks) {
+    --_tempoIndex;
+  }
+  return &_pTempoPoints[_tempoIndex];
+}
+
+/*
+ * Sets which events readEvent() returns.
+ * Events that are filtered out are skipped without decoding
+ * or copying their data (seeking past it, if the stream can seek);
+ * their delta ticks are added to that of the next event returned.
+ * ET_END and ET_UNK are always returned.
+ *  eventMask = the event types to return, as ET_MASK() bits.
+ *    ET_MASK_ALL returns every event type (the default).
+ *  channelMask = for ET_CHANNEL events, the channel codes
+ *    to return, as CH_MASK() bits.
+ *    CH_MASK_ALL returns every channel code (the default).
+ */
+void MidiFileStream::setEventFilter(unsigned long eventMask, unsigned int channelMask) {
+  _eventMask = eventMask & MIDIFILESTREAM_EVENTS;
+  _channelMask = channelMask;
+}
+
+/*
+ * Sets what readEvent() does with a damaged event: one that uses
+ * running status when none is active, or has a delay or length
+ * that isn't a variable-length number, or is otherwise garbled.
+ *  isResync = if false (the default), readEvent() returns ET_UNK
+ *    (or, for a damaged delay, ET_END), and the rest of the track
+ *    is lost.  If true, readEvent() instead skips ahead, within
+ *    the current chunk, to the next byte that looks like the start
+ *    of an event: a channel status byte followed by its data bytes,
+ *    or an End of Track event.  It returns that event, with the
+ *    delay of the damaged event (0 if the delay itself was damaged),
+ *    plus as usual those of any filtered-out events before it;
+ *    getEventTicks() advances by the same.  The delays of
+ *    any events in the skipped bytes are unknown, and lost.
+ *    Or it returns ET_END if the chunk ends first.  getLastError() says what
+ *    was wrong, and getResyncBytes() counts the bytes skipped.
+ * While merging (see beginMerge()), a track that ends while
+ * skipping gives an ET_NO_OP event instead of ET_END.
+ * ET_UNK is still returned if the stream itself fails.
+ */
+void MidiFileStream::setResync(boolean isResync) {
+  _isResync = isResync;
+}
+
+/*
+ * Returns the number of damaged bytes skipped since begin().
+ * See setResync().
+ */
+unsigned long MidiFileStream::getResyncBytes() {
+  return _resyncBytes;
+}
+
+/*
+ * Returns the number of damaged events skipped past since begin().
+ * See setResync().
+ */
+unsigned int MidiFileStream::getResyncCount() {
+  return _resyncCount;
+}
+
+/*
+ * Returns the Midi file format:
+ * 0 = single track
+ * 1 = simultaneously-played tracks
+ *   (or more often, 1 header track and 1 real track)
+ * 2 = sequentially-played tracks.
+ */
+int MidiFileStream::getFormat() {
+  return _format;
+}
+
+/*
+ * Returns the number of tracks in the file,
+ * as reported by the file header.
+ */
+int MidiFileStream::getNumTracks() {
+  return _numTracks;
+}
+
+/*
+ * Returns the ticks per beat, from the Midi header.
+ * Returns 0 for a file with SMPTE time; see getFramesPerSecond().
+ */
+int MidiFileStream::getTicksPerBeat() {
+  return _ticksPerBeat;
+}
+
+/*
+ * For a file with SMPTE time, returns the frames per second
+ * from the Midi header: 24, 25, 29 (meaning 30 drop-frame,
+ * i.e., 29.97 frames per second) or 30.
+ * Returns 0 for a file timed in beats (see getTicksPerBeat()).
+ *
+ * In a file with SMPTE time, ticks are a fixed fraction of a second,
+ * so Tempo events don't affect event times (see getEventTimeMicros()).
+ */
+int MidiFileStream::getFramesPerSecond() {
+  return _framesPerSecond;
+}
+
+/*
+ * For a file with SMPTE time, returns the ticks per frame
+ * from the Midi header; otherwise returns 0.
+ */
+int MidiFileStream::getTicksPerFrame() {
+  return _ticksPerFrame;
+}
+
+/*
+ * Returns the number of bytes remaining to be read
+ * from the current chunk
+ */
+long MidiFileStream::getChunkBytesLeft() {
+  return _bytesLeft;
+}
+
+/*
+ * Returns the number of ticks between the previous event
+ * and the current event
+ */
+long MidiFileStream::getEventDeltaTicks() {
+  return _eventDeltaTicks;
+}
+
+/*
+ * Returns the number of ticks from the start of the track
+ * to the current event.
+ */
+unsigned long MidiFileStream::getEventTicks() {
+  return _eventTicks;
+}
+
+/*
+ * Returns the index of the track of the current event:
+ * 0 = the first track (MTrk chunk) in the file.
+ * With track cursors (see selectTrack() and beginMerge()),
+ * that's MidiTrackCursor.track; otherwise, the number of
+ * MTrk chunks that openChunk() opened before this one.
+ */
+int MidiFileStream::getEventTrack() {
+  return _eventTrack;
+}
+
+/*
+ * Returns the type of the current event.
+ * See ET_*.
+ */
+event_t MidiFileStream::getEventType() {
+  return _eventType;
+}
+
+/*
+ * Returns a pointer to the data of the current event.
+ * To Use:
+ *  Suppose the event type is ET_KEY_SIGN.
+ *  The corresponding _eventData field is keySign.
+ *  So, to access the numSharps field of the event:
+ *    int nSharps = midiFile.getEventDataP()->keySign.numSharps;
+ */
+union eventData *MidiFileStream::getEventDataP() {
+  return &_eventData;
+}
+
+/*
+ * Copies the current event into the given compact event.
+ * See MidiTimedEvent.
+ */
+void MidiFileStream::getTimedEvent(MidiTimedEvent *pEvent) {
+  pEvent->time = getEventTimeMicros();
+  pEvent->type = _eventType;
+  pEvent->track = _eventTrack;
+  getEventBytes(pEvent->data);
+}
+
+/*
+ * Stores the three data bytes of the current event,
+ * as described for MidiTimedEvent.data[].
+ */
+void MidiFileStream::getEventBytes(byte *pBytes) {
+  if (_eventType == ET_CHANNEL) {
+    pBytes[0] = (byte) ((_eventData.channel.code << 4) | _eventData.channel.chan);
+    pBytes[1] = (byte) _eventData.channel.param1;
+    pBytes[2] = (byte) _eventData.channel.param2;
+  } else if (_eventType == ET_TEMPO) {
+    pBytes[0] = (byte) (_eventData.tempo.uSecPerBeat >> 16);
+    pBytes[1] = (byte) (_eventData.tempo.uSecPerBeat >> 8);
+    pBytes[2] = (byte) _eventData.tempo.uSecPerBeat;
+  } else {
+    pBytes[0] = 0;
+    pBytes[1] = 0;
+    pBytes[2] = 0;
+  }
+}
+
+/*
+ * Returns why the last call failed (see ER_*), or ER_NONE.
+ * begin(), openChunk(), readEvent(), selectTrack() and loadIndex()
+ * start with no error, so after one of them returns a failure
+ * (false, -1, CT_UNK or ET_UNK), this says what went wrong;
+ * getErrorPosition() and getErrorTrack() say where.
+ * Calls built on those (e.g., probe() and seekToTick())
+ * report the first, most specific error they ran into.
+ * readEvent() may also return ET_END with ER_VARIABLE set,
+ * if the track ended in a damaged delay.
+ * The codes cost nothing until an error occurs, so unlike
+ * #define MIDIFILESTREAM_DEBUG they can be left on in the field,
+ * e.g., to save the codes and print them later.
+ */
+errcode_t MidiFileStream::getLastError() {
+  return _errorCode;
+}
+
+/*
+ * Returns the stream position (byte offset from the start of the file)
+ * at which the last error was found: normally just past the bytes
+ * that were wrong.  See getLastError().
+ */
+unsigned long MidiFileStream::getErrorPosition() {
+  return _errorPosition;
+}
+
+/*
+ * Returns the index of the track being read when the last error
+ * was found (as getEventTrack()).  See getLastError().
+ */
+int MidiFileStream::getErrorTrack() {
+  return _errorTrack;
+}
+
+/*
+ * Forgets the last error: getLastError() returns ER_NONE.
+ */
+void MidiFileStream::clearError() {
+  _errorCode = ER_NONE;
+  _errorTrack = 0;
+  _errorPosition = 0;
+}
+
+/*
+ * Records an error, and where it was found, for getLastError().
+ * Keeps the first error since the error was cleared, because
+ * the errors that follow from it (e.g., "error reading the track"
+ * after "running status not active") say less.
+ */
+void MidiFileStream::setError(errcode_t code) {
+  if (_errorCode != ER_NONE) {
+    return;
+  }
+  _errorCode = code;
+  _errorTrack = _eventTrack;
+  _errorPosition = getStreamPosition();
+}
+
+#ifdef MIDIFILESTREAM_STATS
+/*
+ * Returns the counts of work done by this MidiFileStream
+ * since it was constructed or resetStats() was last called.
+ * Only with #define MIDIFILESTREAM_STATS.
+ */
+const MidiFileStats *MidiFileStream::getStats() {
+  return &_stats;
+}
+
+/*
+ * Sets all the counts returned by getStats() to zero.
+ */
+void MidiFileStream::resetStats() {
+  memset(&_stats, 0, sizeof(_stats));
+}
+#endif
+
+/*
+ * Initialize based on the given, open Midi file stream,
+ * and read the Midi file header chunk from that stream.
+ * Returns true if successful; false if not successful.
+ */
+boolean MidiFileStream::begin(Stream& stream) { 
+  cancelPrefetch();
+  if (!borrowBuffers(true)) {
+    return false;
+  }
+  _pStream = &stream;
+  _pBuffer = _pReadBuffer;
+#if defined(__AVR__)
+  _pFlash = 0;
+#endif
+  _streamPos = 0;
+  _bufferLength = 0;
+  _bufferIndex = 0;
+  
+  if (!readHeader()) {
+    giveBackBuffers();
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Initialize based on a whole Midi file already in RAM
+ * (or, other than on an AVR, memory-mapped flash),
+ * and read the Midi file header chunk.
+ * The file is read in place, as though it were one large
+ * read-ahead buffer, so there are no Stream calls at all,
+ * and seeking (e.g., selectTrack()) needs no seek function.
+ *  pData = the file contents.  The caller owns this memory
+ *    and must keep it until end() is called.
+ *  length = size (bytes) of pData.  Must fit in an int.
+ * Returns true if successful; false if not successful.
+ */
+boolean MidiFileStream::begin(const byte *pData, unsigned long length) {
+  if (pData == 0 || length != (unsigned long) (int) length) {
+    return false;
+  }
+  
+  cancelPrefetch();
+  if (!borrowBuffers(false)) {
+    return false;
+  }
+  _pStream = 0;
+  _pBuffer = pData;
+#if defined(__AVR__)
+  _pFlash = 0;
+#endif
+  _streamPos = length;
+  _bufferLength = (int) length;
+  _bufferIndex = 0;
+  
+  if (!readHeader()) {
+    giveBackBuffers();
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Initialize based on a whole Midi file in flash (PROGMEM),
+ * and read the Midi file header chunk.
+ * On an AVR, flash must be read with the pgm_read_*() functions,
+ * so the file is copied a block at a time into the read-ahead
+ * buffer (see setReadBuffer()), or read one byte at a time
+ * if there is none.  On other processors flash is
+ * addressable, so this is the same as begin(pData, length).
+ *  pData = the PROGMEM file contents.
+ *  length = size (bytes) of pData.
+ * Returns true if successful; false if not successful.
+ */
+boolean MidiFileStream::begin_P(const byte *pData, unsigned long length) {
+#if defined(__AVR__)
+  if (pData == 0) {
+    return false;
+  }
+  
+  if (!borrowBuffers(true)) {
+    return false;
+  }
+  _pStream = 0;
+  _pBuffer = _pReadBuffer;
+  _pFlash = pData;
+  _flashLength = length;
+  _streamPos = 0;
+  _bufferLength = 0;
+  _bufferIndex = 0;
+  
+  if (!readHeader()) {
+    giveBackBuffers();
+    return false;
+  }
+  return true;
+#else
+  return begin(pData, length);
+#endif
+}
+
+/*
+ * Resets the reading state, then reads the Midi file header chunk,
+ * for begin().  The caller has already set up where bytes come from.
+ * Returns true if successful; false if not successful.
+ */
+boolean MidiFileStream::readHeader() {
+  long division;
+  
+  _bytesLeft = -1;
+  _format = -1;
+  _numTracks = -1;
+  _ticksPerBeat = 0;
+  _division = 0;
+  _framesPerSecond = 0;
+  _ticksPerFrame = 0;
+  _tempoTicks = 0;
+  _runningStatus = 0;
+  _pCursor = 0;
+  _pMerge = 0;
+  _mergeCount = 0;
+  _mergeTicks = 0;
+  _eventType = ET_UNK;
+  _eventDeltaTicks = -1;
+  _eventTicks = 0;
+  _eventTrack = 0;
+  _nextTrack = 0;
+  clearError();
+  _resyncBytes = 0;
+  _resyncCount = 0;
+
+  chunk_t chunkType;
+ 
+  // Open the header chunk
+  chunkType = openChunk();
+  if (chunkType != CT_MTHD) {
+    setError(ER_HEADER);
+#ifdef MIDIFILESTREAM_DEBUG
+    Serial.print("Expected chunk type CT_MTHD, instead read type ");
+    Serial.println((int) chunkType);
+#endif
+    return false;
+  }
+  if (_bytesLeft != 6) {
+    setError(ER_HEADER);
+#ifdef MIDIFILESTREAM_DEBUG
+    Serial.print("Expected chunk length of 6, instead read ");
+    Serial.println(_bytesLeft);
+#endif
+    return false;
+  }
+
+  _format = (int) readFixedLong(2);
+  if (_format < 0) {
+    setError(ER_HEADER);
+#ifdef MIDIFILESTREAM_DEBUG
+    Serial.println("Error reading header format");
+#endif
+    return false;
+  }
+#ifdef MIDIFILESTREAM_VERBOSE
+  Serial.print("Format type: ");
+  Serial.println(_format);
+#endif
+
+  _numTracks = (int) readFixedLong(2);
+  if (_numTracks < 0) {
+    setError(ER_HEADER);
+#ifdef MIDIFILESTREAM_DEBUG
+    Serial.println("Error reading header number of tracks");
+#endif
+    return false;
+  }
+#ifdef MIDIFILESTREAM_VERBOSE
+  Serial.print("Number of tracks: ");
+  Serial.println(_numTracks);
+#endif
+
+  division = readFixedLong(2);
+  if (division < 0) {
+    setError(ER_HEADER);
+#ifdef MIDIFILESTREAM_DEBUG
+    Serial.println("Error reading header time division");
+#endif
+    return false;
+  }
+  _division = (unsigned int) division;
+  
+  if ((_division & 0x8000) == 0) {
+    _ticksPerBeat = (int) _division;
+    _tempoTicks = _division;
+#ifdef MIDIFILESTREAM_VERBOSE
+    Serial.print("Ticks per Beat = ");
+    Serial.println(_ticksPerBeat);
+#endif
+  } else {
+    /*
+     * SMPTE time: the high byte is minus the frames per second;
+     * the low byte is the ticks per frame.
+     */
+    _framesPerSecond = (byte) (0x100 - (_division >> 8));
+    _ticksPerFrame = (byte) (_division & 0xFF);
+    if ((_framesPerSecond != 24 && _framesPerSecond != 25
+        && _framesPerSecond != 29 && _framesPerSecond != 30)
+        || _ticksPerFrame == 0) {
+      setError(ER_SMPTE);
+#ifdef MIDIFILESTREAM_DEBUG
+      Serial.print("Unsupported SMPTE frames per second: ");
+      Serial.println((int) _framesPerSecond);
+#endif
+      return false;
+    }
+    // 29 means 30 drop-frame: 30 frames per 1.001 seconds.
+    _tempoTicks = (unsigned int) ((_framesPerSecond == 29) ? 30 : _framesPerSecond)
+        * _ticksPerFrame;
+#ifdef MIDIFILESTREAM_VERBOSE
+    Serial.print("SMPTE frames per second = ");
+    Serial.print((int) _framesPerSecond);
+    Serial.print(", ticks per frame = ");
+    Serial.println((int) _ticksPerFrame);
+#endif
+  }
+  resetTempoMap();
+  
+  if (_bytesLeft > 0) {
+    setError(ER_HEADER);
+#ifdef MIDIFILESTREAM_DEBUG
+    Serial.print("INTERNAL ERROR: header has ");
+    Serial.print(_bytesLeft);
+    Serial.println(" too many bytes.");
+#endif
+    return false;
+  }
+
+  return true;
+}
+
+/*
+ * Closes the object.
+ * Note: the caller is responsible for closing
+ * the corresponding Midi Stream.
+ */
+void MidiFileStream::end() {
+  cancelPrefetch();
+  giveBackBuffers();
+  _pStream = 0;
+  _pBuffer = _pReadBuffer;
+#if defined(__AVR__)
+  _pFlash = 0;
+#endif
+  _streamPos = 0;
+  _bufferLength = 0;
+  _bufferIndex = 0;
+  _bytesLeft = -1;
+  _format = -1;
+  _numTracks = -1;
+  _ticksPerBeat = 0;
+  _division = 0;
+  _framesPerSecond = 0;
+  _ticksPerFrame = 0;
+  _tempoTicks = 0;
+  _runningStatus = 0;
+  _pCursor = 0;
+  _pMerge = 0;
+  _mergeCount = 0;
+  _mergeTicks = 0;
+  _eventType = ET_UNK;
+  _eventDeltaTicks = -1;
+  _eventTicks = 0;
+  _eventTrack = 0;
+  _nextTrack = 0;
+ 
+}
+
+/*
+ * Reads the chunk type and (if the chunk exists) its length.
+ * sets the length of the chunk, _bytesLeft.
+ * Returns the chunk type. See CT_*.
+ */
+chunk_t MidiFileStream::openChunk() {
+  const char mthd[] = { 'M', 'T', 'h', 'd' };
+  const char mtrk[] = { 'M', 'T', 'r', 'k' };
+  char sig[4]; // chunk signature
+  int bint;
+  int i;
+
+  _bytesLeft = -1;
+  _runningStatus = 0;
+  _pCursor = 0;
+  _pMerge = 0;
+  _mergeCount = 0;
+  _mergeTicks = 0;
+  _eventType = ET_UNK;
+  _eventDeltaTicks = -1;
+  _eventTicks = 0;
+  _eventTrack = 0;
+  clearError();
+  
+  // Read the chunk signature
+  for (i = 0; i < 4; ++i) {
+    bint = readStreamByte();
+    sig[i] = (char) bint;
+    if (bint < 0) {
+      if (i == 0) {
+        return CT_END;
+      } else {
+        setError(ER_CHUNK);
+#ifdef MIDIFILESTREAM_DEBUG
+        Serial.println("End of file reading a chunk header.");
+#endif
+        return CT_UNK;
+      }
+    }
+  }
+  
+  // Read chunk length
+  _bytesLeft = 4;  // hack so readFixedLong() can work.
+  _bytesLeft = readFixedLong(4);
+  if (_bytesLeft < 0) {
+    setError(ER_CHUNK);
+#ifdef MIDIFILESTREAM_DEBUG
+    Serial.println("Error reading chunk length.");
+#endif
+    return CT_UNK;
+  }
+
+  // See if it's a header chunk
+  for (i = 0; i < 4; ++i) {
+    if (sig[i] != mthd[i]) {
+      break;
+    }
+  }
+  if (i == 4) {
+    return CT_MTHD;
+  }
+  
+  // See if it's a track chunk
+  for (i = 0; i < 4; ++i) {
+    if (sig[i] != mtrk[i]) {
+      break;
+    }
+  }
+  if (i == 4) {
+    _eventTrack = _nextTrack++;
+    return CT_MTRK;
+  }
+  
+  // Unknown chunk type.
+  setError(ER_UNKNOWN_CHUNK);
+#ifdef MIDIFILESTREAM_DEBUG
+  Serial.print("Unknown chunk signature:");
+  for (i = 0; i < 4; ++i) {
+    Serial.print(" ");
+    Serial.print(((int) sig[i]) & 0xFF, HEX);
+  }
+  Serial.println();
+#endif
+  return CT_UNK;
+  
+}
+
+/*
+ * Finds the tracks of the file, for reading side by side.
+ * Call this after begin(), instead of calling openChunk().
+ * Reads only the chunk headers: the body of each chunk
+ * is skipped over, by seeking if a seek function is set.
+ *  pCursors = array of cursors to initialize, one per track.
+ *  maxCursors = the number of elements in pCursors[].
+ * Returns the number of tracks found (at most maxCursors),
+ * or -1 if an error occurs.
+ *
+ * To read a track, call selectTrack() then readEvent().
+ * Selecting a different track requires a seek function;
+ * see setSeekFunction().
+ */
+int MidiFileStream::openTracks(MidiTrackCursor *pCursors, int maxCursors) {
+  chunk_t chunkType;
+  unsigned long position;
+  int numCursors;
+
+  numCursors = 0;
+  while (numCursors < maxCursors) {
+    chunkType = openChunk();
+    if (chunkType == CT_END) {
+      break;
+    }
+    if (_bytesLeft < 0) {
+      setError(ER_CHUNK);
+#ifdef MIDIFILESTREAM_DEBUG
+      Serial.println("Error reading chunk header while finding tracks.");
+#endif
+      return -1;
+    }
+    
+    position = getStreamPosition();
+    if (chunkType == CT_MTRK) {
+      pCursors[numCursors].position = position;
+      pCursors[numCursors].bytesLeft = _bytesLeft;
+      pCursors[numCursors].ticks = 0;
+      pCursors[numCursors].runningStatus = 0;
+      pCursors[numCursors].track = (byte) numCursors;
+      ++numCursors;
+    }
+    
+    if (!skipChunk()) {
+      setError(ER_CHUNK);
+#ifdef MIDIFILESTREAM_DEBUG
+      Serial.println("Error skipping chunk while finding tracks.");
+#endif
+      return -1;
+    }
+  }
+
+  return numCursors;
+}
+
+/*
+ * Quickly finds out about a Midi file, e.g., for listing a library
+ * of songs, without reading the events of the file.
+ * Reads the header, then skips from chunk to chunk (by seeking,
+ * if a seek function is set), reading only the meta events
+ * at the start of each track, up to its first channel event:
+ * where the names and the starting tempo normally are.
+ *  stream = the open Midi file.  As with begin(),
+ *    call end() when you're done with it.
+ *  pSummary = the summary to fill in, or 0 for none
+ *    (getFormat() etc. still work after probe()).
+ *  isFullScan = if true, also read every event, to count notes
+ *    and find the duration of the song.  This reads the whole file,
+ *    and requires a read-ahead buffer or a seek function.
+ * Returns the number of tracks (MTrk chunks) found,
+ * or -1 if an error occurs.
+ */
+int MidiFileStream::probe(Stream& stream, MidiFileSummary *pSummary, boolean isFullScan) {
+  MidiTrackSummary *pTrack;
+  chunk_t chunkType;
+  int numTrackChunks;
+
+  if (pSummary != 0) {
+    pSummary->format = -1;
+    pSummary->numTracks = -1;
+    pSummary->ticksPerBeat = 0;
+    pSummary->framesPerSecond = 0;
+    pSummary->ticksPerFrame = 0;
+    pSummary->uSecPerBeat = -1;  // means "no tempo found yet".
+    pSummary->name[0] = '\0';
+    pSummary->numTrackChunks = 0;
+    pSummary->isFullScan = isFullScan;
+    pSummary->numNotes = 0;
+    pSummary->durationTicks = 0;
+    pSummary->durationMicros = 0;
+  }
+  
+  if (!begin(stream)) {
+    return -1;
+  }
+  
+  numTrackChunks = 0;
+  for (;;) {
+    chunkType = openChunk();
+    if (chunkType == CT_END) {
+      break;
+    }
+    if (_bytesLeft < 0) {
+      setError(ER_CHUNK);
+#ifdef MIDIFILESTREAM_DEBUG
+      Serial.println("Error reading chunk header while probing.");
+#endif
+      return -1;
+    }
+    
+    if (chunkType == CT_MTRK) {
+      pTrack = 0;
+      if (pSummary != 0 && pSummary->pTracks != 0
+          && numTrackChunks < pSummary->maxTracks) {
+        pTrack = &pSummary->pTracks[numTrackChunks];
+        pTrack->name[0] = '\0';
+        pTrack->length = (unsigned long) _bytesLeft;
+        pTrack->numNotes = 0;
+        pTrack->durationTicks = 0;
+      }
+      ++numTrackChunks;
+      
+      if (pSummary != 0 && !probeTrack(pSummary, pTrack, isFullScan)) {
+        setError(ER_READ);
+#ifdef MIDIFILESTREAM_DEBUG
+        Serial.println("Error reading track while probing.");
+#endif
+        return -1;
+      }
+    }
+    
+    if (!skipChunk()) {
+      setError(ER_CHUNK);
+#ifdef MIDIFILESTREAM_DEBUG
+      Serial.println("Error skipping chunk while probing.");
+#endif
+      return -1;
+    }
+  }
+  
+  if (pSummary != 0) {
+    pSummary->format = _format;
+    pSummary->numTracks = _numTracks;
+    pSummary->ticksPerBeat = _ticksPerBeat;
+    pSummary->framesPerSecond = _framesPerSecond;
+    pSummary->ticksPerFrame = _ticksPerFrame;
+    if (pSummary->uSecPerBeat < 0) {
+      pSummary->uSecPerBeat = MIDI_DEFAULT_USEC_PER_BEAT;
+    }
+    pSummary->numTrackChunks = numTrackChunks;
+    if (isFullScan) {
+      pSummary->durationMicros = ticksToMicros(pSummary->durationTicks);
+    }
+  }
+  
+  return numTrackChunks;
+}
+
+/*
+ * Reads the meta events at the start of the current track,
+ * up to its first channel event, for probe().
+ * If isFullScan, continues with scanTrack().
+ * Leaves the rest of the track for the caller to skip.
+ * Returns true if successful; false if an error occurs.
+ */
+boolean MidiFileStream::probeTrack(MidiFileSummary *pSummary,
+    MidiTrackSummary *pTrack, boolean isFullScan) {
+  char name[MIDI_SUMMARY_NAME_SIZE];
+  unsigned long position;  // position of the event about to be read.
+  long bytesLeft;          // _bytesLeft at that position.
+  long deltaTicks;
+  long length;
+  long nameLength;
+  long uSecPerBeat;
+  int status;
+  int type;
+
+  for (;;) {
+    position = getStreamPosition();
+    bytesLeft = _bytesLeft;
+    
+    deltaTicks = readVariableLong();
+    if (deltaTicks < 0) {
+      return true;  // the track ended without an End of Track event.
+    }
+    _eventTicks += deltaTicks;
+    
+    status = readChunkByte();
+    if (status < 0) {
+      return false;
+    }
+    
+    if (status < 0xF0) {
+      // The first channel event: the end of the leading meta events.
+      if (!isFullScan) {
+        return true;
+      }
+      _eventTicks -= deltaTicks;
+      _bytesLeft = bytesLeft;
+      if (!seekStream(position)) {
+        return false;
+      }
+      return scanTrack(pSummary, pTrack);
+    }
+    
+    if (status != 0xFF) {
+      // A Sysex event: skip it.
+      length = readVariableLong();
+      if (length < 0 || !skipChunkBytes(length)) {
+        return false;
+      }
+      continue;
+    }
+    
+    type = readChunkByte();
+    length = readVariableLong();
+    if (type < 0 || length < 0) {
+      return false;
+    }
+    
+    if (type == 0x03
+        && (pSummary->name[0] == '\0' || (pTrack != 0 && pTrack->name[0] == '\0'))) {
+      // Sequence/Track name: keep as much as fits.
+      nameLength = readChunkBytes(name,
+          (length < MIDI_SUMMARY_NAME_SIZE - 1) ? length : MIDI_SUMMARY_NAME_SIZE - 1);
+      name[nameLength] = '\0';
+      length -= nameLength;
+      if (pSummary->name[0] == '\0') {
+        strcpy(pSummary->name, name);
+      }
+      if (pTrack != 0 && pTrack->name[0] == '\0') {
+        strcpy(pTrack->name, name);
+      }
+      
+    } else if (type == 0x51 && length == 3) {
+      // Tempo.
+      uSecPerBeat = readFixedLong(3);
+      if (uSecPerBeat < 0) {
+        return false;
+      }
+      length = 0;
+      if (pSummary->uSecPerBeat < 0) {
+        pSummary->uSecPerBeat = uSecPerBeat;
+      }
+      addTempoPoint(_eventTicks, uSecPerBeat);
+      
+    } else if (type == 0x2F) {
+      // End of Track.
+      if (pTrack != 0 && isFullScan) {
+        pTrack->durationTicks = _eventTicks;
+      }
+      if (isFullScan && _eventTicks > pSummary->durationTicks) {
+        pSummary->durationTicks = _eventTicks;
+      }
+      return true;
+    }
+    
+    if (!skipChunkBytes(length)) {
+      return false;
+    }
+  }
+}
+
+/*
+ * Reads the rest of the current track, for a full scan by probe(),
+ * counting its notes and finding its length.
+ * Returns true if successful; false if an error occurs.
+ */
+boolean MidiFileStream::scanTrack(MidiFileSummary *pSummary, MidiTrackSummary *pTrack) {
+  unsigned long eventMask;
+  unsigned int channelMask;
+  event_t eventType;
+
+  eventMask = _eventMask;
+  channelMask = _channelMask;
+  setEventFilter(ET_MASK(ET_TEMPO) | ET_MASK(ET_CHANNEL), CH_MASK(CH_NOTE_ON));
+  
+  for (;;) {
+    eventType = readEvent();
+    if (eventType == ET_END || eventType == ET_UNK) {
+      break;
+    }
+    if (eventType == ET_CHANNEL && _eventData.channel.param2 != 0) {
+      ++pSummary->numNotes;
+      if (pTrack != 0) {
+        ++pTrack->numNotes;
+      }
+    }
+  }
+  
+  _eventMask = eventMask;
+  _channelMask = channelMask;
+  
+  if (eventType == ET_UNK) {
+    return false;
+  }
+  if (pTrack != 0) {
+    pTrack->durationTicks = _eventTicks;
+  }
+  if (_eventTicks > pSummary->durationTicks) {
+    pSummary->durationTicks = _eventTicks;
+  }
+  return true;
+}
+
+/*
+ * Switches to reading the given track.
+ * The state of the previously selected track, if any,
+ * is saved back into its cursor.
+ *  pCursor = one of the cursors set by openTracks().
+ * Returns true if successful; false if the stream can't be
+ * moved to that track (e.g., there is no seek function).
+ */
+boolean MidiFileStream::selectTrack(MidiTrackCursor *pCursor) {
+  clearError();
+  if (_pCursor != 0) {
+    saveCursor(_pCursor);
+  }
+  _pCursor = 0;
+  _bytesLeft = -1;
+  _eventType = ET_UNK;
+  _eventDeltaTicks = -1;
+
+  // The same track again (e.g., still first in the merge) needs no seek.
+  if (pCursor->position != getStreamPosition() && !seekStream(pCursor->position)) {
+    setError(ER_SEEK);
+#ifdef MIDIFILESTREAM_DEBUG
+    Serial.println("Error seeking to the selected track.");
+#endif
+    return false;
+  }
+  
+  _pCursor = pCursor;
+  _bytesLeft = pCursor->bytesLeft;
+  _eventTicks = pCursor->ticks;
+  _runningStatus = pCursor->runningStatus;
+  _eventTrack = pCursor->track;
+  
+  return true;
+}
+
+/*
+ * Saves the state of the current track into the given cursor.
+ */
+void MidiFileStream::saveCursor(MidiTrackCursor *pCursor) {
+  pCursor->position = getStreamPosition();
+  pCursor->bytesLeft = _bytesLeft;
+  pCursor->ticks = _eventTicks;
+  pCursor->runningStatus = (byte) _runningStatus;
+}
+
+/*
+ * Starts merging the given tracks into one stream of events,
+ * in order of absolute ticks.
+ * After this call, each readEvent() returns the next event
+ * of whichever track has the earliest one;
+ * getEventTrack() says which track that is,
+ * and getEventDeltaTicks() is the delay since the previous
+ * merged event, whichever track it came from.
+ * Events at the same tick are returned in track order.
+ * readEvent() returns ET_END once all the tracks have ended.
+ *
+ *  pCursors = the cursors set by openTracks().
+ *    pCursors[] is used as the merge heap, so its elements
+ *    are reordered as events are read.  A track that ends
+ *    is moved past the end of the heap, its cursor holding
+ *    where and at what ticks it ended, so pCursors[] always
+ *    holds each track's cursor once.
+ *  numCursors = the number of elements in pCursors[].
+ * Returns true if successful; false if an error occurs.
+ *
+ * Each event costs O(log numCursors) cursor comparisons,
+ * and a seek when it comes from a different track than
+ * the previous event.  Unless the new track's position is still
+ * in the read-ahead buffer, that seek discards the buffer, and
+ * the next read refills it: tracks further apart in the file
+ * than the buffer's size cost about a block read per track switch,
+ * several times the reads of reading the tracks one at a time.
+ * For SD card playback, prefer begin(pData, length) with the file
+ * in RAM, or a read-ahead buffer at least as large as the file's
+ * longest track; or convert the file ahead of time (see MidiFlatFile.h).
+ */
+boolean MidiFileStream::beginMerge(MidiTrackCursor *pCursors, int numCursors) {
+  MidiTrackCursor temp;
+  long deltaTicks;
+  int i;
+
+  _pMerge = 0;
+  _mergeCount = 0;
+  _mergeTicks = 0;
+  
+  // Read the delta ticks of the first event in each track.
+  i = 0;
+  while (i < numCursors) {
+    if (!selectTrack(&pCursors[i])) {
+      return false;
+    }
+    _pCursor = 0;
+    
+    deltaTicks = readVariableLong();
+    if (deltaTicks < 0) {
+      // Empty track: move it past the end of the heap.
+      --numCursors;
+      temp = pCursors[i];
+      pCursors[i] = pCursors[numCursors];
+      pCursors[numCursors] = temp;
+      continue;
+    }
+    _eventTicks += deltaTicks;
+    saveCursor(&pCursors[i]);
+    ++i;
+  }
+  
+  _pMerge = pCursors;
+  _mergeCount = numCursors;
+  for (i = _mergeCount / 2 - 1; i >= 0; --i) {
+    siftDown(i);
+  }
+  
+  _eventType = ET_UNK;
+  _eventDeltaTicks = -1;
+  return true;
+}
+
+/*
+ * Returns true if the next event of cursor pA comes
+ * before the next event of cursor pB.
+ */
+boolean MidiFileStream::isEarlier(MidiTrackCursor *pA, MidiTrackCursor *pB) {
+  if (pA->ticks != pB->ticks) {
+    return pA->ticks < pB->ticks;
+  }
+  return pA->track < pB->track;
+}
+
+/*
+ * Moves _pMerge[i] down the merge heap to its proper place.
+ */
+void MidiFileStream::siftDown(int i) {
+  MidiTrackCursor temp;
+  int child;
+
+  for (;;) {
+    child = 2 * i + 1;
+    if (child >= _mergeCount) {
+      break;
+    }
+    if (child + 1 < _mergeCount
+        && isEarlier(&_pMerge[child + 1], &_pMerge[child])) {
+      ++child;
+    }
+    if (!isEarlier(&_pMerge[child], &_pMerge[i])) {
+      break;
+    }
+    temp = _pMerge[i];
+    _pMerge[i] = _pMerge[child];
+    _pMerge[child] = temp;
+    i = child;
+  }
+}
+
+/*
+ * Reads the next event from the earliest track of the merge.
+ * See beginMerge().
+ */
+event_t MidiFileStream::readMergedEvent() {
+  MidiTrackCursor *pTop;
+  MidiTrackCursor temp;
+  unsigned long eventTicks; // absolute ticks of the event.
+  long deltaTicks;
+
+  do {
+    if (_mergeCount <= 0) {
+      _eventType = ET_END;
+      return _eventType;
+    }
+    
+    pTop = &_pMerge[0];
+    if (!selectTrack(pTop)) {
+      _eventType = ET_UNK;
+      return _eventType;
+    }
+    _pCursor = 0; // heap reordering would invalidate the pointer.
+    
+    eventTicks = pTop->ticks;
+    readEventData();
+    if (_eventType == ET_UNK && _isResync && resyncEvent() == ET_END) {
+      _eventType = ET_NO_OP;  // only this track has ended.
+    }
+    MIDIFILESTREAM_COUNT(numEvents[_eventType], 1);
+    
+    // Read ahead to the next event of this track, to place it in the heap.
+    deltaTicks = -1;
+    if (_eventType != ET_UNK) {
+      deltaTicks = readVariableLong();
+      if (deltaTicks < 0 && _isResync && _errorCode == ER_VARIABLE) {
+        deltaTicks = 0;  // a damaged delay: skip past it when the event is read.
+      }
+    }
+    if (deltaTicks < 0) {
+      // The track has ended (or is broken): move it past the end of the heap,
+      // keeping its final state.
+      saveCursor(pTop);
+      --_mergeCount;
+      temp = *pTop;
+      *pTop = _pMerge[_mergeCount];
+      _pMerge[_mergeCount] = temp;
+    } else {
+      _eventTicks += deltaTicks;
+      saveCursor(pTop);
+    }
+    siftDown(0);
+  } while (isFilteredOut(_eventType));
+  
+  _eventTicks = eventTicks;
+  _eventDeltaTicks = (long) (eventTicks - _mergeTicks);
+  _mergeTicks = eventTicks;
+  
+  return _eventType;
+}
+
+
+/*
+ * Reads the events of one track into memory, for mergeTracks().
+ * Unlike beginMerge(), which reads the tracks one event at a time
+ * in turn, this reads a whole track at once, so that the tracks
+ * of a large format 1 file can be decoded side by side:
+ * each by its own MidiFileStream (e.g., one per thread or core),
+ * each begun on the same file, sharing the cursors
+ * set by one openTracks().  A file in memory
+ * (see begin(pData, length)) can be shared that way as is;
+ * each MidiFileStream must have its own stream of a file.
+ *  pCursor = one of the cursors set by openTracks().
+ *  pEvents = where to store the events.  time is set to the
+ *    absolute ticks of each event, not microseconds:
+ *    the tempo changes (normally in the first track)
+ *    aren't known until the tracks are merged.
+ *  maxEvents = the number of elements in pEvents[].
+ * Returns the number of events stored, or -1 if an error occurs.
+ * If that is maxEvents, the track may have more events:
+ * call decodeTrack() again, with the same cursor, for the rest.
+ * Events are filtered as readEvent() filters them
+ * (see setEventFilter()).  Ends any merge (see beginMerge()).
+ */
+int MidiFileStream::decodeTrack(MidiTrackCursor *pCursor, MidiTimedEvent *pEvents,
+    int maxEvents) {
+  event_t eventType;
+  int count;
+
+  _pMerge = 0;
+  _mergeCount = 0;
+  if (!selectTrack(pCursor)) {
+    return -1;
+  }
+  
+  for (count = 0; count < maxEvents; ++count) {
+    eventType = readEvent();
+    if (eventType == ET_END) {
+      break;
+    }
+    if (eventType == ET_UNK) {
+      setError(ER_READ);
+#ifdef MIDIFILESTREAM_DEBUG
+      Serial.println("Error reading track while decoding.");
+#endif
+      return -1;
+    }
+    
+    pEvents[count].time = _eventTicks;
+    pEvents[count].type = eventType;
+    pEvents[count].track = _eventTrack;
+    getEventBytes(pEvents[count].data);
+  }
+  
+  saveCursor(pCursor);
+  _pCursor = 0;
+  return count;
+}
+
+/*
+ * Returns true if the next event of decoded track pA comes
+ * before the next event of decoded track pB.
+ * Events at the same tick come in track order, as in beginMerge().
+ */
+static boolean isEarlierDecoded(const MidiDecodedTrack *pA, const MidiDecodedTrack *pB) {
+  const MidiTimedEvent *pEventA;
+  const MidiTimedEvent *pEventB;
+  
+  pEventA = &pA->pEvents[pA->next];
+  pEventB = &pB->pEvents[pB->next];
+  if (pEventA->time != pEventB->time) {
+    return pEventA->time < pEventB->time;
+  }
+  return pEventA->track < pEventB->track;
+}
+
+/*
+ * Moves pHeap[i] down the heap of decoded tracks to its proper place.
+ *  count = the number of tracks in the heap.
+ */
+static void siftDownDecoded(MidiDecodedTrack *pHeap, int count, int i) {
+  MidiDecodedTrack temp;
+  int child;
+
+  for (;;) {
+    child = 2 * i + 1;
+    if (child >= count) {
+      break;
+    }
+    if (child + 1 < count
+        && isEarlierDecoded(&pHeap[child + 1], &pHeap[child])) {
+      ++child;
+    }
+    if (!isEarlierDecoded(&pHeap[child], &pHeap[i])) {
+      break;
+    }
+    temp = pHeap[i];
+    pHeap[i] = pHeap[child];
+    pHeap[child] = temp;
+    i = child;
+  }
+}
+
+/*
+ * Merges tracks decoded by decodeTrack() into one list of events,
+ * in order of absolute ticks, as beginMerge() would read them,
+ * and sets the time of each to microseconds from the start of the file.
+ * Rebuilds the tempo map (see setTempoMap()) from the ET_TEMPO events
+ * as it goes, so call this once all the tracks are decoded,
+ * on a MidiFileStream begun on the same file.
+ *  pTracks = the decoded tracks: set pEvents and numEvents
+ *    of each.  pTracks[] is used as the merge heap,
+ *    so its elements are reordered.
+ *  numTracks = the number of elements in pTracks[].
+ *  pOut = where to store the merged events.  Must not be
+ *    any of the pTracks[] events.
+ *  maxOut = the number of elements in pOut[].  To merge
+ *    every event, that's the sum of the numEvents.
+ * Returns the number of events stored.
+ *
+ * Each event costs O(log numTracks) comparisons.
+ */
+int MidiFileStream::mergeTracks(MidiDecodedTrack *pTracks, int numTracks,
+    MidiTimedEvent *pOut, int maxOut) {
+  MidiDecodedTrack temp;
+  MidiTimedEvent *pEvent;
+  long uSecPerBeat;
+  int count;
+  int i;
+
+  resetTempoMap();
+  
+  // Move the empty tracks past the end of the heap.
+  i = 0;
+  while (i < numTracks) {
+    pTracks[i].next = 0;
+    if (pTracks[i].numEvents <= 0) {
+      --numTracks;
+      temp = pTracks[i];
+      pTracks[i] = pTracks[numTracks];
+      pTracks[numTracks] = temp;
+      continue;
+    }
+    ++i;
+  }
+  for (i = numTracks / 2 - 1; i >= 0; --i) {
+    siftDownDecoded(pTracks, numTracks, i);
+  }
+  
+  for (count = 0; count < maxOut && numTracks > 0; ++count) {
+    pEvent = &pOut[count];
+    *pEvent = pTracks[0].pEvents[pTracks[0].next];
+    if (++pTracks[0].next >= pTracks[0].numEvents) {
+      --numTracks;
+      temp = pTracks[0];
+      pTracks[0] = pTracks[numTracks];
+      pTracks[numTracks] = temp;
+    }
+    siftDownDecoded(pTracks, numTracks, 0);
+    
+    // pEvent->time is still in ticks.
+    if (pEvent->type == ET_TEMPO) {
+      uSecPerBeat = ((long) pEvent->data[0] << 16)
+        | ((long) pEvent->data[1] << 8)
+        | (long) pEvent->data[2];
+      addTempoPoint(pEvent->time, uSecPerBeat);
+    }
+    pEvent->time = ticksToMicros(pEvent->time);
+  }
+  
+  return count;
+}
+
+
+/*
+ * Builds an index of the file, for seekToTick().
+ * Call this after begin(), instead of calling openChunk().
+ * Reads every track once, saving a checkpoint every ticksInterval
+ * ticks, so that seekToTick() need read only the events
+ * between a checkpoint and the position it seeks to.
+ * Also builds the tempo map (see setTempoMap()).
+ *  pIndex = the index to fill in.
+ *  ticksInterval = ticks between checkpoints in each track,
+ *    or 0 for one checkpoint per beat (per second, with SMPTE time).
+ *    If the index runs out of room for checkpoints,
+ *    the rest of the file gets none.
+ * Returns true if successful; false if an error occurs.
+ * Requires a seek function; see setSeekFunction().
+ */
+boolean MidiFileStream::buildIndex(MidiFileIndex *pIndex, unsigned long ticksInterval) {
+  MidiTrackCursor cursor;
+  MidiCheckpoint *pCheckpoint;
+  MidiTempoPoint *pPoint;
+  unsigned long nextTicks; // ticks of the next checkpoint to save.
+  event_t eventType;
+  int track;
+
+  pIndex->numCheckpoints = 0;
+  pIndex->numTracks = openTracks(pIndex->pTracks, pIndex->maxTracks);
+  if (pIndex->numTracks < 0) {
+    pIndex->numTracks = 0;
+    return false;
+  }
+  if (ticksInterval == 0) {
+    ticksInterval = (_tempoTicks > 0) ? (unsigned long) _tempoTicks : 1;
+  }
+  
+  for (track = 0; track < pIndex->numTracks; ++track) {
+    cursor = pIndex->pTracks[track];
+    if (!selectTrack(&cursor)) {
+      return false;
+    }
+    
+    nextTicks = ticksInterval;
+    for (;;) {
+      eventType = readEvent();
+      if (eventType == ET_END) {
+        break;
+      }
+      if (eventType == ET_UNK) {
+        _pCursor = 0;
+        return false;
+      }
+      if (_eventTicks < nextTicks
+          || pIndex->numCheckpoints >= pIndex->maxCheckpoints) {
+        continue;
+      }
+      
+      pCheckpoint = &pIndex->pCheckpoints[pIndex->numCheckpoints++];
+      saveCursor(&pCheckpoint->cursor);
+      pCheckpoint->cursor.track = (byte) track;
+      pPoint = findTempoPoint(_eventTicks);
+      pCheckpoint->tempoTicks = pPoint->ticks;
+      pCheckpoint->tempoMicros = pPoint->micros;
+      pCheckpoint->uSecPerBeat = pPoint->uSecPerBeat;
+      
+      while (nextTicks <= _eventTicks) {
+        nextTicks += ticksInterval;
+      }
+    }
+    _pCursor = 0;
+  }
+  
+  return true;
+}
+
+/*
+ * Positions a set of track cursors at the given absolute ticks,
+ * using the index built by buildIndex() or read by loadIndex().
+ * Each cursor is left just before the first event of its track
+ * at or after ticks, ready for selectTrack() or beginMerge().
+ *  pIndex = the index of this file.
+ *  ticks = the absolute ticks to seek to.
+ *  pCursors = the cursors to set: one per track (pIndex->numTracks).
+ * Returns true if successful; false if an error occurs.
+ *
+ * Times (see getEventTimeMicros()) are correct after seeking
+ * if there is a tempo map table (see setTempoMap()),
+ * or if the file has only one track.
+ */
+boolean MidiFileStream::seekToTick(MidiFileIndex *pIndex, unsigned long ticks,
+    MidiTrackCursor *pCursors) {
+  MidiCheckpoint *pBest;   // the latest checkpoint before ticks, of any track.
+  MidiCheckpoint *pFound;  // the latest checkpoint before ticks, of this track.
+  MidiCheckpoint *pCheckpoint;
+  int track;
+  int i;
+
+  _pMerge = 0;
+  pBest = 0;
+  
+  i = 0;
+  for (track = 0; track < pIndex->numTracks; ++track) {
+    // Find this track's latest checkpoint before the position.
+    pFound = 0;
+    for ( ; i < pIndex->numCheckpoints; ++i) {
+      pCheckpoint = &pIndex->pCheckpoints[i];
+      if (pCheckpoint->cursor.track != track) {
+        if (pCheckpoint->cursor.track > track) {
+          break;
+        }
+        continue;
+      }
+      if (pCheckpoint->cursor.ticks < ticks) {
+        pFound = pCheckpoint;
+      }
+    }
+    
+    if (pFound != 0) {
+      pCursors[track] = pFound->cursor;
+      if (pBest == 0 || pFound->cursor.ticks > pBest->cursor.ticks) {
+        pBest = pFound;
+      }
+    } else {
+      pCursors[track] = pIndex->pTracks[track];
+    }
+  }
+  
+  // Without a tempo map table, restart the tempo from the best checkpoint.
+  if (_pTempoPoints == 0) {
+    resetTempoMap();
+    if (pBest != 0) {
+      _tempoPoint.ticks = pBest->tempoTicks;
+      _tempoPoint.micros = pBest->tempoMicros;
+      setTempoPoint(&_tempoPoint, 0, pBest->uSecPerBeat);
+    }
+  }
+  
+  // Read forward from the checkpoints to the position.
+  for (track = 0; track < pIndex->numTracks; ++track) {
+    if (!selectTrack(&pCursors[track])) {
+      return false;
+    }
+    if (!advanceToTick(ticks)) {
+      _pCursor = 0;
+      return false;
+    }
+    saveCursor(&pCursors[track]);
+    _pCursor = 0;
+  }
+  
+  _eventType = ET_UNK;
+  _eventDeltaTicks = -1;
+  return true;
+}
+
+/*
+ * Reads the events of the current track that are before
+ * the given absolute ticks, stopping just before the first event
+ * at or after those ticks (or at the end of the track).
+ * Returns true if successful; false if an error occurs.
+ */
+boolean MidiFileStream::advanceToTick(unsigned long ticks) {
+  unsigned long position;  // position of the event about to be read.
+  long bytesLeft;          // _bytesLeft at that position.
+  long deltaTicks;
+
+  for (;;) {
+    position = getStreamPosition();
+    bytesLeft = _bytesLeft;
+    
+    deltaTicks = readVariableLong();
+    if (deltaTicks < 0 || _eventTicks + (unsigned long) deltaTicks >= ticks) {
+      // Put back the delta ticks; the next readEvent() reads this event.
+      _bytesLeft = bytesLeft;
+      return seekStream(position);
+    }
+    
+    _eventTicks += deltaTicks;
+    if (readEventData() == ET_UNK) {
+      return false;
+    }
+    MIDIFILESTREAM_COUNT(numEvents[_eventType], 1);
+  }
+}
+
+/*
+ * Index file format used by saveIndex() and loadIndex().
+ * All numbers are big-endian, as in a Midi file.
+ */
+static const char indexMagic[] = { 'M', 'F', 'S', 'I' };
+static const byte indexVersion = 1;
+
+/*
+ * Writes the low numBytes bytes of the given number, most significant first.
+ */
+static void writeIndexNumber(Print& out, unsigned long number, int numBytes) {
+  byte bytes[4];
+  int i;
+
+  for (i = numBytes - 1; i >= 0; --i) {
+    bytes[i] = (byte) number;
+    number >>= 8;
+  }
+  out.write(bytes, (size_t) numBytes);
+}
+
+/*
+ * Reads a numBytes-long number written by writeIndexNumber().
+ * Returns true if successful; false at end of file.
+ */
+static boolean readIndexNumber(Stream& in, unsigned long *pNumber, int numBytes) {
+  byte bytes[4];
+  int i;
+
+  if (in.readBytes((char *) bytes, (size_t) numBytes) != (size_t) numBytes) {
+    return false;
+  }
+  *pNumber = 0;
+  for (i = 0; i < numBytes; ++i) {
+    *pNumber = (*pNumber << 8) | bytes[i];
+  }
+  return true;
+}
+
+static void writeIndexCursor(Print& out, MidiTrackCursor *pCursor) {
+  writeIndexNumber(out, pCursor->position, 4);
+  writeIndexNumber(out, (unsigned long) pCursor->bytesLeft, 4);
+  writeIndexNumber(out, pCursor->ticks, 4);
+  writeIndexNumber(out, pCursor->runningStatus, 1);
+  writeIndexNumber(out, pCursor->track, 1);
+}
+
+static boolean readIndexCursor(Stream& in, MidiTrackCursor *pCursor) {
+  unsigned long n[5];
+
+  if (!readIndexNumber(in, &n[0], 4) || !readIndexNumber(in, &n[1], 4)
+      || !readIndexNumber(in, &n[2], 4) || !readIndexNumber(in, &n[3], 1)
+      || !readIndexNumber(in, &n[4], 1)) {
+    return false;
+  }
+  pCursor->position = n[0];
+  pCursor->bytesLeft = (long) n[1];
+  pCursor->ticks = n[2];
+  pCursor->runningStatus = (byte) n[3];
+  pCursor->track = (byte) n[4];
+  return true;
+}
+
+/*
+ * Writes the given index, and the tempo map, to a file.
+ * For example, save the index of SONG.MID to SONG.IDX on the SD card,
+ * so that the next time, loadIndex() can replace buildIndex().
+ *  pIndex = the index built by buildIndex().
+ *  out = the (open) file to write to.
+ * Returns true if successful; false if an error occurs.
+ */
+boolean MidiFileStream::saveIndex(MidiFileIndex *pIndex, Print& out) {
+  MidiTempoPoint *pPoint;
+  int i;
+
+  out.write((const byte *) indexMagic, sizeof(indexMagic));
+  writeIndexNumber(out, indexVersion, 1);
+  writeIndexNumber(out, (unsigned long) _format, 2);
+  writeIndexNumber(out, (unsigned long) _numTracks, 2);
+  writeIndexNumber(out, (unsigned long) _division, 2);
+  writeIndexNumber(out, (unsigned long) pIndex->numTracks, 2);
+  writeIndexNumber(out, (unsigned long) pIndex->numCheckpoints, 2);
+  writeIndexNumber(out, (unsigned long) getTempoPointCount(), 2);
+  
+  for (i = 0; i < pIndex->numTracks; ++i) {
+    writeIndexCursor(out, &pIndex->pTracks[i]);
+  }
+  for (i = 0; i < pIndex->numCheckpoints; ++i) {
+    writeIndexCursor(out, &pIndex->pCheckpoints[i].cursor);
+    writeIndexNumber(out, pIndex->pCheckpoints[i].tempoTicks, 4);
+    writeIndexNumber(out, pIndex->pCheckpoints[i].tempoMicros, 4);
+    writeIndexNumber(out, (unsigned long) pIndex->pCheckpoints[i].uSecPerBeat, 4);
+  }
+  for (i = 0; i < getTempoPointCount(); ++i) {
+    pPoint = (_pTempoPoints != 0) ? &_pTempoPoints[i] : &_tempoPoint;
+    writeIndexNumber(out, pPoint->ticks, 4);
+    writeIndexNumber(out, pPoint->micros, 4);
+    writeIndexNumber(out, (unsigned long) pPoint->uSecPerBeat, 4);
+  }
+  
+  return !out.getWriteError();
+}
+
+/*
+ * Reads an index written by saveIndex(), in place of buildIndex().
+ * Call this after begin().
+ * Also restores the tempo map, if there is a tempo map table.
+ *  pIndex = the index to fill in.  Its arrays must be
+ *    at least as large as those of the saved index.
+ *  in = the (open) index file to read from.
+ * Returns true if successful; false if the index file is damaged,
+ * too large for pIndex, or doesn't match the header of this Midi file.
+ */
+boolean MidiFileStream::loadIndex(MidiFileIndex *pIndex, Stream& in) {
+  MidiTempoPoint point;
+  char magic[sizeof(indexMagic)];
+  unsigned long n[7];
+  unsigned long numPoints;
+  int i;
+
+  clearError();
+  pIndex->numTracks = 0;
+  pIndex->numCheckpoints = 0;
+  
+  if (in.readBytes(magic, sizeof(magic)) != sizeof(magic)
+      || memcmp(magic, indexMagic, sizeof(magic)) != 0) {
+    return false;
+  }
+  for (i = 0; i < 7; ++i) {
+    if (!readIndexNumber(in, &n[i], (i == 0) ? 1 : 2)) {
+      return false;
+    }
+  }
+  if (n[0] != indexVersion || n[1] != (unsigned long) _format
+      || n[2] != (unsigned long) _numTracks
+      || n[3] != (unsigned long) _division
+      || n[4] > (unsigned long) pIndex->maxTracks
+      || n[5] > (unsigned long) pIndex->maxCheckpoints) {
+    setError(ER_INDEX);
+#ifdef MIDIFILESTREAM_DEBUG
+    Serial.println("Index file does not match the Midi file.");
+#endif
+    return false;
+  }
+  
+  for (i = 0; i < (int) n[4]; ++i) {
+    if (!readIndexCursor(in, &pIndex->pTracks[i])) {
+      return false;
+    }
+  }
+  for (i = 0; i < (int) n[5]; ++i) {
+    if (!readIndexCursor(in, &pIndex->pCheckpoints[i].cursor)
+        || !readIndexNumber(in, &pIndex->pCheckpoints[i].tempoTicks, 4)
+        || !readIndexNumber(in, &pIndex->pCheckpoints[i].tempoMicros, 4)
+        || !readIndexNumber(in, (unsigned long *) &pIndex->pCheckpoints[i].uSecPerBeat, 4)) {
+      return false;
+    }
+  }
+  
+  resetTempoMap();
+  numPoints = n[6];
+  for (i = 0; i < (int) numPoints; ++i) {
+    if (!readIndexNumber(in, &point.ticks, 4)
+        || !readIndexNumber(in, &point.micros, 4)
+        || !readIndexNumber(in, (unsigned long *) &point.uSecPerBeat, 4)) {
+      return false;
+    }
+    if (_pTempoPoints != 0 && i < _maxTempoPoints) {
+      _pTempoPoints[i] = point;
+      setTempoPoint(&_pTempoPoints[i], 0, point.uSecPerBeat);
+      _numTempoPoints = i + 1;
+    }
+  }
+  
+  pIndex->numTracks = (int) n[4];
+  pIndex->numCheckpoints = (int) n[5];
+  return true;
+}
+
+/*
+ * Read the next event in the track (if any).
+ * Sets _eventType, _eventDeltaTicks, and _eventData.
+ * Returns ET_UNK for an error,
+ * ET_END for the end of track data (not an End of Track event),
+ * or an ET_* value.
+ */
+event_t MidiFileStream::readEvent() {
+#ifdef MIDIFILESTREAM_STATS
+  unsigned long startMicros;
+  unsigned long elapsedMicros;
+  event_t eventType;
+  
+  startMicros = micros();
+  eventType = decodeEvent();
+  elapsedMicros = micros() - startMicros;
+  if (elapsedMicros > _stats.maxEventMicros) {
+    _stats.maxEventMicros = elapsedMicros;
+  }
+  return eventType;
+#else
+  return decodeEvent();
+#endif
+}
+
+/*
+ * Reads up to maxCount events, as readEvent() would,
+ * into the caller's arrays, for a program that looks at
+ * many events at once (e.g., to count notes).
+ *  pBatch = the arrays to fill.  Each must have room for
+ *    maxCount events, or be 0 to not store that field.
+ *  maxCount = the most events to read.
+ * Returns the number of events stored.  If that is less than maxCount,
+ * the events ran out: getEventType() then returns ET_END
+ * at the end of the track (or of the merged tracks),
+ * or ET_UNK if an error occurred.
+ *
+ * A channel event whose delay and data are all in the read-ahead
+ * buffer is decoded here, straight into the arrays, without
+ * the calls and checks of readEvent().  Other events (Meta and Sysex
+ * events, damaged events, and those that cross the end of the buffer),
+ * and all the events of merged tracks, are read by readEvent().
+ * Either way the events, and the state afterwards
+ * (getEventTicks(), getEventDataP(), running status and stats),
+ * are those of readEvent(): with MIDIFILESTREAM_STATS, each event
+ * decoded here is timed for maxEventMicros as readEvent() times it.
+ */
+int MidiFileStream::readEvents(MidiEventBatch *pBatch, int maxCount) {
+  byte bytes[3];
+  event_t eventType;
+  int count;
+  long filteredTicks;  // delta ticks of channel events filtered out here.
+
+  clearError();
+  filteredTicks = 0;
+  for (count = 0; count < maxCount; ) {
+#ifndef MIDIFILESTREAM_VERBOSE
+    const byte *p;       // the next unread byte of the buffer.
+    long available;      // bytes of the chunk in the buffer, from p.
+    long deltaTicks;
+    int status;
+    int i;
+#ifdef MIDIFILESTREAM_STATS
+    unsigned long startMicros;
+    unsigned long elapsedMicros;
+
+    startMicros = micros();
+#endif
+
+    p = _pBuffer + _bufferIndex;
+    available = (long) (_bufferLength - _bufferIndex);
+    if (available > _bytesLeft) {
+      available = _bytesLeft;
+    }
+
+    // Fast path: a channel event all in the buffer: at most a 4-byte delay,
+    // the status byte and 2 parameters.
+    if (_pMerge == 0 && available >= 7) {
+      i = 0;
+      deltaTicks = 0;
+      do {
+        deltaTicks = (deltaTicks << 7) | (p[i] & 0x7F);
+      } while ((p[i++] & 0x80) != 0 && i < 4);
+      if ((p[i - 1] & 0x80) != 0) {
+        status = 0xFF;  // a longer delay: let readEvent() report it.
+      } else if ((p[i] & 0x80) == 0) {
+        status = _runningStatus;  // p[i] is param1.
+      } else {
+        status = p[i++];
+      }
+
+      if ((status & 0x80) != 0 && status < 0xF0) {
+        _runningStatus = status;
+        _eventType = ET_CHANNEL;
+        _eventData.channel.code = (char) (status >> 4);
+        _eventData.channel.chan = status & 0x0F;
+        _eventData.channel.param1 = p[i++];
+        _eventData.channel.param2 = 0;
+        if (((CH_ONE_PARAM_MASK >> (status >> 4)) & 1) == 0) {
+          _eventData.channel.param2 = p[i++];
+        }
+        _bufferIndex += i;
+        _bytesLeft -= i;
+        _payloadLength = 0;
+        _eventTicks += deltaTicks;
+        filteredTicks += deltaTicks;
+        MIDIFILESTREAM_COUNT(numEvents[ET_CHANNEL], 1);
+#ifdef MIDIFILESTREAM_STATS
+        elapsedMicros = micros() - startMicros;
+        if (elapsedMicros > _stats.maxEventMicros) {
+          _stats.maxEventMicros = elapsedMicros;
+        }
+#endif
+        if (isFilteredOut(ET_CHANNEL)) {
+          continue;
+        }
+        _eventDeltaTicks = filteredTicks;
+        filteredTicks = 0;
+
+        if (pBatch->pTicks != 0) {
+          pBatch->pTicks[count] = _eventTicks;
+        }
+        if (pBatch->pTypes != 0) {
+          pBatch->pTypes[count] = ET_CHANNEL;
+        }
+        if (pBatch->pStatus != 0) {
+          pBatch->pStatus[count] = (byte) status;
+        }
+        if (pBatch->pParam1 != 0) {
+          pBatch->pParam1[count] = (byte) _eventData.channel.param1;
+        }
+        if (pBatch->pParam2 != 0) {
+          pBatch->pParam2[count] = (byte) _eventData.channel.param2;
+        }
+        ++count;
+        continue;
+      }
+    }
+#endif
+
+    eventType = readEvent();
+    if (eventType == ET_END || eventType == ET_UNK) {
+      break;
+    }
+    _eventDeltaTicks += filteredTicks;
+    filteredTicks = 0;
+
+    if (pBatch->pTicks != 0) {
+      pBatch->pTicks[count] = _eventTicks;
+    }
+    if (pBatch->pTypes != 0) {
+      pBatch->pTypes[count] = eventType;
+    }
+    getEventBytes(bytes);
+    if (pBatch->pStatus != 0) {
+      pBatch->pStatus[count] = bytes[0];
+    }
+    if (pBatch->pParam1 != 0) {
+      pBatch->pParam1[count] = bytes[1];
+    }
+    if (pBatch->pParam2 != 0) {
+      pBatch->pParam2[count] = bytes[2];
+    }
+    ++count;
+  }
+  return count;
+}
+
+/*
+ * Does the work of readEvent().
+ */
+event_t MidiFileStream::decodeEvent() {
+  clearError();
+  if (_pMerge != 0) {
+    return readMergedEvent();
+  }
+  
+  long deltaTicks;
+  long totalDeltaTicks; // delta ticks, including those of filtered-out events.
+  
+  totalDeltaTicks = 0;
+  do {
+    _eventType = ET_UNK;
+    _eventDeltaTicks = -1;
+    
+    deltaTicks = readVariableLong();
+    if (deltaTicks < 0) {
+      if (!_isResync || _errorCode != ER_VARIABLE) {
+        _eventType = ET_END;
+        return _eventType;  // normal end of track reached (or an error).
+      }
+      // A damaged delay: its ticks are lost.
+      _eventDeltaTicks = totalDeltaTicks;
+      if (resyncEvent() == ET_END) {
+        return _eventType;
+      }
+    } else {
+      _eventTicks += deltaTicks;
+      totalDeltaTicks += deltaTicks;
+      _eventDeltaTicks = totalDeltaTicks;
+      
+      readEventData();
+      if (_eventType == ET_UNK && _isResync && resyncEvent() == ET_END) {
+        return _eventType;
+      }
+    }
+    MIDIFILESTREAM_COUNT(numEvents[_eventType], 1);
+  } while (isFilteredOut(_eventType));
+  
+  return _eventType;
+}
+
+/*
+ * Returns true if the given event, just read,
+ * is not to be returned by readEvent(). See setEventFilter().
+ */
+boolean MidiFileStream::isFilteredOut(event_t eventType) {
+  if (eventType == ET_UNK || eventType == ET_END) {
+    return false;
+  }
+  if ((_eventMask & ET_MASK(eventType)) == 0) {
+    return true;
+  }
+  if (eventType == ET_CHANNEL
+      && (_channelMask & CH_MASK(_eventData.channel.code)) == 0) {
+    return true;
+  }
+  return false;
+}
+
+/*
+ * For setResync(): after a damaged event, skips ahead in the chunk
+ * to the next channel status byte that is followed by its data bytes,
+ * or to the next End of Track event, and reads that event.
+ * Sets _eventType and _eventData.
+ * Returns the event type, ET_END if the chunk ends first,
+ * or ET_UNK if the stream fails.
+ */
+event_t MidiFileStream::resyncEvent() {
+  unsigned long startPosition; // stream position of the first byte skipped.
+  unsigned long eventPosition; // stream position of the event found.
+  int params[2];
+  int numParams;
+  int bint;
+  int i;
+
+  startPosition = getStreamPosition();
+  eventPosition = startPosition;
+  _runningStatus = 0;
+  _eventType = ET_UNK;
+  
+  bint = readChunkByte();
+  while (bint >= 0) {
+    eventPosition = getStreamPosition() - 1;
+    
+    if (bint >= 0x80 && bint < 0xF0) {
+      // A channel status byte: plausible if data bytes follow it.
+      numParams = ((CH_ONE_PARAM_MASK >> (bint >> 4)) & 1) ? 1 : 2;
+      params[1] = 0;
+      for (i = 0; i < numParams; ++i) {
+        params[i] = readChunkByte();
+        if (params[i] < 0 || (params[i] & 0x80) != 0) {
+          break;
+        }
+      }
+      if (i == numParams) {
+        _runningStatus = bint;
+        _eventType = ET_CHANNEL;
+        _eventData.channel.code = (char) (bint >> 4);
+        _eventData.channel.chan = bint & 0x0F;
+        _eventData.channel.param1 = params[0];
+        _eventData.channel.param2 = params[1];
+        break;
+      }
+      bint = params[i];  // the end, or another status byte to try.
+      continue;
+    }
+    
+    if (bint == 0xFF) {
+      // Perhaps an End of Track event: FF 2F 00.
+      bint = readChunkByte();
+      if (bint == 0x2F) {
+        bint = readChunkByte();
+        if (bint == 0x00) {
+          _eventType = ET_END_TRACK;
+          break;
+        }
+      }
+      continue;
+    }
+    
+    bint = readChunkByte();
+  }
+  
+  if (_eventType == ET_UNK) {
+    eventPosition = getStreamPosition();
+    if (_bytesLeft <= 0) {
+      _eventType = ET_END;
+    }
+  } else {
+    ++_resyncCount;
+  }
+  _resyncBytes += eventPosition - startPosition;
+  MIDIFILESTREAM_COUNT(bytesSkipped, eventPosition - startPosition);
+  
+  return _eventType;
+}
+
+/*
+ * Returns the event type (ET_*) of the given Meta event type byte,
+ * or ET_NO_OP if it is not a Meta event type we know of.
+ */
+event_t MidiFileStream::metaEventType(int metaType) {
+  switch (metaType) {
+  case 0x00: return ET_SEQ_NUM;
+  case 0x01: return ET_TEXT;
+  case 0x02: return ET_COPYRIGHT;
+  case 0x03: return ET_NAME;
+  case 0x04: return ET_INSTRUMENT;
+  case 0x05: return ET_LYRIC;
+  case 0x06: return ET_MARKER;
+  case 0x07: return ET_CUE;
+  case 0x20: return ET_CHAN_PREFIX;
+  case 0x2F: return ET_END_TRACK;
+  case 0x51: return ET_TEMPO;
+  case 0x54: return ET_SMPTE_OFFSET;
+  case 0x58: return ET_TIME_SIGN;
+  case 0x59: return ET_KEY_SIGN;
+  default: return ET_NO_OP;
+  }
+}
+
+/*
+ * Reads the rest of an event, after its delta ticks.
+ * Sets _eventType and _eventData.
+ * Returns ET_UNK for an error, or an ET_* value.
+ */
+event_t MidiFileStream::readEventData() {
   int bint;
   int metaType;  // Midi byte that identifies the meta event type
   long length;
   long l;
   
   _eventType = ET_UNK;
-
-  _eventDeltaTicks = readVariableLong();
-  if (_eventDeltaTicks < 0) {
-    _eventType = ET_END;
-    return _eventType;  // normal end of track reached (or an error).
-  }
+  _payloadLength = 0;
 
 #ifdef MIDIFILESTREAM_VERBOSE  
   Serial.print(_eventDeltaTicks);
@@ -277,6 +2615,7 @@ event_t MidiFileStream::readEvent() {
   // The first byte tells what event type it is.
   bint = readChunkByte();
   if (bint < 0) {
+    setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
     Serial.println("Error reading event type byte.");
 #endif
@@ -284,6 +2623,11 @@ event_t MidiFileStream::readEvent() {
     return _eventType;
   }
   
+  // Channel events, by far the most common, are tested for first.
+  if (bint < 0xF0) {
+    return readChannelData(bint);
+  }
+  
   if ((bint == 0xF0) || (bint == 0xF7)) {
     // A Sysex event of one type or another.
     // That clears running status.
@@ -291,6 +2635,7 @@ event_t MidiFileStream::readEvent() {
     
     length = readVariableLong();
     if (length < 0) {
+      setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
       Serial.println("Error reading Sysex F0 or Sysex Esc data length");
 #endif
@@ -298,11 +2643,25 @@ event_t MidiFileStream::readEvent() {
       return _eventType;
     }
 
-    if (bint == 0xF0) {
+    // If this event is filtered out, skip its data.
+    _eventType = (bint == 0xF0) ? ET_SYSEX_F0 : ET_SYSEX_ESC;
+    if ((_eventMask & ET_MASK(_eventType)) == 0) {
+      if (!skipChunkBytes(length)) {
+        setError(ER_READ);
+#ifdef MIDIFILESTREAM_DEBUG
+        Serial.println("Error skipping Sysex data");
+#endif
+        _eventType = ET_UNK;
+      }
+      return _eventType;
+    }
+
+    if (bint == 0xF0 && MIDIFILESTREAM_DECODES(ET_SYSEX_F0)) {
       _eventType = ET_SYSEX_F0;
 
-      _eventData.sysexF0.length = readVariableBytes(length, &_eventData.sysexF0.bytes[0]);
+      _eventData.sysexF0.length = readEventBytes(length, _eventData.sysexF0.bytes);
       if (_eventData.sysexF0.length < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Sysex F0 data");
 #endif
@@ -315,11 +2674,12 @@ event_t MidiFileStream::readEvent() {
       Serial.println(_eventData.sysexF0.length);
 #endif
       
-    } else if (bint == 0xF7) {
+    } else if (bint == 0xF7 && MIDIFILESTREAM_DECODES(ET_SYSEX_ESC)) {
       _eventType = ET_SYSEX_ESC;
 
-      _eventData.sysexEsc.length = readVariableBytes(length, &_eventData.sysexEsc.bytes[0]);
+      _eventData.sysexEsc.length = readEventBytes(length, _eventData.sysexEsc.bytes);
       if (_eventData.sysexEsc.length < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Sysex Esc data");
 #endif
@@ -344,6 +2704,7 @@ event_t MidiFileStream::readEvent() {
 
     metaType = readChunkByte();
     if (metaType < 0) {
+      setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
       Serial.println("End of track reading meta event type.");
 #endif
@@ -353,6 +2714,7 @@ event_t MidiFileStream::readEvent() {
              
     length = readVariableLong();
     if (length < 0) {
+      setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
       Serial.println("Error reading Meta Event data length");
 #endif
@@ -360,12 +2722,30 @@ event_t MidiFileStream::readEvent() {
       return _eventType;
     }
     
+    // If this event is filtered out, skip its data.
+    // Tempo events are always read, for the tempo map.
+    _eventType = metaEventType(metaType);
+    if ((_eventMask & ET_MASK(_eventType)) == 0 && _eventType != ET_TEMPO) {
+      if (!skipChunkBytes(length)) {
+        setError(ER_READ);
+#ifdef MIDIFILESTREAM_DEBUG
+        Serial.println("Error skipping Meta Event data");
+#endif
+        _eventType = ET_UNK;
+      }
+      return _eventType;
+    }
+    
     switch ((char) metaType) {
       
     case (char) 0x00:  // Sequence Number
+      if (!MIDIFILESTREAM_DECODES(ET_SEQ_NUM)) {
+        break;  // not compiled in; skipped above.
+      }
       _eventType = ET_SEQ_NUM;
       
       if (length != 2) {
+        setError(ER_META_LENGTH);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.print("Garbled Meta SeqNum length: ");
         Serial.println(length);
@@ -376,6 +2756,7 @@ event_t MidiFileStream::readEvent() {
       
       l = readFixedLong(2);
       if (l < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Meta Sequence Number");
 #endif
@@ -391,10 +2772,14 @@ event_t MidiFileStream::readEvent() {
       break;
     
     case (char) 0x01: // Text
+      if (!MIDIFILESTREAM_DECODES(ET_TEXT)) {
+        break;  // not compiled in; skipped above.
+      }
       _eventType = ET_TEXT;
     
-      _eventData.text.length = readVariableBytes(length, &_eventData.text.bytes[0]);
+      _eventData.text.length = readEventBytes(length, _eventData.text.bytes);
       if (_eventData.text.length < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Meta Text data");
 #endif
@@ -409,10 +2794,14 @@ event_t MidiFileStream::readEvent() {
       break;
     
     case (char) 0x02: // Copyright
+      if (!MIDIFILESTREAM_DECODES(ET_COPYRIGHT)) {
+        break;  // not compiled in; skipped above.
+      }
       _eventType = ET_COPYRIGHT;
     
-      _eventData.copyright.length = readVariableBytes(length, &_eventData.copyright.bytes[0]);
+      _eventData.copyright.length = readEventBytes(length, _eventData.copyright.bytes);
       if (_eventData.copyright.length < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Meta Copyright data");
 #endif
@@ -427,10 +2816,14 @@ event_t MidiFileStream::readEvent() {
       break;
       
     case (char) 0x03: // Sequence/Track name
+      if (!MIDIFILESTREAM_DECODES(ET_NAME)) {
+        break;  // not compiled in; skipped above.
+      }
       _eventType = ET_NAME;
     
-      _eventData.name.length = readVariableBytes(length, &_eventData.name.bytes[0]);
+      _eventData.name.length = readEventBytes(length, _eventData.name.bytes);
       if (_eventData.name.length < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Meta Seq/Trk data");
 #endif
@@ -445,10 +2838,14 @@ event_t MidiFileStream::readEvent() {
       break;
     
     case (char) 0x04: // Instrument name
+      if (!MIDIFILESTREAM_DECODES(ET_INSTRUMENT)) {
+        break;  // not compiled in; skipped above.
+      }
       _eventType = ET_INSTRUMENT;
 
-      _eventData.instrument.length = readVariableBytes(length, &_eventData.instrument.bytes[0]);
+      _eventData.instrument.length = readEventBytes(length, _eventData.instrument.bytes);
       if (_eventData.instrument.length < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Meta Instrument Name data");
 #endif
@@ -463,10 +2860,14 @@ event_t MidiFileStream::readEvent() {
       break;
  
     case (char) 0x05: // Lyric
+      if (!MIDIFILESTREAM_DECODES(ET_LYRIC)) {
+        break;  // not compiled in; skipped above.
+      }
       _eventType = ET_LYRIC;
 
-      _eventData.lyric.length = readVariableBytes(length, &_eventData.lyric.bytes[0]);
+      _eventData.lyric.length = readEventBytes(length, _eventData.lyric.bytes);
       if (_eventData.lyric.length < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Meta Lyric data");
 #endif
@@ -481,10 +2882,14 @@ event_t MidiFileStream::readEvent() {
       break;
  
     case (char) 0x06: // Marker
+      if (!MIDIFILESTREAM_DECODES(ET_MARKER)) {
+        break;  // not compiled in; skipped above.
+      }
       _eventType = ET_MARKER;
     
-      _eventData.marker.length = readVariableBytes(length, &_eventData.marker.bytes[0]);
+      _eventData.marker.length = readEventBytes(length, _eventData.marker.bytes);
       if (_eventData.marker.length < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Meta Marker data");
 #endif
@@ -499,10 +2904,14 @@ event_t MidiFileStream::readEvent() {
       break;
  
     case (char) 0x07: // Cue Point
+      if (!MIDIFILESTREAM_DECODES(ET_CUE)) {
+        break;  // not compiled in; skipped above.
+      }
       _eventType = ET_CUE;
 
-      _eventData.cue.length = readVariableBytes(length, &_eventData.cue.bytes[0]);
+      _eventData.cue.length = readEventBytes(length, _eventData.cue.bytes);
       if (_eventData.cue.length < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Meta Cue data");
 #endif
@@ -517,9 +2926,13 @@ event_t MidiFileStream::readEvent() {
       break;
     
     case (char) 0x20: // Midi Channel Prefix
+      if (!MIDIFILESTREAM_DECODES(ET_CHAN_PREFIX)) {
+        break;  // not compiled in; skipped above.
+      }
       _eventType = ET_CHAN_PREFIX;
     
       if (length != 1) {
+        setError(ER_META_LENGTH);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.print("Garbled Meta Chan Prefix length: ");
         Serial.println(length);
@@ -530,6 +2943,7 @@ event_t MidiFileStream::readEvent() {
       
       bint = readChunkByte();
       if (bint < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Meta Chan Prefix");
 #endif
@@ -545,9 +2959,13 @@ event_t MidiFileStream::readEvent() {
       break;
       
     case (char) 0x2F: // End of Track
+      if (!MIDIFILESTREAM_DECODES(ET_END_TRACK)) {
+        break;  // not compiled in; skipped above.
+      }
       _eventType = ET_END_TRACK;
 
       if (length != 0) {
+        setError(ER_META_LENGTH);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.print("Garbled Meta End of Track length: ");
         Serial.println(length);
@@ -566,6 +2984,7 @@ event_t MidiFileStream::readEvent() {
       _eventType = ET_TEMPO;
 
       if (length != 3) {
+        setError(ER_META_LENGTH);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.print("Garbled Meta Tempo length: ");
         Serial.println(length);
@@ -576,6 +2995,7 @@ event_t MidiFileStream::readEvent() {
       
       _eventData.tempo.uSecPerBeat = readFixedLong(3);
       if (_eventData.tempo.uSecPerBeat < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Meta Tempo data");
 #endif
@@ -583,6 +3003,8 @@ event_t MidiFileStream::readEvent() {
         return _eventType;
       }
       
+      addTempoPoint(_eventTicks, _eventData.tempo.uSecPerBeat);
+      
 #ifdef MIDIFILESTREAM_VERBOSE
       Serial.print("Tempo. uSecPerBeat: ");
       Serial.println(_eventData.tempo.uSecPerBeat);
@@ -590,9 +3012,13 @@ event_t MidiFileStream::readEvent() {
       break;
       
     case (char) 0x54: // SMPTE Offset
+      if (!MIDIFILESTREAM_DECODES(ET_SMPTE_OFFSET)) {
+        break;  // not compiled in; skipped above.
+      }
       _eventType = ET_SMPTE_OFFSET;
 
       if (length != 5) {
+        setError(ER_META_LENGTH);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.print("Garbled Meta SMPTE Offset length: ");
         Serial.println(length);
@@ -603,46 +3029,56 @@ event_t MidiFileStream::readEvent() {
       
       bint = readChunkByte();
       if (bint < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error SMPTE Offset");
 #endif
         _eventType = ET_UNK;
+        return _eventType;
       }
       _eventData.smpteOffset.hours = (int) bint;
       
       bint = readChunkByte();
       if (bint < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error SMPTE Offset");
 #endif
         _eventType = ET_UNK;
+        return _eventType;
       }
       _eventData.smpteOffset.minutes = (int) bint;
       
       bint = readChunkByte();
       if (bint < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error SMPTE Offset");
 #endif
         _eventType = ET_UNK;
+        return _eventType;
       }
       _eventData.smpteOffset.seconds = (int) bint;
       
       bint = readChunkByte();
       if (bint < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error SMPTE Offset");
 #endif
         _eventType = ET_UNK;
+        return _eventType;
       }
       _eventData.smpteOffset.frames = (int) bint;
       
       bint = readChunkByte();
       if (bint < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error SMPTE Offset");
 #endif
         _eventType = ET_UNK;
+        return _eventType;
       }
       _eventData.smpteOffset.f100ths = (int) bint;
       
@@ -652,9 +3088,13 @@ event_t MidiFileStream::readEvent() {
       break;
       
     case (char) 0x58: // Time Signature
+      if (!MIDIFILESTREAM_DECODES(ET_TIME_SIGN)) {
+        break;  // not compiled in; skipped above.
+      }
       _eventType = ET_TIME_SIGN;
 
       if (length != 4) {
+        setError(ER_META_LENGTH);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.print("Garbled Meta Time Signature length: ");
         Serial.println(length);
@@ -665,38 +3105,49 @@ event_t MidiFileStream::readEvent() {
       
       bint = readChunkByte();
       if (bint < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Time Signature");
 #endif
         _eventType = ET_UNK;
+        return _eventType;
       }
       _eventData.timeSign.numer = (int) bint;
       
       // Denominator is expressed as a power of 2.
       bint = readChunkByte();
       if (bint < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Time Signature");
 #endif
         _eventType = ET_UNK;
+        return _eventType;
+      }
+      if (bint > 7) {
+        bint = 7;  // a note value shorter than a 128th isn't music, and wouldn't fit.
       }
       _eventData.timeSign.denom = 1 << bint;
       
       bint = readChunkByte();
       if (bint < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Time Signature");
 #endif
         _eventType = ET_UNK;
+        return _eventType;
       }
       _eventData.timeSign.metro = (int) bint;
       
       bint = readChunkByte();
       if (bint < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Time Signature");
 #endif
         _eventType = ET_UNK;
+        return _eventType;
       }
       _eventData.timeSign.m32nds = (int) bint;
 
@@ -713,9 +3164,13 @@ event_t MidiFileStream::readEvent() {
       break;
       
     case (char) 0x59: // Key Signature
+      if (!MIDIFILESTREAM_DECODES(ET_KEY_SIGN)) {
+        break;  // not compiled in; skipped above.
+      }
       _eventType = ET_KEY_SIGN;
 
       if (length != 2) {
+        setError(ER_META_LENGTH);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.print("Garbled Meta Key Signature length: ");
         Serial.println(length);
@@ -726,10 +3181,12 @@ event_t MidiFileStream::readEvent() {
       
       bint = readChunkByte();
       if (bint < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Key Signature");
 #endif
         _eventType = ET_UNK;
+        return _eventType;
       }
       // Sign-extend the byte
       _eventData.keySign.numSharps = (int) bint;
@@ -739,10 +3196,12 @@ event_t MidiFileStream::readEvent() {
             
       bint = readChunkByte();
       if (bint < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
         Serial.println("Error reading Key Signature");
 #endif
         _eventType = ET_UNK;
+        return _eventType;
       }
       _eventData.keySign.isMinor = (int) bint;
 
@@ -757,16 +3216,13 @@ event_t MidiFileStream::readEvent() {
     default: // Unknown Meta event.
       _eventType = ET_NO_OP; // no event.
       
-      long bytesLeft;
-      for (bytesLeft = length; bytesLeft > 0; --bytesLeft) {
-        bint = readChunkByte();
-        if (bint < 0) {
+      if (!skipChunkBytes(length)) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
-          Serial.println("Error reading unknown Meta event data.");
+        Serial.println("Error reading unknown Meta event data.");
 #endif
-          _eventType = ET_UNK;
-          return _eventType;
-        }
+        _eventType = ET_UNK;
+        return _eventType;
       }
 
 #ifdef MIDIFILESTREAM_VERBOSE 
@@ -779,18 +3235,34 @@ event_t MidiFileStream::readEvent() {
 
   }
   
-  /*
-   * A Channel event.
-   * If the first byte top bit is not set,
-   * the event uses _runningStatus as the first byte.
-   */
-  _eventType = ET_CHANNEL;
+  // Anything else is a Channel event.
+  return readChannelData(bint);
+  
+}
+
+/*
+ * Reads the rest of a Channel event, for readEventData().
+ *  bint = the first byte of the event: its status byte or,
+ *    if the top bit is not set, its first parameter
+ *    (the event uses _runningStatus as its status byte).
+ * Sets _eventType and _eventData.
+ * Returns ET_UNK for an error, or ET_CHANNEL.
+ *
+ * Channel events are nearly all of the events in a typical file,
+ * so when the parameters are all in the read-ahead buffer
+ * this copies them directly, without the checks of readChunkByte().
+ */
+event_t MidiFileStream::readChannelData(int bint) {
+  int param1;     // if >= 0, the first parameter, already read.
+  int numParams;  // number of parameter bytes left to read.
+  byte code;
 
-  int runningBint = -1;
+  param1 = -1;
   if ((bint & 0x80) == 0) {
-    runningBint = bint;  // sort of a pushdown stack.
+    param1 = bint;
     bint = _runningStatus;
     if ((bint & 0x80) == 0) {
+      setError(ER_RUNNING_STATUS);
 #ifdef MIDIFILESTREAM_DEBUG
       Serial.println("Running status used, but not active.");
 #endif
@@ -798,38 +3270,59 @@ event_t MidiFileStream::readEvent() {
       return _eventType;
     }
   }
-  _eventData.channel.code = (char) (bint >> 4);
-  _eventData.channel.chan = bint & 0x0F;
- 
   _runningStatus = bint;
   
-  if (runningBint != -1) {
-    _eventData.channel.param1 = runningBint;
+  code = (byte) (bint >> 4);
+  _eventType = ET_CHANNEL;
+  _eventData.channel.code = (char) code;
+  _eventData.channel.chan = bint & 0x0F;
+  _eventData.channel.param2 = 0;
+  
+  // Some channel events don't have a second parameter
+  numParams = ((CH_ONE_PARAM_MASK >> code) & 1) ? 1 : 2;
+  if (param1 >= 0) {
+    _eventData.channel.param1 = param1;
+    --numParams;
+  }
+  
+  if (numParams > 0 && _bytesLeft >= numParams
+      && _bufferLength - _bufferIndex >= numParams) {
+    // Fast path: the parameters are in the read-ahead buffer.
+    _bytesLeft -= numParams;
+    if (param1 < 0) {
+      _eventData.channel.param1 = _pBuffer[_bufferIndex++];
+      --numParams;
+    }
+    if (numParams > 0) {
+      _eventData.channel.param2 = _pBuffer[_bufferIndex++];
+    }
+    
   } else {
-    bint = readChunkByte();
-    if (bint < 0) {
+    if (param1 < 0) {
+      bint = readChunkByte();
+      if (bint < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
-      Serial.println("End of track reading channel event parameter 1.");
+        Serial.println("End of track reading channel event parameter 1.");
 #endif
-      _eventType = ET_UNK;
-      return _eventType;
+        _eventType = ET_UNK;
+        return _eventType;
+      }
+      _eventData.channel.param1 = bint;
+      --numParams;
     }
-    _eventData.channel.param1 = bint;
-  }
-
-  // Some channel events don't have a second parameter
-  if (_eventData.channel.code == 0xC || _eventData.channel.code == 0xD) {
-    _eventData.channel.param2 = 0;
-  } else {
-    bint = readChunkByte();
-    if (bint < 0) {
+    if (numParams > 0) {
+      bint = readChunkByte();
+      if (bint < 0) {
+        setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
-      Serial.println("End of track reading channel event parameter 2.");
+        Serial.println("End of track reading channel event parameter 2.");
 #endif
-      _eventType = ET_UNK;
-      return _eventType;
+        _eventType = ET_UNK;
+        return _eventType;
+      }
+      _eventData.channel.param2 = bint;
     }
-    _eventData.channel.param2 = bint;
   }
 
 #ifdef MIDIFILESTREAM_VERBOSE
@@ -844,7 +3337,6 @@ event_t MidiFileStream::readEvent() {
 #endif
   
   return _eventType;
-  
 }
 
 /*
@@ -862,6 +3354,7 @@ long MidiFileStream::readFixedLong(int numBytes) {
     
     bint = readChunkByte();
     if (bint < 0) {
+      setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
       Serial.println("End of chunk reading a fixed-length number. Expected ");
       Serial.print(numBytes);
@@ -877,6 +3370,43 @@ long MidiFileStream::readFixedLong(int numBytes) {
   return result;
 }
 
+/*
+ * Reads the data of a variable-length event (Sysex or text Meta event)
+ * into the given bytes field of _eventData.
+ * With MIDIFILESTREAM_COMPACT, first points that field
+ * at the payload buffer.
+ * Records where the data is, for readPayload().
+ * If payloads are read by reference, skips the data instead.
+ * Returns the same as readVariableBytes().
+ */
+long MidiFileStream::readEventBytes(long length, evbytes_t& bytes) {
+#ifdef MIDIFILESTREAM_COMPACT
+  bytes = _pPayload;
+#endif
+
+  _payloadPosition = getStreamPosition();
+  _payloadLength = length;
+  
+  if (_payloadByReference) {
+    // Read nothing now; see readPayload().
+    bytes[0] = '\0';
+    if (!skipChunkBytes(length)) {
+      setError(ER_READ);
+#ifdef MIDIFILESTREAM_DEBUG
+      Serial.println("Error skipping variable bytes");
+#endif
+      return -1;
+    }
+    return 0;
+  }
+
+#ifdef MIDIFILESTREAM_COMPACT
+  return readVariableBytes(length, bytes, _payloadSize);
+#else
+  return readVariableBytes(length, bytes, EV_BUFFER_SIZE);
+#endif
+}
+
 /*
  * Reads the data for an event that has a variable number of bytes
  * of data.
@@ -889,44 +3419,48 @@ long MidiFileStream::readFixedLong(int numBytes) {
  * -1 if an error occurs.
  */
 long MidiFileStream::readVariableBytes(long length, char *pBuffer) {
- long truncLength; // truncated length; the stored number of data bytes.
+  return readVariableBytes(length, pBuffer, EV_BUFFER_SIZE);
+}
+
+/*
+ * Same as readVariableBytes(length, pBuffer) above,
+ * for a buffer that is bufferSize bytes long.
+ * Truncates the length and data to bufferSize - 1 bytes.
+ */
+long MidiFileStream::readVariableBytes(long length, char *pBuffer, int bufferSize) {
+  long truncLength; // truncated length; the stored number of data bytes.
   long bytesRead; // number of data bytes read so far.
-  char *cp;
-  int bint;
   
   pBuffer[0] = '\0';
   
   truncLength = length;
-  if (length > EV_BUFFER_SIZE - 1) {
-    truncLength = EV_BUFFER_SIZE - 1;
+  if (length > bufferSize - 1) {
+    truncLength = bufferSize - 1;
+    MIDIFILESTREAM_COUNT(numTruncated, 1);
   }
   
   // Read the truncated data into the buffer.
-  cp = pBuffer;
-  for (bytesRead = 0; bytesRead < truncLength; ++bytesRead) {
-    bint = readChunkByte();
-    if (bint < 0) {
+  bytesRead = readChunkBytes(pBuffer, truncLength);
+  if (bytesRead < truncLength) {
+    setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
-      Serial.print("Error reading variable byte[");
-      Serial.print(bytesRead);
-      Serial.println("]");
+    Serial.print("Error reading variable byte[");
+    Serial.print(bytesRead);
+    Serial.println("]");
 #endif
-      return -1;
-    }
-    *cp++ = (char) bint;
+    return -1;
   }
-  *cp++ = '\0';
+  pBuffer[truncLength] = '\0';
   
   // Skip the remaining data.
-  for ( ; bytesRead < length; ++bytesRead) {
-    if (readChunkByte() < 0) {
+  if (!skipChunkBytes(length - bytesRead)) {
+    setError(ER_READ);
 #ifdef MIDIFILESTREAM_DEBUG
-      Serial.print("Error skipping variable byte[");
-      Serial.print(bytesRead);
-      Serial.println("]");
+    Serial.print("Error skipping variable bytes after byte[");
+    Serial.print(bytesRead);
+    Serial.println("]");
 #endif
-      return -1;
-    }
+    return -1;
   }
   
   return truncLength;
@@ -943,11 +3477,19 @@ long MidiFileStream::readVariableLong() {
   int anotherByte; // if true, there's at least one more byte to read.
   int numBytes;    // number of bytes in the variable number.
   
- result = 0;
+  // Fast path: most delta ticks are a single byte, already buffered.
+  if (_bytesLeft > 0 && _bufferIndex < _bufferLength
+      && (_pBuffer[_bufferIndex] & 0x80) == 0) {
+    --_bytesLeft;
+    return _pBuffer[_bufferIndex++];
+  }
+  
+  result = 0;
   numBytes = 0;
   anotherByte = true;
   while (anotherByte) {
     if (numBytes > 4) {
+      setError(ER_VARIABLE);
 #ifdef MIDIFILESTREAM_DEBUG
       Serial.println("Corrupted file: variable number not terminated after 4 bytes.");
 #endif
@@ -967,6 +3509,99 @@ long MidiFileStream::readVariableLong() {
   return result;
 }
 
+/*
+ * Skips the rest of the current chunk,
+ * by seeking if the stream can seek (see setSeekFunction()).
+ * Useful for skipping CT_UNK chunks, or the rest of a track.
+ * After this call, openChunk() will read the next chunk.
+ * Returns true if successful; false if an error occurs.
+ */
+boolean MidiFileStream::skipChunk() {
+  if (_bytesLeft < 0) {
+    return false;
+  }
+  return skipChunkBytes(_bytesLeft);
+}
+
+/*
+ * Skips the given number of bytes of the current chunk,
+ * without reading them if the stream can seek.
+ * Maintains the chunk bytes left.
+ * Returns true if successful; false if the chunk
+ * or file ends first.
+ */
+boolean MidiFileStream::skipChunkBytes(long count) {
+  if (count <= 0) {
+    return true;
+  }
+  if (count > _bytesLeft) {
+    return false;
+  }
+  if (!seekStream(getStreamPosition() + (unsigned long) count)) {
+    _bytesLeft = 0;
+    return false;
+  }
+  _bytesLeft -= count;
+  MIDIFILESTREAM_COUNT(bytesSkipped, (unsigned long) count);
+  return true;
+}
+
+/*
+ * Reads up to count bytes from the current chunk into pDest.
+ * Copies directly from the read-ahead buffer, if there is one.
+ * Returns the number of bytes read, which is less than count
+ * if the chunk or file ends first.
+ */
+long MidiFileStream::readChunkBytes(char *pDest, long count) {
+  long bytesRead;
+
+  if (count > _bytesLeft) {
+    count = _bytesLeft;
+  }
+  if (count <= 0) {
+    return 0;
+  }
+  bytesRead = readStreamBytes(pDest, count);
+  _bytesLeft -= bytesRead;
+  return bytesRead;
+}
+
+/*
+ * Reads up to count bytes from the underlying stream into pDest,
+ * through the read-ahead buffer if there is one.
+ * Does not change _bytesLeft.
+ * Returns the number of bytes read, which is less than count
+ * if the file ends first.
+ */
+long MidiFileStream::readStreamBytes(char *pDest, long count) {
+  long bytesRead;
+  long n;
+  int bint;
+
+  bytesRead = 0;
+  while (bytesRead < count) {
+    n = _bufferLength - _bufferIndex;
+    if (n <= 0) {
+      // Nothing buffered: read a byte, which also refills the buffer.
+      bint = readStreamByte();
+      if (bint < 0) {
+        break;
+      }
+      pDest[bytesRead++] = (char) bint;
+      continue;
+    }
+
+    if (n > count - bytesRead) {
+      n = count - bytesRead;
+    }
+    memcpy(pDest + bytesRead, _pBuffer + _bufferIndex, (size_t) n);
+    _bufferIndex += (int) n;
+    bytesRead += n;
+  }
+
+  return bytesRead;
+}
+
 /*
  * Reads one byte from the current chunk,
  * returning the byte as an integer
@@ -978,5 +3613,304 @@ int MidiFileStream::readChunkByte() {
   }
   
   --_bytesLeft;
-  return _pStream->read();
+  if (_bufferIndex < _bufferLength) {
+    return _pBuffer[_bufferIndex++];
+  }
+  return readStreamByte();
+}
+
+/*
+ * Returns the stream position of the next byte to be read,
+ * counted from the stream position at the call to begin().
+ */
+unsigned long MidiFileStream::getStreamPosition() {
+  return _streamPos - (unsigned long) (_bufferLength - _bufferIndex);
+}
+
+/*
+ * Moves to the given stream position (see getStreamPosition()).
+ * Does not change _bytesLeft.
+ * Uses the read-ahead buffer if the position is in it,
+ * otherwise the seek function if there is one,
+ * otherwise skips forward by reading.
+ * Returns true if successful; false otherwise.
+ */
+boolean MidiFileStream::seekStream(unsigned long position) {
+  unsigned long bufferStart;
+  unsigned long current;
+  int n;
+
+  // See if the position is in the buffer.
+  bufferStart = _streamPos - (unsigned long) _bufferLength;
+  if (position >= bufferStart && position <= _streamPos) {
+    _bufferIndex = (int) (position - bufferStart);
+    return true;
+  }
+  
+#if defined(__AVR__)
+  if (_pFlash != 0) {
+    if (position > _flashLength) {
+      return false;
+    }
+    _bufferLength = 0;
+    _bufferIndex = 0;
+    _streamPos = position;
+    return true;
+  }
+#endif
+  if (_pStream == 0) {
+    return false;  // begin(pData, length): there's nothing outside the buffer.
+  }
+  
+  if (_seekStream != 0) {
+    cancelPrefetch();
+    _bufferLength = 0;
+    _bufferIndex = 0;
+#ifdef MIDIFILESTREAM_STATS
+    unsigned long startMicros = micros();
+    boolean isSeeked = (*_seekStream)(*_pStream, position);
+    _stats.streamMicros += micros() - startMicros;
+    ++_stats.numSeeks;
+    if (!isSeeked) {
+      return false;
+    }
+#else
+    if (!(*_seekStream)(*_pStream, position)) {
+      return false;
+    }
+#endif
+    _streamPos = position;
+    return true;
+  }
+  
+  // The stream can't seek. Skip forward if we can.
+  current = getStreamPosition();
+  if (position < current) {
+    return false;
+  }
+  while (current < position) {
+    if (_pBuffer == 0) {
+      if (readStreamByte() < 0) {
+        return false;
+      }
+      ++current;
+      continue;
+    }
+    
+    // Skip whole buffers at a time.
+    if (_bufferIndex >= _bufferLength) {
+      if (!fillBuffer()) {
+        return false;
+      }
+    }
+    n = _bufferLength - _bufferIndex;
+    if ((unsigned long) n > position - current) {
+      n = (int) (position - current);
+    }
+    _bufferIndex += n;
+    current += (unsigned long) n;
+  }
+  return true;
+}
+
+/*
+ * Reads one byte from the underlying stream,
+ * through the read-ahead buffer if there is one.
+ * Does not change _bytesLeft.
+ * Returns the byte, or -1 at end of file.
+ */
+int MidiFileStream::readStreamByte() {
+  int bint;
+
+  if (_pBuffer == 0) {
+#if defined(__AVR__)
+    if (_pFlash != 0) {
+      if (_streamPos >= _flashLength) {
+        return -1;
+      }
+      MIDIFILESTREAM_COUNT(bytesRead, 1);
+      return pgm_read_byte(_pFlash + _streamPos++);
+    }
+#endif
+#ifdef MIDIFILESTREAM_STATS
+    unsigned long startMicros = micros();
+    bint = _pStream->read();
+    _stats.streamMicros += micros() - startMicros;
+    ++_stats.numReads;
+#else
+    bint = _pStream->read();
+#endif
+    if (bint >= 0) {
+      ++_streamPos;
+      MIDIFILESTREAM_COUNT(bytesRead, 1);
+    }
+    return bint;
+  }
+  
+  if (_bufferIndex >= _bufferLength) {
+    if (!fillBuffer()) {
+      return -1;
+    }
+  }
+  return _pBuffer[_bufferIndex++];
+}
+
+/*
+ * Refills the read-ahead buffer from the stream.
+ * Returns true if at least one byte was read;
+ * false at end of file.
+ */
+boolean MidiFileStream::fillBuffer() {
+  int n;
+  int bint;
+
+#if defined(__AVR__)
+  if (_pFlash != 0) {
+    _bufferLength = 0;
+    _bufferIndex = 0;
+    if (_streamPos >= _flashLength) {
+      return false;
+    }
+    n = _bufferSize;
+    if ((unsigned long) n > _flashLength - _streamPos) {
+      n = (int) (_flashLength - _streamPos);
+    }
+    memcpy_P(_pReadBuffer, _pFlash + _streamPos, (size_t) n);
+    _bufferLength = n;
+    _streamPos += (unsigned long) n;
+    MIDIFILESTREAM_COUNT(bytesRead, (unsigned long) n);
+    return true;
+  }
+#endif
+  if (_pStream == 0) {
+    return false;  // begin(pData, length): the end of the data.
+  }
+#ifdef MIDIFILESTREAM_PREFETCH
+  if (_startRead != 0 && _bufferSize >= 2) {
+    return fillPrefetchBuffer();
+  }
+#endif
+  
+  _bufferLength = 0;
+  _bufferIndex = 0;
+#ifdef MIDIFILESTREAM_STATS
+  unsigned long startMicros = micros();
+#endif
+
+  if (_readBlock != 0) {
+    n = (*_readBlock)(*_pStream, _pReadBuffer, _bufferSize);
+    MIDIFILESTREAM_COUNT(numBlockReads, 1);
+  } else {
+    /*
+     * Ask readBytes() only for what's available,
+     * so that we don't wait for its timeout at end of file.
+     */
+    n = _pStream->available();
+    if (n > _bufferSize) {
+      n = _bufferSize;
+    }
+    if (n > 0) {
+      n = (int) _pStream->readBytes((char *) _pReadBuffer, (size_t) n);
+      MIDIFILESTREAM_COUNT(numBlockReads, 1);
+    } else {
+      bint = _pStream->read();
+      MIDIFILESTREAM_COUNT(numReads, 1);
+      if (bint >= 0) {
+        _pReadBuffer[0] = (byte) bint;
+        n = 1;
+      }
+    }
+  }
+#ifdef MIDIFILESTREAM_STATS
+  _stats.streamMicros += micros() - startMicros;
+#endif
+
+  if (n <= 0) {
+    return false;
+  }
+  MIDIFILESTREAM_COUNT(bytesRead, (unsigned long) n);
+  _bufferLength = n;
+  _streamPos += (unsigned long) n;
+  return true;
+}
+
+/*
+ * Refills the read-ahead buffer when reading in the background
+ * (see setPrefetch()): waits for the read into one half
+ * of the buffer, then starts reading the next block into the other.
+ * Returns true if successful; false at end of file.
+ */
+boolean MidiFileStream::fillPrefetchBuffer() {
+#ifdef MIDIFILESTREAM_PREFETCH
+  byte *pFilled;
+  int n;
+
+  _bufferLength = 0;
+  _bufferIndex = 0;
+  if (!_isPrefetching) {
+    // Nothing read ahead (at the start, or after a seek): read now.
+    startPrefetch(_pReadBuffer);
+    if (!_isPrefetching) {
+      return false;
+    }
+  }
+  
+#ifdef MIDIFILESTREAM_STATS
+  unsigned long startMicros = micros();
+  n = (*_finishRead)(*_pStream);
+  _stats.streamMicros += micros() - startMicros;
+#else
+  n = (*_finishRead)(*_pStream);
+#endif
+  _isPrefetching = false;
+  if (n <= 0) {
+    return false;
+  }
+  
+  pFilled = _pPrefetch;
+  _pBuffer = pFilled;
+  _bufferLength = n;
+  _streamPos += (unsigned long) n;
+  MIDIFILESTREAM_COUNT(bytesRead, (unsigned long) n);
+  
+  // Read the next block while this one is decoded.
+  startPrefetch((pFilled == _pReadBuffer) ? _pReadBuffer + _bufferSize / 2 : _pReadBuffer);
+  return true;
+#else
+  return false;
+#endif
+}
+
+/*
+ * Starts a background read of the next block of the stream
+ * into the given half of the read-ahead buffer.
+ * Sets _isPrefetching if the read was started.
+ */
+void MidiFileStream::startPrefetch(byte *pBuffer) {
+#ifdef MIDIFILESTREAM_PREFETCH
+  _pPrefetch = pBuffer;
+#ifdef MIDIFILESTREAM_STATS
+  unsigned long startMicros = micros();
+  _isPrefetching = (*_startRead)(*_pStream, pBuffer, _bufferSize / 2);
+  _stats.streamMicros += micros() - startMicros;
+#else
+  _isPrefetching = (*_startRead)(*_pStream, pBuffer, _bufferSize / 2);
+#endif
+  MIDIFILESTREAM_COUNT(numBlockReads, 1);
+#else
+  (void) pBuffer;
+#endif
+}
+
+/*
+ * Waits for, and throws away, any background read in progress,
+ * e.g., before moving the stream elsewhere.
+ */
+void MidiFileStream::cancelPrefetch() {
+#ifdef MIDIFILESTREAM_PREFETCH
+  if (_isPrefetching) {
+    (*_finishRead)(*_pStream);
+    _isPrefetching = false;
+  }
+#endif
 }
@@ -16,9 +16,17 @@
  * Licensed under the LGPL version 2.1
  * a version of which should be supplied with this file.
  *
- * The library supports two #defines:
+ * The library supports six #defines:
  *  #define MIDIFILESTREAM_DEBUG 1 to print file format error messages.
  *  #define MIDIFILESTREAM_VERBOSE 1 to print each event as it is read.
+ *  #define MIDIFILESTREAM_COMPACT 1 to use less RAM per MidiFileStream.
+ *   See EV_BUFFER_SIZE, below.
+ *  #define MIDIFILESTREAM_STATS 1 to count the work done reading a file.
+ *   See MidiFileStats, below.
+ *  #define MIDIFILESTREAM_EVENTS as the mask of the event types to decode,
+ *   to save flash.  See MIDIFILESTREAM_EVENTS, below.
+ *  #define MIDIFILESTREAM_PREFETCH 1 to read ahead in the background.
+ *   See MIDIFILESTREAM_PREFETCH, below.
  *
  * If you're looking for a more callback-oriented library,
  * you may be interested in:
@@ -32,6 +40,30 @@
  * http://www.cs.cmu.edu/~music/cmsip/readings/MIDI%20tutorial%20for%20programmers.html
  */
 
+/*
+ * MIDIFILESTREAM_COMPACT changes the layout of union eventData,
+ * so it must be defined here, where both the library and
+ * the Sketch see it.
+ */
+//#define MIDIFILESTREAM_COMPACT 1
+
+/*
+ * Likewise MIDIFILESTREAM_STATS, which adds a MidiFileStats
+ * to each MidiFileStream.
+ */
+//#define MIDIFILESTREAM_STATS 1
+
+/*
+ * Likewise MIDIFILESTREAM_PREFETCH, which adds reading ahead
+ * in the background (see MidiFileStream::setPrefetch()).
+ * Without it, setPrefetch() does nothing.  It's ignored on an AVR,
+ * which has no DMA to read with.
+ */
+//#define MIDIFILESTREAM_PREFETCH 1
+#if defined(__AVR__)
+#undef MIDIFILESTREAM_PREFETCH
+#endif
+
 /*
  * File chunk types:
  * CT_UNK = Unknown/unset chunk type.
@@ -74,6 +106,7 @@ const event_t ET_SMPTE_OFFSET = (event_t) 16;// Meta SMPTE offset event
 const event_t ET_TIME_SIGN = (event_t) 17;   // Meta Time Signature event
 const event_t ET_KEY_SIGN = (event_t) 18;    // Meta Key Signature event
 const event_t ET_CHANNEL = (event_t) 19;     // A channel message.  See CH_* below.
+const int ET_NUM_TYPES = 20;                 // number of ET_* values.
 
 /*
  * Values for dataChannel.code.
@@ -87,6 +120,56 @@ const char CH_PROG_CHANGE = (char) 0xC;     // Channel Program Change code
 const char CH_CHAN_AFTERTOUCH = (char) 0xD; // Channel Channel Aftertouch code
 const char CH_PITCH_BEND = (char) 0xE;      // Channel Pitch Bend code
 
+/*
+ * Error codes: why the last call failed. See MidiFileStream::getLastError().
+ * Unlike the MIDIFILESTREAM_DEBUG messages, these are always
+ * compiled in, and cost only a few bytes of RAM, and a store
+ * when an error occurs.
+ */
+typedef byte errcode_t;
+const errcode_t ER_NONE = (errcode_t) 0;           // No error
+const errcode_t ER_READ = (errcode_t) 1;           // An event or number ended early (end of chunk or file)
+const errcode_t ER_SEEK = (errcode_t) 2;           // The stream couldn't be moved (e.g., no seek function)
+const errcode_t ER_HEADER = (errcode_t) 3;         // Not a Midi file, or a damaged header chunk
+const errcode_t ER_SMPTE = (errcode_t) 4;          // Unsupported SMPTE frames per second
+const errcode_t ER_CHUNK = (errcode_t) 5;          // A damaged chunk header
+const errcode_t ER_UNKNOWN_CHUNK = (errcode_t) 6;  // Not an MThd or MTrk chunk.  Its length is valid, so skipChunk() works.
+const errcode_t ER_VARIABLE = (errcode_t) 7;       // A variable-length number longer than 4 bytes
+const errcode_t ER_RUNNING_STATUS = (errcode_t) 8; // Running status used, but not active
+const errcode_t ER_META_LENGTH = (errcode_t) 9;    // A Meta event of the wrong length for its type
+const errcode_t ER_INDEX = (errcode_t) 10;         // An index file that doesn't match the Midi file
+const errcode_t ER_BUFFER = (errcode_t) 11;        // No room in the buffer pool for this file's buffers. See setBufferPool().
+
+/*
+ * Event filter masks. See MidiFileStream::setEventFilter().
+ * ET_MASK(et) = the event mask bit for event type et (an ET_* value).
+ * CH_MASK(code) = the channel mask bit for channel code (a CH_* value).
+ * For example, to read only tempo changes and notes:
+ *  midiFile.setEventFilter(ET_MASK(ET_TEMPO) | ET_MASK(ET_CHANNEL),
+ *    CH_MASK(CH_NOTE_ON) | CH_MASK(CH_NOTE_OFF));
+ */
+#define ET_MASK(et) (1UL << (et))
+#define CH_MASK(code) (1U << (code))
+const unsigned long ET_MASK_ALL = 0xFFFFFFFFUL; // all event types
+const unsigned int CH_MASK_ALL = 0xFFFFU;       // all channel codes
+
+/*
+ * MIDIFILESTREAM_EVENTS = the event types (an ET_MASK() mask) whose
+ * decoding is compiled into the library.  Other Sysex and Meta events
+ * take no code beyond a generic skip, and are never returned,
+ * as though setEventFilter() had filtered them out.
+ * On a small board, define it (here, so that the library sees it)
+ * as just the events your Sketch handles, to save flash.  For example:
+ *  #define MIDIFILESTREAM_EVENTS (ET_MASK(ET_CHANNEL) | ET_MASK(ET_END_TRACK))
+ * Channel events and Tempo events are always decoded:
+ * the first because they have no length to skip by,
+ * the second for event times (see getEventTimeMicros()).
+ */
+//#define MIDIFILESTREAM_EVENTS (ET_MASK(ET_CHANNEL) | ET_MASK(ET_END_TRACK))
+#ifndef MIDIFILESTREAM_EVENTS
+#define MIDIFILESTREAM_EVENTS ET_MASK_ALL
+#endif
+
 /*
  * Size (bytes) of all of the character buffers in ET_* value structures.
  * +1 to account for an always-there null terminator.
@@ -96,6 +179,35 @@ const char CH_PITCH_BEND = (char) 0xE;      // Channel Pitch Bend code
  */
 const int EV_BUFFER_SIZE = (140 + 1);
 
+/*
+ * Types of the fields in the ET_* value structures.
+ *
+ * Normally, each variable-length event (Sysex or text Meta event)
+ * structure contains its own bytes[EV_BUFFER_SIZE], and the small
+ * numeric fields are ints.  That makes union eventData
+ * about 145 bytes.
+ *
+ * With MIDIFILESTREAM_COMPACT, bytes is instead a pointer to
+ * one buffer supplied by the caller (see
+ * MidiFileStream::setPayloadBuffer()), and small numeric fields
+ * are single bytes.  That makes union eventData a few bytes.
+ * The field names are the same either way, so
+ * code that reads eventData works in both modes.
+ *
+ * evbytes_t = the type of the bytes field.
+ * evbyte_t = the type of small unsigned numeric fields.
+ * evsbyte_t = the type of small signed numeric fields.
+ */
+#ifdef MIDIFILESTREAM_COMPACT
+typedef char *evbytes_t;
+typedef byte evbyte_t;
+typedef signed char evsbyte_t;
+#else
+typedef char evbytes_t[EV_BUFFER_SIZE];
+typedef int evbyte_t;
+typedef int evsbyte_t;
+#endif
+
 /*
  * Data from an ET_SYSEX_F0 event.
  *  length = the number of bytes in the bytes[],
@@ -104,7 +216,7 @@ const int EV_BUFFER_SIZE = (140 + 1);
  */
 struct dataSysexF0 {
   int length;
-  char bytes[EV_BUFFER_SIZE];
+  evbytes_t bytes;
 };
 
 /*
@@ -114,7 +226,7 @@ struct dataSysexF0 {
  */
 struct dataSysexEsc {
   int length;
-  char bytes[EV_BUFFER_SIZE];
+  evbytes_t bytes;
 };
 
 /*
@@ -132,7 +244,7 @@ struct dataSeqNum {
  */
 struct dataText {
   int length;
-  char bytes[EV_BUFFER_SIZE];
+  evbytes_t bytes;
 };
 
 /*
@@ -142,7 +254,7 @@ struct dataText {
  */
 struct dataCopyright {
   int length;
-  char bytes[EV_BUFFER_SIZE];
+  evbytes_t bytes;
 };
 
 /*
@@ -152,7 +264,7 @@ struct dataCopyright {
  */
 struct dataName {
   int length;
-  char bytes[EV_BUFFER_SIZE];
+  evbytes_t bytes;
 };
 
 /*
@@ -162,7 +274,7 @@ struct dataName {
  */
 struct dataInstrument {
   int length;
-  char bytes[EV_BUFFER_SIZE];
+  evbytes_t bytes;
 };
 
 /*
@@ -172,7 +284,7 @@ struct dataInstrument {
  */
 struct dataLyric {
   int length;
-  char bytes[EV_BUFFER_SIZE];
+  evbytes_t bytes;
 };
 
 /*
@@ -182,7 +294,7 @@ struct dataLyric {
  */
 struct dataMarker {
   int length;
-  char bytes[EV_BUFFER_SIZE];
+  evbytes_t bytes;
 };
 
 /*
@@ -192,7 +304,7 @@ struct dataMarker {
  */
 struct dataCue {
   int length;
-  char bytes[EV_BUFFER_SIZE];
+  evbytes_t bytes;
 };
 
 /*
@@ -200,7 +312,7 @@ struct dataCue {
  *  chan = the channel
  */
 struct dataChanPrefix {
-  int chan;
+  evbyte_t chan;
 };
 
 /*
@@ -217,25 +329,26 @@ struct dataTempo {
  *  SMPTE time when the track is to start.
  */
 struct dataSmpteOffset {
-  int hours;
-  int minutes;
-  int seconds;
-  int frames;
-  int f100ths;
+  evbyte_t hours;
+  evbyte_t minutes;
+  evbyte_t seconds;
+  evbyte_t frames;
+  evbyte_t f100ths;
 };
 
 /*
  * Data from an ET_TIME_SIGN event.
  *  numer = numerator. That is, musical beats per measure.
  *  denom = denominator. That is, musical duration that gets the beat
+ *    (1 to 128; a file's larger values are read as 128).
  *  metro = Midi clocks per metronome sounding.
  *  m32nds = number of 32nd notes per 24 Midi clocks.
  */
 struct dataTimeSign {
-  int numer;
-  int denom;
-  int metro;
-  int m32nds;
+  evbyte_t numer;
+  evbyte_t denom;
+  evbyte_t metro;
+  evbyte_t m32nds;
 };
 
 /*
@@ -246,8 +359,8 @@ struct dataTimeSign {
  *  isMinor = if non-zero, Minor key; if 0, Major key
  */
 struct dataKeySign {
-  int numSharps;
-  int isMinor;
+  evsbyte_t numSharps;
+  evbyte_t isMinor;
 };
 
 /*
@@ -259,9 +372,9 @@ struct dataKeySign {
  */
 struct dataChannel {
   char code;
-  int chan;
-  int param1;
-  int param2;
+  evbyte_t chan;
+  evbyte_t param1;
+  evbyte_t param2;
 };
 
 /*
@@ -288,38 +401,478 @@ union eventData {
   struct dataChannel channel;
 };
 
+const int MIDI_SUMMARY_NAME_SIZE = 24; // bytes in a summary name, including the null.
+
+/*
+ * What probe() found out about one track (MTrk chunk).
+ *  name = the first Sequence/Track Name (ET_NAME) of the track,
+ *    truncated and null-terminated; empty if there is none.
+ *  length = the number of bytes in the track.
+ *  numNotes = the number of Note On events (with non-zero velocity).
+ *    Full scan only; otherwise 0.
+ *  durationTicks = absolute ticks of the End of Track event.
+ *    Full scan only; otherwise 0.
+ */
+struct MidiTrackSummary {
+  char name[MIDI_SUMMARY_NAME_SIZE];
+  unsigned long length;
+  unsigned long numNotes;
+  unsigned long durationTicks;
+};
+
+/*
+ * What probe() found out about a Midi file: small enough
+ * to keep in a list of files, or to save as-is in a cache file.
+ * The caller sets pTracks and maxTracks;
+ * probe() sets the rest.
+ *  format, numTracks, ticksPerBeat, framesPerSecond, ticksPerFrame
+ *    = as in the file header. See getTicksPerBeat() etc.
+ *  uSecPerBeat = the first tempo in the file,
+ *    or MIDI_DEFAULT_USEC_PER_BEAT if there is none
+ *    before the first channel event of each track.
+ *  name = the name of the first track that has one:
+ *    usually the title of the song.
+ *  numTrackChunks = the number of MTrk chunks found.
+ *  pTracks = array to fill with the summary of each track, or 0.
+ *  maxTracks = the number of elements in pTracks[].
+ *  isFullScan = true if every event was read, so that
+ *    the numNotes and duration* fields are set.
+ *  numNotes = the number of Note On events, in all tracks.
+ *  durationTicks = ticks of the end of the longest track.
+ *  durationMicros = the time of durationTicks, in microseconds.
+ */
+struct MidiFileSummary {
+  int format;
+  int numTracks;
+  int ticksPerBeat;
+  int framesPerSecond;
+  int ticksPerFrame;
+  long uSecPerBeat;
+  char name[MIDI_SUMMARY_NAME_SIZE];
+  int numTrackChunks;
+  MidiTrackSummary *pTracks;
+  int maxTracks;
+  boolean isFullScan;
+  unsigned long numNotes;
+  unsigned long durationTicks;
+  unsigned long durationMicros;
+};
+
+/*
+ * One decoded event, in a few bytes, with its time.
+ * Used to queue events between reading and playing them.
+ * See MidiFileStream::getTimedEvent().
+ *  time = time of the event, in microseconds from the start of the file.
+ *    (decodeTrack() stores absolute ticks here instead,
+ *    until mergeTracks() converts them.)
+ *  type = the event type. See ET_*.
+ *  track = index of the track of the event. See MidiTrackCursor.track.
+ *  data[] = the event data:
+ *    ET_CHANNEL: data[0] = the status byte ((code << 4) | chan),
+ *      data[1] = param1, data[2] = param2.
+ *    ET_TEMPO: uSecPerBeat, most significant byte first.
+ *    other event types: 0.
+ */
+struct MidiTimedEvent {
+  unsigned long time;
+  event_t type;
+  byte track;
+  byte data[3];
+};
+
+/*
+ * Caller-owned parallel arrays that MidiFileStream::readEvents()
+ * decodes a batch of events into, one element per event.
+ * Any pointer may be 0, to not store that field.
+ *  pTicks[] = absolute ticks of the event. See getEventTicks().
+ *  pTypes[] = the event type. See ET_*.
+ *  pStatus[], pParam1[], pParam2[] = the event data,
+ *    as MidiTimedEvent.data[0], [1] and [2].
+ *    For example, for an ET_CHANNEL event: the status byte
+ *    ((code << 4) | chan), param1 and param2.
+ */
+struct MidiEventBatch {
+  unsigned long *pTicks;
+  event_t *pTypes;
+  byte *pStatus;
+  byte *pParam1;
+  byte *pParam2;
+};
+
+/*
+ * Optional function to read a block of bytes from the Midi file stream.
+ * Used to refill the read-ahead buffer (see setReadBuffer()).
+ *  stream = the stream passed to begin().
+ *  pBuffer = the buffer to read into.
+ *  length = the maximum number of bytes to read.
+ * Returns the number of bytes read; 0 or less at end of file.
+ *
+ * For example, for an SD library File:
+ *  int readSdBlock(Stream& stream, byte *pBuffer, int length) {
+ *    return ((File &) stream).read(pBuffer, length);
+ *  }
+ */
+typedef int (*readBlock_t)(Stream& stream, byte *pBuffer, int length);
+
+/*
+ * Optional functions to read a block of bytes in the background,
+ * e.g., by a DMA transfer from an SD card, while the Midi file
+ * is being decoded.  See MidiFileStream::setPrefetch().
+ *
+ * startRead_t starts reading a block, and returns without waiting.
+ *  stream = the stream passed to begin().
+ *  pBuffer = the buffer to read into.  Its contents are not used
+ *    until the matching finishRead_t call.
+ *  length = the maximum number of bytes to read.
+ * Returns true if the read was started; false otherwise
+ * (e.g., at end of file).
+ *
+ * finishRead_t waits for the block read started by
+ * the last startRead_t call to complete.
+ *  stream = the stream passed to begin().
+ * Returns the number of bytes read; 0 or less at end of file.
+ *
+ * The stream is used by no one else between the two calls.
+ * A platform without background reads can do the whole read
+ * in the startRead_t function, and return its length
+ * from the finishRead_t function.
+ */
+typedef boolean (*startRead_t)(Stream& stream, byte *pBuffer, int length);
+typedef int (*finishRead_t)(Stream& stream);
+
+/*
+ * Optional function to move the Midi file stream to a given position.
+ * Used to jump from track to track (see MidiTrackCursor)
+ * and to skip data without reading it.
+ *  stream = the stream passed to begin().
+ *  position = the byte offset to move to,
+ *    counted from the stream position at the call to begin()
+ *    (normally the start of the file).
+ * Returns true if successful; false otherwise.
+ *
+ * For example, for an SD library File:
+ *  boolean seekSd(Stream& stream, unsigned long position) {
+ *    return ((File &) stream).seek(position);
+ *  }
+ */
+typedef boolean (*seekStream_t)(Stream& stream, unsigned long position);
+
+/*
+ * One tempo change in the tempo map. See MidiFileStream::setTempoMap().
+ *  ticks = absolute ticks at which this tempo starts.
+ *  micros = time (microseconds) from the start of the file to ticks.
+ *  uSecPerBeat = the tempo, in microseconds per beat.
+ *    For a file with SMPTE time, there is only one point,
+ *    and this is the microseconds per second of frames
+ *    (1001000 at 29.97 frames per second).
+ *  uSecPerTick = the tempo, in microseconds per tick,
+ *    as a fixed-point number with shift fraction bits.
+ *    Precomputed so that converting ticks to microseconds
+ *    takes a multiply and a shift instead of a divide.
+ *  shift = the number of fraction bits in uSecPerTick:
+ *    as many as fit, up to MIDI_TEMPO_SHIFT.
+ */
+struct MidiTempoPoint {
+  unsigned long ticks;
+  unsigned long micros;
+  long uSecPerBeat;
+  unsigned long uSecPerTick;
+  byte shift;
+};
+
+const int MIDI_TEMPO_SHIFT = 16;                 // maximum MidiTempoPoint.shift
+const long MIDI_DEFAULT_USEC_PER_BEAT = 500000L; // tempo until the first ET_TEMPO: 120 beats/minute
+
+/*
+ * The read position within one track (MTrk chunk) of the file.
+ * Several cursors can share one MidiFileStream, so that
+ * the tracks of a format 1 file can be read side by side.
+ * See MidiFileStream::openTracks() and selectTrack().
+ *  position = stream position of the next byte to read in the track.
+ *  bytesLeft = bytes remaining to be read in the track.
+ *  ticks = absolute ticks of the last event read from the track.
+ *    While merging (see beginMerge()), the absolute ticks
+ *    of the next event to be read from the track.
+ *  runningStatus = if non-zero, the status byte of the previous event.
+ *  track = index of the track in the file: 0 = the first MTrk chunk.
+ */
+struct MidiTrackCursor {
+  unsigned long position;
+  long bytesLeft;
+  unsigned long ticks;
+  byte runningStatus;
+  byte track;
+};
+
+/*
+ * The events of one track, decoded into memory,
+ * for merging with the other tracks. See MidiFileStream::decodeTrack()
+ * and mergeTracks().
+ *  pEvents = the events of the track, as stored by decodeTrack().
+ *  numEvents = the number of events in pEvents[].
+ *  next = index in pEvents[] of the next event to merge.
+ *    Set by mergeTracks().
+ */
+struct MidiDecodedTrack {
+  MidiTimedEvent *pEvents;
+  int numEvents;
+  int next;
+};
+
+#ifdef MIDIFILESTREAM_STATS
+/*
+ * Counts of the work a MidiFileStream has done,
+ * since it was constructed or resetStats() was last called.
+ * See MidiFileStream::getStats().
+ *  bytesRead = bytes read from the stream.
+ *  numReads = calls to the stream's read().
+ *  numBlockReads = calls to the stream's readBytes(),
+ *    or to the block-read function (see setReadBuffer()),
+ *    or background reads started (see setPrefetch()).
+ *  numSeeks = calls to the seek function (see setSeekFunction()).
+ *  bytesSkipped = bytes of filtered-out events, payloads,
+ *    unknown chunks etc. skipped rather than decoded.
+ *  numTruncated = payloads (Sysex or text data) truncated
+ *    to fit their buffer.
+ *  numEvents[] = events decoded, by event type (ET_*),
+ *    including events that were filtered out.
+ *  maxEventMicros = the longest time readEvent() took, in microseconds
+ *    (or readEvents(), for one event).
+ *  streamMicros = total time spent waiting for the stream,
+ *    in read(), readBytes(), and the block-read and seek functions.
+ */
+struct MidiFileStats {
+  unsigned long bytesRead;
+  unsigned long numReads;
+  unsigned long numBlockReads;
+  unsigned long numSeeks;
+  unsigned long bytesSkipped;
+  unsigned long numTruncated;
+  unsigned long numEvents[ET_NUM_TYPES];
+  unsigned long maxEventMicros;
+  unsigned long streamMicros;
+};
+#endif
+
+/*
+ * A saved read position within a track, for seeking.
+ * See MidiFileIndex.
+ *  cursor = the state of the track just after one of its events.
+ *    cursor.ticks is the absolute ticks of that event.
+ *  tempoTicks, tempoMicros = the absolute ticks and time (microseconds)
+ *    of the tempo change in effect at cursor.ticks.
+ *  uSecPerBeat = the tempo in effect at cursor.ticks.
+ */
+struct MidiCheckpoint {
+  MidiTrackCursor cursor;
+  unsigned long tempoTicks;
+  unsigned long tempoMicros;
+  long uSecPerBeat;
+};
+
+/*
+ * An index of a Midi file, for jumping to a musical position
+ * without reading the file from the start.
+ * See MidiFileStream::buildIndex() and seekToTick().
+ * The caller supplies the arrays and sets the max* fields;
+ * the library sets the num* fields.
+ *  pTracks = the start of each track, as set by openTracks().
+ *  maxTracks = the number of elements in pTracks[].
+ *  numTracks = the number of tracks found.
+ *  pCheckpoints = saved positions, in order of track, then ticks.
+ *  maxCheckpoints = the number of elements in pCheckpoints[].
+ *  numCheckpoints = the number of checkpoints stored.
+ */
+struct MidiFileIndex {
+  MidiTrackCursor *pTracks;
+  int maxTracks;
+  int numTracks;
+  MidiCheckpoint *pCheckpoints;
+  int maxCheckpoints;
+  int numCheckpoints;
+};
+
+class MidiBufferPool;  // see MidiBufferPool.h.
+
 class MidiFileStream {
   private:
     Stream *_pStream;  // the underlying Midi file stream
     
+    const byte *_pBuffer; // bytes being read: _pReadBuffer, the begin(pData, length) data, or 0.
+    byte *_pReadBuffer; // optional read-ahead buffer, or 0 if none.
+    int _bufferSize;    // size (bytes) of _pReadBuffer.
+#if defined(__AVR__)
+    const byte *_pFlash; // if non-zero, the begin_P() data, in flash.
+    unsigned long _flashLength; // size (bytes) of _pFlash.
+#endif
+    int _bufferLength;  // number of valid bytes in _pBuffer.
+    int _bufferIndex;   // index in _pBuffer of the next byte to read.
+    readBlock_t _readBlock; // optional block-read function, or 0 to use readBytes().
+    seekStream_t _seekStream; // optional seek function, or 0 if the stream can't seek.
+    unsigned long _streamPos; // stream position just past the last byte read from _pStream.
+    MidiBufferPool *_pPool;   // optional pool that begin() borrows buffers from, or 0. See setBufferPool().
+    int _poolReadSize;        // size (bytes) of the read-ahead buffer to borrow from _pPool.
+    int _poolPayloadSize;     // size (bytes) of the payload buffer to borrow from _pPool.
+    boolean _isBorrowed;      // if true, the buffers in use were borrowed from _pPool.
+#ifdef MIDIFILESTREAM_PREFETCH
+    startRead_t _startRead;   // optional background-read functions, or 0. See setPrefetch().
+    finishRead_t _finishRead;
+    byte *_pPrefetch;         // the half of _pReadBuffer being read in the background.
+    boolean _isPrefetching;   // if true, a background read into _pPrefetch has been started.
+#endif
+    
     long _bytesLeft;   // bytes remaining to be read in the current chunk.
     
     int _format;        // file format from header: 0, 1, or 2, from the header chunk.
     int _numTracks;     // number of tracks, from the header chunk.
-    int _ticksPerBeat;  // tempo, from the header chunk.
+    int _ticksPerBeat;  // tempo, from the header chunk; 0 for SMPTE time.
+    unsigned int _division; // the time division word of the header chunk.
+    byte _framesPerSecond; // for SMPTE time, 24, 25, 29 (30 drop frame) or 30; otherwise 0.
+    byte _ticksPerFrame;   // for SMPTE time, ticks per frame; otherwise 0.
+    unsigned int _tempoTicks; // the ticks that MidiTempoPoint.uSecPerBeat takes: a beat, or for SMPTE time a second.
     
     int _runningStatus; // if non-zero, the status byte (event byte) of the previous event.
     
+    MidiTrackCursor *_pCursor; // the track cursor in use, or 0 if none.
+    MidiTrackCursor *_pMerge;  // heap of tracks being merged, or 0 if not merging.
+    int _mergeCount;           // number of tracks in _pMerge[] that have events left.
+    unsigned long _mergeTicks; // absolute ticks of the previous merged event.
+    
+    MidiTempoPoint *_pTempoPoints; // the tempo map, in order of ticks. See setTempoMap().
+    int _maxTempoPoints;  // the number of elements in _pTempoPoints[].
+    int _numTempoPoints;  // the number of tempo changes stored in _pTempoPoints[].
+    int _tempoIndex;      // index in _pTempoPoints[] of the most recently used tempo.
+    MidiTempoPoint _tempoPoint; // the tempo map, if there's no _pTempoPoints[].
+    
     event_t _eventType; // type of the current event, or ET_UNK if none. See ET_* above.
     long _eventDeltaTicks; // number of ticks delay between the previous event and this one.
+    unsigned long _eventTicks; // absolute ticks from the start of the track to this event.
+    byte _eventTrack;   // index of the track of the current event. See MidiTrackCursor.track.
+    byte _nextTrack;    // index the next MTrk chunk openChunk() opens will have.
+    
+    errcode_t _errorCode; // the error of the last call that failed, or ER_NONE. See getLastError().
+    byte _errorTrack;     // index of the track being read when the error occurred.
+    unsigned long _errorPosition; // stream position at which the error occurred.
+    boolean _isResync;    // if true, skip past damaged events. See setResync().
+    unsigned long _resyncBytes; // bytes skipped by resyncEvent() since begin().
+    unsigned int _resyncCount;  // number of times resyncEvent() found an event since begin().
+    
+    unsigned long _eventMask; // the event types to return. See ET_MASK().
+    unsigned int _channelMask; // the ET_CHANNEL codes to return. See CH_MASK().
     union eventData _eventData; // data for the current event
+    boolean _payloadByReference; // if true, don't copy variable-length event data.
+    unsigned long _payloadPosition; // stream position of the current event's variable-length data.
+    long _payloadLength; // full length of the current event's variable-length data.
+#ifdef MIDIFILESTREAM_COMPACT
+    char *_pPayload;    // buffer for variable-length event data. See setPayloadBuffer().
+    int _payloadSize;   // size (bytes) of _pPayload.
+#endif
+#ifdef MIDIFILESTREAM_STATS
+    MidiFileStats _stats; // see getStats().
+#endif
+    
+    boolean readHeader();
+    boolean borrowBuffers(boolean isReadBuffer);
+    void giveBackBuffers();
+    int readStreamByte();
+    boolean fillBuffer();
+    boolean fillPrefetchBuffer();
+    void startPrefetch(byte *pBuffer);
+    void cancelPrefetch();
+    long readChunkBytes(char *pDest, long count);
+    long readStreamBytes(char *pDest, long count);
+    long readEventBytes(long length, evbytes_t& bytes);
+    boolean skipChunkBytes(long count);
+    unsigned long getStreamPosition();
+    boolean seekStream(unsigned long position);
+    event_t decodeEvent();
+    void getEventBytes(byte *pBytes);
+    event_t readEventData();
+    event_t readChannelData(int bint);
+    event_t metaEventType(int metaType);
+    boolean isFilteredOut(event_t eventType);
+    event_t readMergedEvent();
+    void saveCursor(MidiTrackCursor *pCursor);
+    boolean isEarlier(MidiTrackCursor *pA, MidiTrackCursor *pB);
+    void siftDown(int i);
+    void resetTempoMap();
+    void addTempoPoint(unsigned long ticks, long uSecPerBeat);
+    void setTempoPoint(MidiTempoPoint *pPoint, MidiTempoPoint *pPrevious, long uSecPerBeat);
+    MidiTempoPoint *findTempoPoint(unsigned long ticks);
+    boolean advanceToTick(unsigned long ticks);
+    boolean probeTrack(MidiFileSummary *pSummary, MidiTrackSummary *pTrack, boolean isFullScan);
+    boolean scanTrack(MidiFileSummary *pSummary, MidiTrackSummary *pTrack);
+    void setError(errcode_t code);
+    event_t resyncEvent();
     
   public:
+    MidiFileStream();
+    void setReadBuffer(byte *pBuffer, int bufferSize, readBlock_t readBlock = 0);
+    void setSeekFunction(seekStream_t seekStream);
+    void setPrefetch(startRead_t startRead, finishRead_t finishRead);
+    void setBufferPool(MidiBufferPool *pPool, int readBufferSize, int payloadBufferSize,
+      readBlock_t readBlock = 0);
+#ifdef MIDIFILESTREAM_COMPACT
+    void setPayloadBuffer(char *pBuffer, int bufferSize);
+#endif
+    void setPayloadByReference(boolean byReference);
+    void setTempoMap(MidiTempoPoint *pPoints, int maxPoints);
+    void setEventFilter(unsigned long eventMask, unsigned int channelMask = CH_MASK_ALL);
+    void setResync(boolean isResync);
     boolean begin(Stream& stream);
+    boolean begin(const byte *pData, unsigned long length);
+    boolean begin_P(const byte *pData, unsigned long length);
+    int probe(Stream& stream, MidiFileSummary *pSummary = 0, boolean isFullScan = false);
     void end();
     chunk_t openChunk();
     event_t readEvent();
     long getChunkBytesLeft();
+    boolean skipChunk();
+    
+    int openTracks(MidiTrackCursor *pCursors, int maxCursors);
+    boolean selectTrack(MidiTrackCursor *pCursor);
+    boolean beginMerge(MidiTrackCursor *pCursors, int numCursors);
+    int decodeTrack(MidiTrackCursor *pCursor, MidiTimedEvent *pEvents, int maxEvents);
+    int mergeTracks(MidiDecodedTrack *pTracks, int numTracks, MidiTimedEvent *pOut, int maxOut);
+    
+    boolean buildIndex(MidiFileIndex *pIndex, unsigned long ticksInterval = 0);
+    boolean seekToTick(MidiFileIndex *pIndex, unsigned long ticks, MidiTrackCursor *pCursors);
+    boolean saveIndex(MidiFileIndex *pIndex, Print& out);
+    boolean loadIndex(MidiFileIndex *pIndex, Stream& in);
     
     int getFormat();
     int getNumTracks();
     int getTicksPerBeat();
+    int getFramesPerSecond();
+    int getTicksPerFrame();
+    int getTempoPointCount();
+    unsigned long ticksToMicros(unsigned long ticks);
     
     event_t getEventType();
     long getEventDeltaTicks();
+    unsigned long getEventTicks();
+    int getEventTrack();
+    unsigned long getEventTimeMicros();
     union eventData *getEventDataP();
+    unsigned long getPayloadPosition();
+    long getPayloadLength();
+    long readPayload(char *pDest, long maxLength, long offset = 0);
+    void getTimedEvent(MidiTimedEvent *pEvent);
+    int readEvents(MidiEventBatch *pBatch, int maxCount);
+    
+    errcode_t getLastError();
+    unsigned long getErrorPosition();
+    int getErrorTrack();
+    void clearError();
+    unsigned long getResyncBytes();
+    unsigned int getResyncCount();
+#ifdef MIDIFILESTREAM_STATS
+    const MidiFileStats *getStats();
+    void resetStats();
+#endif
     
     long readVariableBytes(long, char *pBuffer);
+    long readVariableBytes(long, char *pBuffer, int bufferSize);
     long readFixedLong(int numBytes);
     long readVariableLong();
     int readChunkByte();
@@ -0,0 +1,589 @@
+/*
+ * Stream-based MIDI File writing library.
+ * See MidiFileWriter.h.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ */
+
+#include <MidiFileWriter.h>
+//#define MIDIFILESTREAM_DEBUG 1
+
+/*
+ * Meta event type codes, as they appear in the file.
+ * The text events, ET_TEXT through ET_CUE, are META_TEXT through 0x07.
+ */
+static const byte META_SEQ_NUM = 0x00;
+static const byte META_TEXT = 0x01;
+static const byte META_CHAN_PREFIX = 0x20;
+static const byte META_END_TRACK = 0x2F;
+static const byte META_TEMPO = 0x51;
+static const byte META_SMPTE_OFFSET = 0x54;
+static const byte META_TIME_SIGN = 0x58;
+static const byte META_KEY_SIGN = 0x59;
+
+/*
+ * FAIL(message) records an error and returns false.
+ * The message is printed with MIDIFILESTREAM_DEBUG,
+ * and otherwise left out, to save RAM.
+ */
+#ifdef MIDIFILESTREAM_DEBUG
+#define FAIL(message) fail(message)
+#else
+#define FAIL(message) fail(0)
+#endif
+
+static const unsigned long MAX_VARIABLE = 0x0FFFFFFFUL; // largest variable-length number.
+static const unsigned long MTHD_NUM_TRACKS_POSITION = 10; // file position of the MThd track count.
+
+/*
+ * Returns true if the given length and bytes field
+ * of a text or Sysex event can be written.
+ * With MIDIFILESTREAM_COMPACT, bytes is a pointer that may be 0.
+ */
+static boolean isValidBytes(int length, const char *pBytes) {
+#ifdef MIDIFILESTREAM_COMPACT
+  return length >= 0 && (length == 0 || pBytes != 0);
+#else
+  (void) pBytes;
+  return length >= 0;
+#endif
+}
+
+MidiFileWriter::MidiFileWriter() {
+  _pOut = 0;
+  _seekFunction = 0;
+  _pBuffer = _smallBuffer;
+  _bufferSize = MIDI_WRITER_SMALL_BUFFER;
+  _bufferLength = 0;
+  _flushedLength = 0;
+  _trackStart = 0;
+  _numTracks = 0;
+  _tracksWritten = 0;
+  _runningStatus = 0;
+  _pendingTicks = 0;
+  _isInTrack = false;
+  _isError = false;
+}
+
+/*
+ * Sets the buffer to collect the output in.
+ * The output is written in blocks of bufferSize bytes,
+ * so a multiple of the output's block size (e.g., 512 for an SD card)
+ * works best.
+ *  pBuffer = the buffer, or 0 to use a small internal one
+ *    (see MIDI_WRITER_SMALL_BUFFER).  The caller owns this memory
+ *    and must keep it until end() is called.
+ *  bufferSize = size (bytes) of pBuffer.
+ * Call this before calling begin().
+ */
+void MidiFileWriter::setWriteBuffer(byte *pBuffer, int bufferSize) {
+  if (pBuffer == 0 || bufferSize < MIDI_WRITER_SMALL_BUFFER) {
+    _pBuffer = _smallBuffer;
+    _bufferSize = MIDI_WRITER_SMALL_BUFFER;
+  } else {
+    _pBuffer = pBuffer;
+    _bufferSize = bufferSize;
+  }
+  _bufferLength = 0;
+}
+
+/*
+ * Sets the function to seek the output with, to write the length
+ * of a track that no longer fits in the buffer.
+ *  seekFunction = the function (see seekPrint_t), or 0 for none.
+ */
+void MidiFileWriter::setSeekFunction(seekPrint_t seekFunction) {
+  _seekFunction = seekFunction;
+}
+
+/*
+ * Starts writing a Midi file, and writes its header.
+ *  out = where to write the file, e.g., an SD File open for writing.
+ *    The caller is responsible for opening and closing it.
+ *  format = the file format: 0, 1, or 2.
+ *  numTracks = the number of tracks that will be written.
+ *    If a different number are, end() corrects the header,
+ *    which needs the header still in the buffer or a seek function.
+ *  division = ticks per beat (1..32767), or for SMPTE time,
+ *    -256 * framesPerSecond + ticksPerFrame, as in the file header.
+ * Returns true if successful; false otherwise.
+ */
+boolean MidiFileWriter::begin(Print& out, int format, int numTracks, int division) {
+  _pOut = &out;
+  _bufferLength = 0;
+  _flushedLength = 0;
+  _trackStart = 0;
+  _numTracks = numTracks;
+  _tracksWritten = 0;
+  _runningStatus = 0;
+  _pendingTicks = 0;
+  _isInTrack = false;
+  _isError = false;
+
+  if (format < 0 || format > 2 || numTracks < 0 || division == 0) {
+    return FAIL("Bad Midi file format, number of tracks or division.");
+  }
+
+  putBytes((const byte *) "MThd", 4);
+  putFixed(6L, 4);
+  putFixed((unsigned long) format, 2);
+  putFixed((unsigned long) numTracks, 2);
+  putFixed((unsigned long) division & 0xFFFFUL, 2);
+  return !_isError;
+}
+
+/*
+ * Starts a track (an MTrk chunk).
+ * Returns true if successful; false otherwise.
+ */
+boolean MidiFileWriter::beginTrack() {
+  if (_isError) {
+    return false;
+  }
+  if (_isInTrack) {
+    return FAIL("beginTrack() called inside a track.");
+  }
+
+  _trackStart = getLength();
+  putBytes((const byte *) "MTrk", 4);
+  putFixed(0L, 4);     // the length, written by endTrack().
+  _runningStatus = 0;
+  _pendingTicks = 0;
+  _isInTrack = true;
+  return !_isError;
+}
+
+/*
+ * Writes one event, in the form MidiFileStream reads it.
+ * For example, to copy the current event of a MidiFileStream:
+ *   writer.writeEvent(midiFile.getEventDeltaTicks(),
+ *     eventType, midiFile.getEventDataP());
+ *  deltaTicks = ticks since the previous event of the track.
+ *  eventType = the type of the event (an ET_* value).
+ *    ET_END_TRACK ends the track, as endTrack() does.
+ *    ET_NO_OP writes nothing; its delay is added to that of the next event.
+ *  pData = the data of the event, in the field for its type.
+ *    For text and Sysex events, length bytes of bytes[] are written.
+ * Returns true if successful; false if an error occurs
+ *  or the event can't be written (e.g., ET_UNK or ET_END).
+ */
+boolean MidiFileWriter::writeEvent(unsigned long deltaTicks, event_t eventType,
+    const union eventData *pData) {
+  unsigned long length;
+  byte bytes[5];
+  byte metaType;
+  int power;
+
+  if (_isError) {
+    return false;
+  }
+  if (!_isInTrack) {
+    return FAIL("Event written outside a track.");
+  }
+
+  switch (eventType) {
+
+  case ET_CHANNEL:
+    return writeChannel(deltaTicks, pData->channel.code, (byte) pData->channel.chan,
+        (byte) pData->channel.param1, (byte) pData->channel.param2);
+
+  case ET_TEMPO:
+    return writeTempo(deltaTicks, pData->tempo.uSecPerBeat);
+
+  case ET_END_TRACK:
+    return endTrack(deltaTicks);
+
+  case ET_NO_OP:
+    _pendingTicks += deltaTicks;
+    return true;
+
+  case ET_SYSEX_F0:
+  case ET_SYSEX_ESC:
+    if (!isValidBytes(pData->sysexF0.length, pData->sysexF0.bytes)) {
+      return FAIL("Bad Sysex data.");
+    }
+    length = (unsigned long) pData->sysexF0.length;
+    putDelta(deltaTicks);
+    putByte((eventType == ET_SYSEX_F0) ? 0xF0 : 0xF7);
+    putVariable(length);
+    putBytes((const byte *) pData->sysexF0.bytes, length);
+    _runningStatus = 0;
+    return !_isError;
+
+  case ET_SEQ_NUM:
+    putMeta(deltaTicks, META_SEQ_NUM, 2);
+    putFixed((unsigned long) pData->seqNum.number, 2);
+    return !_isError;
+
+  case ET_CHAN_PREFIX:
+    bytes[0] = (byte) pData->chanPrefix.chan;
+    putMeta(deltaTicks, META_CHAN_PREFIX, 1);
+    putBytes(bytes, 1);
+    return !_isError;
+
+  case ET_SMPTE_OFFSET:
+    bytes[0] = (byte) pData->smpteOffset.hours;
+    bytes[1] = (byte) pData->smpteOffset.minutes;
+    bytes[2] = (byte) pData->smpteOffset.seconds;
+    bytes[3] = (byte) pData->smpteOffset.frames;
+    bytes[4] = (byte) pData->smpteOffset.f100ths;
+    putMeta(deltaTicks, META_SMPTE_OFFSET, 5);
+    putBytes(bytes, 5);
+    return !_isError;
+
+  case ET_TIME_SIGN:
+    // The file holds the denominator as a power of 2.
+    for (power = 0; power < 8 && (1 << power) < (int) pData->timeSign.denom; ++power) {
+    }
+    if ((1 << power) != (int) pData->timeSign.denom) {
+      return FAIL("Time signature denominator is not a power of 2.");
+    }
+    bytes[0] = (byte) pData->timeSign.numer;
+    bytes[1] = (byte) power;
+    bytes[2] = (byte) pData->timeSign.metro;
+    bytes[3] = (byte) pData->timeSign.m32nds;
+    putMeta(deltaTicks, META_TIME_SIGN, 4);
+    putBytes(bytes, 4);
+    return !_isError;
+
+  case ET_KEY_SIGN:
+    bytes[0] = (byte) pData->keySign.numSharps;
+    bytes[1] = pData->keySign.isMinor ? 1 : 0;
+    putMeta(deltaTicks, META_KEY_SIGN, 2);
+    putBytes(bytes, 2);
+    return !_isError;
+
+  case ET_TEXT:
+  case ET_COPYRIGHT:
+  case ET_NAME:
+  case ET_INSTRUMENT:
+  case ET_LYRIC:
+  case ET_MARKER:
+  case ET_CUE:
+    metaType = META_TEXT + (eventType - ET_TEXT);
+    // All the text structures share the layout of dataText.
+    if (!isValidBytes(pData->text.length, pData->text.bytes)) {
+      return FAIL("Bad text data.");
+    }
+    length = (unsigned long) pData->text.length;
+    putMeta(deltaTicks, metaType, length);
+    putBytes((const byte *) pData->text.bytes, length);
+    return !_isError;
+
+  default:
+    break;
+  }
+
+#ifdef MIDIFILESTREAM_DEBUG
+  Serial.print("Can't write event type ");
+  Serial.println((int) eventType);
+#endif
+  _isError = true;
+  return false;
+}
+
+/*
+ * Writes a channel event.  The status byte is left out
+ * if it's the same as that of the previous channel event (running status).
+ *  deltaTicks = ticks since the previous event of the track.
+ *  code = the channel code (a CH_* value).
+ *  chan = the Midi channel (0..15).
+ *  param1 = the first parameter (0..127).
+ *  param2 = the second parameter (0..127);
+ *    ignored for CH_PROG_CHANGE and CH_CHAN_AFTERTOUCH.
+ * Returns true if successful; false otherwise.
+ */
+boolean MidiFileWriter::writeChannel(unsigned long deltaTicks, char code, byte chan,
+    byte param1, byte param2) {
+  byte status;
+
+  if (_isError) {
+    return false;
+  }
+  if (!_isInTrack) {
+    return FAIL("Event written outside a track.");
+  }
+  if (code < CH_NOTE_OFF || code > CH_PITCH_BEND || chan > 15
+      || param1 > 0x7F || param2 > 0x7F) {
+    return FAIL("Bad channel event.");
+  }
+
+  status = (byte) ((code << 4) | chan);
+  putDelta(deltaTicks);
+  if (status != _runningStatus) {
+    putByte(status);
+    _runningStatus = status;
+  }
+  putByte(param1);
+  if (code != CH_PROG_CHANGE && code != CH_CHAN_AFTERTOUCH) {
+    putByte(param2);
+  }
+  return !_isError;
+}
+
+/*
+ * Writes a Tempo event.
+ *  deltaTicks = ticks since the previous event of the track.
+ *  uSecPerBeat = the new tempo, in microseconds per beat.
+ * Returns true if successful; false otherwise.
+ */
+boolean MidiFileWriter::writeTempo(unsigned long deltaTicks, long uSecPerBeat) {
+  if (_isError) {
+    return false;
+  }
+  if (!_isInTrack) {
+    return FAIL("Event written outside a track.");
+  }
+  if (uSecPerBeat <= 0 || uSecPerBeat > 0xFFFFFFL) {
+    return FAIL("Bad tempo.");
+  }
+
+  putMeta(deltaTicks, META_TEMPO, 3);
+  putFixed((unsigned long) uSecPerBeat, 3);
+  return !_isError;
+}
+
+/*
+ * Writes the End of Track event and the length of the track.
+ *  deltaTicks = ticks since the previous event of the track.
+ * Returns true if successful; false otherwise.
+ */
+boolean MidiFileWriter::endTrack(unsigned long deltaTicks) {
+  if (_isError) {
+    return false;
+  }
+  if (!_isInTrack) {
+    return FAIL("endTrack() called outside a track.");
+  }
+
+  putMeta(deltaTicks, META_END_TRACK, 0);
+  patchFixed(_trackStart + 4, getLength() - _trackStart - 8, 4);
+  _isInTrack = false;
+  ++_tracksWritten;
+  return !_isError;
+}
+
+/*
+ * Finishes the file: corrects the track count in the header
+ * if need be, and writes what's left in the buffer.
+ * Note: the caller is responsible for closing the output.
+ * Returns true if the whole file was written successfully;
+ * false if any error occurred.
+ */
+boolean MidiFileWriter::end() {
+  if (_pOut == 0) {
+    return false;
+  }
+  if (!_isError && _isInTrack) {
+    FAIL("end() called before endTrack().");
+  }
+  if (!_isError && _tracksWritten != _numTracks) {
+    patchFixed(MTHD_NUM_TRACKS_POSITION, (unsigned long) _tracksWritten, 2);
+  }
+  if (!_isError) {
+    flush();
+  }
+
+  _pOut = 0;
+  _bufferLength = 0;
+  _isInTrack = false;
+  return !_isError;
+}
+
+/*
+ * Returns the number of bytes of the file so far,
+ * including those still in the buffer.
+ */
+unsigned long MidiFileWriter::getLength() {
+  return _flushedLength + (unsigned long) _bufferLength;
+}
+
+/*
+ * Returns true if an error has occurred since begin().
+ */
+boolean MidiFileWriter::isError() {
+  return _isError;
+}
+
+/*
+ * Adds one byte to the output.
+ * Returns true if successful; false otherwise.
+ */
+boolean MidiFileWriter::putByte(byte b) {
+  if (_bufferLength >= _bufferSize && !flush()) {
+    return false;
+  }
+  _pBuffer[_bufferLength++] = b;
+  return true;
+}
+
+/*
+ * Adds the given bytes to the output.
+ * Returns true if successful; false otherwise.
+ */
+boolean MidiFileWriter::putBytes(const byte *pBytes, unsigned long length) {
+  int n;
+
+  while (length > 0) {
+    if (_bufferLength >= _bufferSize && !flush()) {
+      return false;
+    }
+    n = _bufferSize - _bufferLength;
+    if ((unsigned long) n > length) {
+      n = (int) length;
+    }
+    memcpy(_pBuffer + _bufferLength, pBytes, (size_t) n);
+    _bufferLength += n;
+    pBytes += n;
+    length -= (unsigned long) n;
+  }
+  return true;
+}
+
+/*
+ * Adds a fixed-length number, most significant byte first.
+ *  value = the number.
+ *  numBytes = the number of bytes (1..4) to write.
+ * Returns true if successful; false otherwise.
+ */
+boolean MidiFileWriter::putFixed(unsigned long value, int numBytes) {
+  byte bytes[4];
+  int i;
+
+  for (i = numBytes - 1; i >= 0; --i) {
+    bytes[i] = (byte) value;
+    value >>= 8;
+  }
+  return putBytes(bytes, (unsigned long) numBytes);
+}
+
+/*
+ * Adds a variable-length number: 7 bits per byte,
+ * most significant first, with the top bit set in all but the last byte.
+ * Returns true if successful; false otherwise.
+ */
+boolean MidiFileWriter::putVariable(unsigned long value) {
+  byte bytes[4];
+  int i;
+
+  if (value > MAX_VARIABLE) {
+    return FAIL("Number too large for a variable-length number.");
+  }
+
+  // Fill bytes[] from the end, least significant 7 bits first.
+  i = 3;
+  bytes[i] = (byte) (value & 0x7F);
+  value >>= 7;
+  while (value != 0) {
+    --i;
+    bytes[i] = (byte) (0x80 | (value & 0x7F));
+    value >>= 7;
+  }
+  return putBytes(bytes + i, (unsigned long) (4 - i));
+}
+
+/*
+ * Adds the delay of an event, plus that of any ET_NO_OP events before it.
+ * Returns true if successful; false otherwise.
+ */
+boolean MidiFileWriter::putDelta(unsigned long deltaTicks) {
+  deltaTicks += _pendingTicks;
+  _pendingTicks = 0;
+  return putVariable(deltaTicks);
+}
+
+/*
+ * Adds the start of a Meta event: its delay, type, and data length.
+ * Meta events cancel running status.
+ * Returns true if successful; false otherwise.
+ */
+boolean MidiFileWriter::putMeta(unsigned long deltaTicks, byte metaType, unsigned long length) {
+  _runningStatus = 0;
+  return putDelta(deltaTicks) && putByte(0xFF) && putByte(metaType)
+      && putVariable(length);
+}
+
+/*
+ * Writes the contents of the buffer to the output.
+ * Returns true if successful; false otherwise.
+ */
+boolean MidiFileWriter::flush() {
+  if (_isError) {
+    return false;
+  }
+  if (_bufferLength == 0) {
+    return true;
+  }
+  if (_pOut->write(_pBuffer, (size_t) _bufferLength) != (size_t) _bufferLength) {
+    return FAIL("Error writing the Midi file.");
+  }
+  _flushedLength += (unsigned long) _bufferLength;
+  _bufferLength = 0;
+  return true;
+}
+
+/*
+ * Replaces a fixed-length number written earlier
+ * (the length of a track, or the track count).
+ * The part of it still in the buffer is changed there;
+ * any part already written is rewritten by seeking back to it.
+ *  position = the file position of the number.
+ *  value = its new value.
+ *  numBytes = the number of bytes (1..4) in the number.
+ * Returns true if successful; false otherwise.
+ */
+boolean MidiFileWriter::patchFixed(unsigned long position, unsigned long value, int numBytes) {
+  byte bytes[4];
+  int numFlushed;  // number of bytes[] already written to the output.
+  int i;
+
+  if (_isError) {
+    return false;
+  }
+
+  for (i = numBytes - 1; i >= 0; --i) {
+    bytes[i] = (byte) value;
+    value >>= 8;
+  }
+
+  numFlushed = 0;
+  if (position < _flushedLength) {
+    numFlushed = numBytes;
+    if (_flushedLength - position < (unsigned long) numBytes) {
+      numFlushed = (int) (_flushedLength - position);
+    }
+  }
+
+  if (numFlushed > 0) {
+    if (_seekFunction == 0) {
+      return FAIL("No seek function to go back with: make the buffer larger, or call setSeekFunction().");
+    }
+    if (!(*_seekFunction)(*_pOut, position)
+        || _pOut->write(bytes, (size_t) numFlushed) != (size_t) numFlushed
+        || !(*_seekFunction)(*_pOut, _flushedLength)) {
+      return FAIL("Error seeking to rewrite the Midi file.");
+    }
+  }
+
+  for (i = numFlushed; i < numBytes; ++i) {
+    _pBuffer[position + i - _flushedLength] = bytes[i];
+  }
+  return true;
+}
+
+/*
+ * Records an error, for the caller to return.
+ * Returns false.
+ */
+boolean MidiFileWriter::fail(const char *pMessage) {
+#ifdef MIDIFILESTREAM_DEBUG
+  Serial.println(pMessage);
+#else
+  (void) pMessage;
+#endif
+  _isError = true;
+  return false;
+}
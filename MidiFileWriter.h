@@ -0,0 +1,109 @@
+#ifndef MidiFileWriter_h
+#define MidiFileWriter_h
+
+#include <Arduino.h>
+#include <MidiFileStream.h>
+
+/*
+ * Stream-based MIDI File writing library.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ *
+ * A MidiFileWriter writes a Standard Midi File, one event at a time,
+ * from the same ET_* types and union eventData that MidiFileStream
+ * reads, so a Sketch can record a performance, or copy events
+ * from one file to another.  It encodes delays as variable-length
+ * numbers, leaves out repeated channel status bytes (running status),
+ * and collects the output in a buffer supplied by the caller,
+ * writing it in whole blocks (e.g., one 512-byte SD card sector).
+ *
+ * The length of each track is written once the track ends:
+ * into the buffer, if the start of the track is still there;
+ * otherwise by seeking back to it (see setSeekFunction()).
+ * So without a seek function, each track must fit in the buffer.
+ *
+ * To use:
+ *    byte writeBuffer[512];
+ *    MidiFileWriter writer;
+ *
+ *    writer.setWriteBuffer(writeBuffer, sizeof(writeBuffer));
+ *    writer.setSeekFunction(seekSdWrite);
+ *    writer.begin(file, 0, 1, 480);  // format 0, 1 track, 480 ticks per beat.
+ *    writer.beginTrack();
+ *    writer.writeChannel(0, CH_NOTE_ON, 0, 60, 100);
+ *    writer.writeChannel(480, CH_NOTE_OFF, 0, 60, 0);
+ *    writer.endTrack(0);
+ *    if (!writer.end()) ...report the error...
+ *    file.close();
+ */
+
+/*
+ * Optional function to move the output to a given position,
+ * to go back and write the length of a track.
+ *  out = the Print passed to MidiFileWriter::begin().
+ *  position = the byte offset to move to,
+ *    counted from the output position at the call to begin()
+ *    (normally the start of the file).
+ * Returns true if successful; false otherwise.
+ *
+ * For example, for an SD library File:
+ *  boolean seekSdWrite(Print& out, unsigned long position) {
+ *    return ((File &) out).seek(position);
+ *  }
+ */
+typedef boolean (*seekPrint_t)(Print& out, unsigned long position);
+
+/*
+ * Size (bytes) of the buffer a MidiFileWriter uses
+ * if the caller doesn't supply one (see setWriteBuffer()).
+ * That is, the most bytes a write to the output holds.
+ */
+const int MIDI_WRITER_SMALL_BUFFER = 16;
+
+class MidiFileWriter {
+  private:
+    Print *_pOut;               // where to write the file.
+    seekPrint_t _seekFunction;  // optional function to seek the output, or 0.
+    byte *_pBuffer;             // the write buffer.
+    int _bufferSize;            // size (bytes) of _pBuffer.
+    int _bufferLength;          // number of bytes waiting in _pBuffer.
+    byte _smallBuffer[MIDI_WRITER_SMALL_BUFFER]; // _pBuffer if none is supplied.
+
+    unsigned long _flushedLength; // number of bytes written to _pOut so far.
+    unsigned long _trackStart;    // file position of the current MTrk chunk.
+    int _numTracks;               // the track count written in the header.
+    int _tracksWritten;           // number of tracks ended so far.
+    byte _runningStatus;          // last channel status byte written, or 0.
+    unsigned long _pendingTicks;  // delay of ET_NO_OP events, for the next event.
+    boolean _isInTrack;           // if true, beginTrack() has been called.
+    boolean _isError;             // if true, an error has occurred.
+
+    boolean putByte(byte b);
+    boolean putBytes(const byte *pBytes, unsigned long length);
+    boolean putFixed(unsigned long value, int numBytes);
+    boolean putVariable(unsigned long value);
+    boolean putDelta(unsigned long deltaTicks);
+    boolean putMeta(unsigned long deltaTicks, byte metaType, unsigned long length);
+    boolean flush();
+    boolean patchFixed(unsigned long position, unsigned long value, int numBytes);
+    boolean fail(const char *pMessage);
+
+  public:
+    MidiFileWriter();
+    void setWriteBuffer(byte *pBuffer, int bufferSize);
+    void setSeekFunction(seekPrint_t seekFunction);
+    boolean begin(Print& out, int format, int numTracks, int division);
+    boolean beginTrack();
+    boolean writeEvent(unsigned long deltaTicks, event_t eventType, const union eventData *pData);
+    boolean writeChannel(unsigned long deltaTicks, char code, byte chan, byte param1, byte param2 = 0);
+    boolean writeTempo(unsigned long deltaTicks, long uSecPerBeat);
+    boolean endTrack(unsigned long deltaTicks);
+    boolean end();
+    unsigned long getLength();
+    boolean isError();
+};
+
+#endif
@@ -0,0 +1,352 @@
+/*
+ * A flat, pre-merged playback format for Midi files.
+ * See MidiFlatFile.h.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ */
+
+#include <MidiFlatFile.h>
+//#define MIDIFILESTREAM_DEBUG 1
+
+static const char flatMagic[] = { 'M', 'F', 'S', 'F' };
+
+/*
+ * Writes one record of the flat file.
+ *  delay = microseconds since the previous record:
+ *    at most MIDI_FLAT_MAX_DELAY.
+ */
+static void writeFlatRecord(Print& out, unsigned long delay, event_t type,
+    byte track, const byte *pData) {
+  byte record[MIDI_FLAT_RECORD_SIZE];
+
+  record[0] = (byte) (delay >> 16);
+  record[1] = (byte) (delay >> 8);
+  record[2] = (byte) delay;
+  record[3] = type;
+  record[4] = track;
+  record[5] = pData[0];
+  record[6] = pData[1];
+  record[7] = pData[2];
+  out.write(record, sizeof(record));
+}
+
+/*
+ * Writes the given delay as ET_NO_OP records,
+ * leaving a remainder that fits in one record.
+ * Returns that remainder.
+ */
+static unsigned long writeFlatDelay(Print& out, unsigned long delay) {
+  const byte noData[3] = { 0, 0, 0 };
+
+  while (delay > MIDI_FLAT_MAX_DELAY) {
+    writeFlatRecord(out, MIDI_FLAT_MAX_DELAY, ET_NO_OP, 0, noData);
+    delay -= MIDI_FLAT_MAX_DELAY;
+  }
+  return delay;
+}
+
+/*
+ * Converts a Midi file to the flat format (see MidiFlatFile.h).
+ * Merges the tracks (see MidiFileStream::beginMerge())
+ * and writes one record for each ET_CHANNEL or ET_TEMPO event
+ * that readEvent() returns.  To leave out more events (e.g., all but
+ * notes), call setEventFilter() on midiFile first.
+ * Works wherever there's a Print to write to:
+ * e.g., an SD File on the Arduino, or a file on a computer.
+ *  midiFile = the Midi file, after begin(), with a seek function set
+ *    (see setSeekFunction()) unless it was begun from memory.
+ *  pCursors = array of track cursors for merging.
+ *  maxCursors = the number of elements in pCursors[].
+ *  out = where to write the flat file.
+ * Returns true if successful; false if an error occurs.
+ */
+boolean MidiFlatFile::convert(MidiFileStream& midiFile,
+    MidiTrackCursor *pCursors, int maxCursors, Print& out) {
+  byte header[MIDI_FLAT_HEADER_SIZE];
+  MidiTimedEvent event;
+  unsigned long lastTime; // time of the last record written.
+  unsigned long endTime;  // time of the latest End of Track.
+  event_t eventType;
+  int numTracks;
+
+  numTracks = midiFile.openTracks(pCursors, maxCursors);
+  if (numTracks < 0 || !midiFile.beginMerge(pCursors, numTracks)) {
+#ifdef MIDIFILESTREAM_DEBUG
+    Serial.println("Error opening tracks to convert.");
+#endif
+    return false;
+  }
+
+  memcpy(header, flatMagic, sizeof(flatMagic));
+  header[4] = MIDI_FLAT_VERSION;
+  header[5] = (byte) MIDI_FLAT_RECORD_SIZE;
+  header[6] = 0;
+  header[7] = 0;
+  out.write(header, sizeof(header));
+
+  lastTime = 0;
+  endTime = 0;
+  for (;;) {
+    eventType = midiFile.readEvent();
+    if (eventType == ET_END) {
+      break;
+    }
+    if (eventType == ET_UNK) {
+#ifdef MIDIFILESTREAM_DEBUG
+      Serial.println("Error reading event to convert.");
+#endif
+      return false;
+    }
+    if (eventType == ET_END_TRACK) {
+      if (midiFile.getEventTimeMicros() > endTime) {
+        endTime = midiFile.getEventTimeMicros();
+      }
+      continue;
+    }
+    if (eventType != ET_CHANNEL && eventType != ET_TEMPO) {
+      continue;
+    }
+
+    midiFile.getTimedEvent(&event);
+    writeFlatRecord(out, writeFlatDelay(out, event.time - lastTime),
+        event.type, event.track, event.data);
+    lastTime = event.time;
+  }
+
+  // The End record.
+  if (endTime < lastTime) {
+    endTime = lastTime;
+  }
+  event.data[0] = 0;
+  event.data[1] = 0;
+  event.data[2] = 0;
+  writeFlatRecord(out, writeFlatDelay(out, endTime - lastTime), ET_END, 0, event.data);
+
+  return !out.getWriteError();
+}
+
+MidiFlatReader::MidiFlatReader() {
+  _pStream = 0;
+  _pData = 0;
+  _dataLength = 0;
+  _dataIndex = 0;
+  _pBuffer = 0;
+  _bufferSize = 0;
+  _bufferLength = 0;
+  _bufferIndex = 0;
+  _readBlock = 0;
+  _time = 0;
+  _isEnded = true;
+}
+
+/*
+ * Sets an optional read-ahead buffer, as for
+ * MidiFileStream::setReadBuffer().  A multiple of
+ * MIDI_FLAT_RECORD_SIZE (e.g., 512) works best.
+ * Call this before calling begin().
+ */
+void MidiFlatReader::setReadBuffer(byte *pBuffer, int bufferSize, readBlock_t readBlock) {
+  _pBuffer = pBuffer;
+  _bufferSize = bufferSize;
+  if (_pBuffer == 0 || _bufferSize <= 0) {
+    _pBuffer = 0;
+    _bufferSize = 0;
+  }
+  _readBlock = readBlock;
+  _bufferLength = 0;
+  _bufferIndex = 0;
+}
+
+/*
+ * Starts reading the given, open flat file, and reads its header.
+ * Returns true if successful; false if the stream isn't a flat file.
+ */
+boolean MidiFlatReader::begin(Stream& stream) {
+  _pStream = &stream;
+  _pData = 0;
+  _dataLength = 0;
+  _dataIndex = 0;
+  _bufferLength = 0;
+  _bufferIndex = 0;
+
+  return readHeader();
+}
+
+/*
+ * Starts reading a flat file that's already in memory,
+ * and reads its header.
+ *  pData = the file contents.  The caller owns this memory
+ *    and must keep it until end() is called.
+ *  length = size (bytes) of pData.
+ * Returns true if successful; false if the data isn't a flat file.
+ */
+boolean MidiFlatReader::begin(const byte *pData, unsigned long length) {
+  _pStream = 0;
+  _pData = pData;
+  _dataLength = (pData != 0) ? length : 0;
+  _dataIndex = 0;
+
+  return readHeader();
+}
+
+/*
+ * Stops reading.
+ * Note: the caller is responsible for closing the stream.
+ */
+void MidiFlatReader::end() {
+  _pStream = 0;
+  _pData = 0;
+  _dataLength = 0;
+  _bufferLength = 0;
+  _bufferIndex = 0;
+  _isEnded = true;
+}
+
+/*
+ * Reads and checks the header of the flat file, for begin().
+ * Returns true if successful; false otherwise.
+ */
+boolean MidiFlatReader::readHeader() {
+  byte header[MIDI_FLAT_HEADER_SIZE];
+
+  _time = 0;
+  _isEnded = true;
+
+  if (!readRecord(header)
+      || memcmp(header, flatMagic, sizeof(flatMagic)) != 0
+      || header[4] != MIDI_FLAT_VERSION
+      || header[5] != (byte) MIDI_FLAT_RECORD_SIZE) {
+#ifdef MIDIFILESTREAM_DEBUG
+    Serial.println("Not a flat Midi file, or an unsupported version.");
+#endif
+    return false;
+  }
+
+  _isEnded = false;
+  return true;
+}
+
+/*
+ * Reads the next event of the flat file.
+ *  pEvent = where to store the event.  Its time is in
+ *    microseconds from the start of the file.
+ * Returns the type of the event, as MidiFileStream::readEvent() does:
+ * ET_CHANNEL or ET_TEMPO; ET_END once the end of the file is reached;
+ * ET_UNK if the file ends early or an error occurs.
+ */
+event_t MidiFlatReader::readEvent(MidiTimedEvent *pEvent) {
+  byte record[MIDI_FLAT_RECORD_SIZE];
+
+  if (_isEnded) {
+    pEvent->time = _time;
+    pEvent->type = ET_END;
+    return ET_END;
+  }
+
+  do {
+    if (!readRecord(record)) {
+#ifdef MIDIFILESTREAM_DEBUG
+      Serial.println("Flat Midi file ended without an End record.");
+#endif
+      _isEnded = true;
+      pEvent->type = ET_UNK;
+      return ET_UNK;
+    }
+    _time += ((unsigned long) record[0] << 16)
+        | ((unsigned long) record[1] << 8) | record[2];
+  } while (record[3] == ET_NO_OP);
+
+  pEvent->time = _time;
+  pEvent->type = record[3];
+  pEvent->track = record[4];
+  pEvent->data[0] = record[5];
+  pEvent->data[1] = record[6];
+  pEvent->data[2] = record[7];
+  if (pEvent->type == ET_END) {
+    _isEnded = true;
+  }
+  return pEvent->type;
+}
+
+/*
+ * Reads the next MIDI_FLAT_RECORD_SIZE bytes of the file into pRecord.
+ * Returns true if successful; false at end of file.
+ */
+boolean MidiFlatReader::readRecord(byte *pRecord) {
+  int count;
+  int n;
+  int bint;
+
+  if (_pData != 0) {
+    if (_dataLength - _dataIndex < (unsigned long) MIDI_FLAT_RECORD_SIZE) {
+      return false;
+    }
+    memcpy(pRecord, _pData + _dataIndex, MIDI_FLAT_RECORD_SIZE);
+    _dataIndex += MIDI_FLAT_RECORD_SIZE;
+    return true;
+  }
+  if (_pStream == 0) {
+    return false;
+  }
+
+  if (_pBuffer == 0) {
+    for (count = 0; count < MIDI_FLAT_RECORD_SIZE; ++count) {
+      bint = _pStream->read();
+      if (bint < 0) {
+        return false;
+      }
+      pRecord[count] = (byte) bint;
+    }
+    return true;
+  }
+
+  // Copy from the buffer, refilling it as needed.
+  count = 0;
+  while (count < MIDI_FLAT_RECORD_SIZE) {
+    if (_bufferIndex >= _bufferLength && !fillBuffer()) {
+      return false;
+    }
+    n = _bufferLength - _bufferIndex;
+    if (n > MIDI_FLAT_RECORD_SIZE - count) {
+      n = MIDI_FLAT_RECORD_SIZE - count;
+    }
+    memcpy(pRecord + count, _pBuffer + _bufferIndex, (size_t) n);
+    _bufferIndex += n;
+    count += n;
+  }
+  return true;
+}
+
+/*
+ * Refills the read-ahead buffer from the stream.
+ * Returns true if at least one byte was read;
+ * false at end of file.
+ */
+boolean MidiFlatReader::fillBuffer() {
+  int n;
+
+  _bufferLength = 0;
+  _bufferIndex = 0;
+
+  if (_readBlock != 0) {
+    n = (*_readBlock)(*_pStream, _pBuffer, _bufferSize);
+  } else {
+    n = _pStream->available();
+    if (n > _bufferSize) {
+      n = _bufferSize;
+    }
+    if (n <= 0) {
+      n = 1;  // wait for (or fail on) one byte.
+    }
+    n = (int) _pStream->readBytes((char *) _pBuffer, (size_t) n);
+  }
+
+  if (n <= 0) {
+    return false;
+  }
+  _bufferLength = n;
+  return true;
+}
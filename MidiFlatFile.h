@@ -0,0 +1,74 @@
+#ifndef MidiFlatFile_h
+#define MidiFlatFile_h
+
+#include <Arduino.h>
+#include <MidiFileStream.h>
+
+/*
+ * A flat, pre-merged playback format for Midi files.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ *
+ * MidiFlatFile::convert() reads a Midi file through a MidiFileStream,
+ * merging its tracks, and writes the events a player needs
+ * as fixed-size records with their times already in microseconds.
+ * MidiFlatReader then plays that file back with no variable-length
+ * numbers, running status, tempo map or merging to work out:
+ * each event is the next MIDI_FLAT_RECORD_SIZE bytes of the file.
+ *
+ * The file is a MIDI_FLAT_HEADER_SIZE byte header:
+ *  'M', 'F', 'S', 'F', the version (MIDI_FLAT_VERSION),
+ *  the record size (MIDI_FLAT_RECORD_SIZE), 0, 0
+ * followed by records of MIDI_FLAT_RECORD_SIZE bytes:
+ *  [0..2] = microseconds since the previous record,
+ *    most significant byte first.
+ *  [3] = the event type (ET_*).
+ *  [4] = the track of the event (see MidiTimedEvent.track).
+ *  [5..7] = the event data, as in MidiTimedEvent.data[].
+ * A delay too long for 3 bytes (about 16 seconds) is split
+ * with ET_NO_OP records.  The last record is ET_END,
+ * whose delay is from the last event to the end of the longest track.
+ */
+
+const int MIDI_FLAT_HEADER_SIZE = 8;  // bytes in the flat file header.
+const int MIDI_FLAT_RECORD_SIZE = 8;  // bytes in each flat file event.
+const byte MIDI_FLAT_VERSION = 1;     // the version of the format.
+const unsigned long MIDI_FLAT_MAX_DELAY = 0xFFFFFFUL; // longest delay in one record.
+
+class MidiFlatFile {
+  public:
+    static boolean convert(MidiFileStream& midiFile,
+        MidiTrackCursor *pCursors, int maxCursors, Print& out);
+};
+
+class MidiFlatReader {
+  private:
+    Stream *_pStream;       // the stream being read, or 0 if from memory.
+    const byte *_pData;     // the begin(pData, length) data, or 0.
+    unsigned long _dataLength; // size (bytes) of _pData.
+    unsigned long _dataIndex;  // index in _pData of the next byte to read.
+    byte *_pBuffer;         // optional read-ahead buffer, or 0 if none.
+    int _bufferSize;        // size (bytes) of _pBuffer.
+    int _bufferLength;      // number of valid bytes in _pBuffer.
+    int _bufferIndex;       // index in _pBuffer of the next byte to read.
+    readBlock_t _readBlock; // optional block-read function.
+    unsigned long _time;    // time (microseconds) of the last record read.
+    boolean _isEnded;       // if true, the ET_END record has been read.
+
+    boolean readHeader();
+    boolean readRecord(byte *pRecord);
+    boolean fillBuffer();
+
+  public:
+    MidiFlatReader();
+    void setReadBuffer(byte *pBuffer, int bufferSize, readBlock_t readBlock = 0);
+    boolean begin(Stream& stream);
+    boolean begin(const byte *pData, unsigned long length);
+    void end();
+    event_t readEvent(MidiTimedEvent *pEvent);
+};
+
+#endif
@@ -0,0 +1,250 @@
+/*
+ * Pairs Note On and Note Off events into notes with durations.
+ * See MidiNotePairer.h.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ */
+
+#include <MidiNotePairer.h>
+
+MidiNotePairer::MidiNotePairer() {
+  begin(0, 0);
+}
+
+/*
+ * Starts pairing, with no notes held.
+ *  pPool = where to keep the held notes.  The caller owns
+ *    this array, and must keep it while pairing.
+ *  poolSize = the number of elements in pPool[]:
+ *    at least the most notes held at once.  Lookups stay fast
+ *    while the pool is no more than about 3/4 full.
+ */
+void MidiNotePairer::begin(MidiPendingNote *pPool, int poolSize) {
+  int i;
+
+  memset(_isOn, 0, sizeof(_isOn));
+  _pPool = pPool;
+  _poolSize = (pPool != 0 && poolSize > 0) ? poolSize : 0;
+  for (i = 0; i < _poolSize; ++i) {
+    _pPool[i].velocity = 0;
+  }
+  _numPending = 0;
+  _flushIndex = 0;
+  _numDropped = 0;
+}
+
+/*
+ * Adds the next channel event, in time order.
+ *  ticks = absolute ticks of the event.
+ *  status = the status byte ((code << 4) | chan),
+ *    as in MidiTimedEvent.data[0].
+ *  param1, param2 = the parameters of the event.  Only their low
+ *    7 bits are used, as a damaged file may have the top bit set.
+ *  pNote = where to store the note that this event ends, if any.
+ * Returns true if a note ended, and was stored in *pNote;
+ * false otherwise.  Events other than Note On and Note Off
+ * are ignored.  A Note On of a key that is already held
+ * ends the held note and starts a new one.
+ */
+boolean MidiNotePairer::addEvent(unsigned long ticks, byte status, byte param1, byte param2,
+    MidiNote *pNote) {
+  byte code;
+  byte chan;
+  byte key;
+  byte velocity;
+  boolean isEnded;
+  int i;
+
+  code = (byte) (status >> 4);
+  chan = (byte) (status & 0x0F);
+  key = (byte) (param1 & 0x7F);
+  velocity = (byte) (param2 & 0x7F);
+  if (code != (byte) CH_NOTE_ON && code != (byte) CH_NOTE_OFF) {
+    return false;
+  }
+
+  // End the note that is held on this key, if any.
+  isEnded = false;
+  if (isNoteOn(chan, key)) {
+    i = findPending(chan, key);
+    if (i >= 0) {
+      endNote(i, ticks, pNote);
+      isEnded = true;
+    }
+    setOn(chan, key, false);
+  }
+
+  if (code == (byte) CH_NOTE_OFF || velocity == 0) {
+    return isEnded;  // a Note On of velocity 0 is a Note Off.
+  }
+
+  // Start the new note.
+  if (_numPending >= _poolSize) {
+    ++_numDropped;
+    return isEnded;
+  }
+  for (i = hashIndex(chan, key); _pPool[i].velocity != 0; i = (i + 1 < _poolSize) ? i + 1 : 0) {
+  }
+  _pPool[i].startTicks = ticks;
+  _pPool[i].chan = chan;
+  _pPool[i].key = key;
+  _pPool[i].velocity = velocity;
+  ++_numPending;
+  setOn(chan, key, true);
+
+  return isEnded;
+}
+
+/*
+ * Adds the current event of the given MidiFileStream, as the other
+ * addEvent() does.  Events other than ET_CHANNEL are ignored.
+ * getEventTicks() gives the ticks: so read a format 1 file's
+ * tracks merged (see beginMerge()), or pair each track separately.
+ */
+boolean MidiNotePairer::addEvent(MidiFileStream& midiFile, MidiNote *pNote) {
+  union eventData *pData;
+
+  if (midiFile.getEventType() != ET_CHANNEL) {
+    return false;
+  }
+  pData = midiFile.getEventDataP();
+  return addEvent(midiFile.getEventTicks(),
+      (byte) ((pData->channel.code << 4) | pData->channel.chan),
+      (byte) pData->channel.param1, (byte) pData->channel.param2, pNote);
+}
+
+/*
+ * Ends one of the notes still held, e.g., at the end of the file.
+ *  ticks = absolute ticks at which to end the note.
+ *  pNote = where to store the note.
+ * Returns true if a note was stored; false if none are held.
+ * Call it until it returns false to end them all.
+ */
+boolean MidiNotePairer::flush(unsigned long ticks, MidiNote *pNote) {
+  int n;
+
+  if (_numPending == 0) {
+    _flushIndex = 0;
+    return false;
+  }
+  // Look at each element at most once, so a bad count can't hang.
+  for (n = 0; n < _poolSize && _pPool[_flushIndex].velocity == 0; ++n) {
+    _flushIndex = (_flushIndex + 1 < _poolSize) ? _flushIndex + 1 : 0;
+  }
+  if (n >= _poolSize) {
+    _numPending = 0;
+    _flushIndex = 0;
+    return false;
+  }
+  setOn(_pPool[_flushIndex].chan, _pPool[_flushIndex].key, false);
+  endNote(_flushIndex, ticks, pNote);
+  return true;
+}
+
+/*
+ * Returns true if the given key of the given channel is held.
+ */
+boolean MidiNotePairer::isNoteOn(byte chan, byte key) {
+  return (_isOn[chan & 0x0F][(key & 0x7F) >> 3] & (1 << (key & 0x07))) != 0;
+}
+
+/*
+ * Returns the number of notes held.
+ */
+int MidiNotePairer::getPendingCount() {
+  return _numPending;
+}
+
+/*
+ * Returns the number of Note Ons dropped since begin()
+ * because the pool was full.  Their Note Offs are ignored.
+ */
+unsigned int MidiNotePairer::getDroppedCount() {
+  return _numDropped;
+}
+
+/*
+ * Returns the index in _pPool[] at which to start looking
+ * for the given note.
+ */
+int MidiNotePairer::hashIndex(byte chan, byte key) {
+  unsigned int h;
+
+  // Spread neighboring keys, and the same key on different channels.
+  h = ((unsigned int) key * 31U) ^ ((unsigned int) chan * 97U);
+  return (int) (h % (unsigned int) _poolSize);
+}
+
+/*
+ * Returns the index in _pPool[] of the given held note, or -1 if none.
+ */
+int MidiNotePairer::findPending(byte chan, byte key) {
+  int i;
+  int n;
+
+  i = hashIndex(chan, key);
+  for (n = 0; n < _poolSize && _pPool[i].velocity != 0; ++n) {
+    if (_pPool[i].chan == chan && _pPool[i].key == key) {
+      return i;
+    }
+    i = (i + 1 < _poolSize) ? i + 1 : 0;
+  }
+  return -1;
+}
+
+/*
+ * Frees _pPool[i], moving back any later notes of the same run
+ * that would otherwise no longer be found from their hashIndex().
+ */
+void MidiNotePairer::removePending(int i) {
+  int j;
+  int home;
+
+  _pPool[i].velocity = 0;
+  --_numPending;
+  j = i;
+  for (;;) {
+    j = (j + 1 < _poolSize) ? j + 1 : 0;
+    if (_pPool[j].velocity == 0) {
+      break;
+    }
+    home = hashIndex(_pPool[j].chan, _pPool[j].key);
+    // Leave j where it is if its home is cyclically in (i, j].
+    if ((i < j) ? (home > i && home <= j) : (home > i || home <= j)) {
+      continue;
+    }
+    _pPool[i] = _pPool[j];
+    _pPool[j].velocity = 0;
+    i = j;
+  }
+}
+
+/*
+ * Sets or clears the held bit of the given key.
+ */
+void MidiNotePairer::setOn(byte chan, byte key, boolean isOn) {
+  byte *pBits;
+
+  pBits = &_isOn[chan & 0x0F][(key & 0x7F) >> 3];
+  if (isOn) {
+    *pBits |= (byte) (1 << (key & 0x07));
+  } else {
+    *pBits &= (byte) ~(1 << (key & 0x07));
+  }
+}
+
+/*
+ * Stores the held note _pPool[i], ending at the given ticks,
+ * and frees it.
+ */
+void MidiNotePairer::endNote(int i, unsigned long ticks, MidiNote *pNote) {
+  pNote->startTicks = _pPool[i].startTicks;
+  pNote->durationTicks = ticks - _pPool[i].startTicks;
+  pNote->chan = _pPool[i].chan;
+  pNote->key = _pPool[i].key;
+  pNote->velocity = _pPool[i].velocity;
+  removePending(i);
+}
@@ -0,0 +1,100 @@
+#ifndef MidiNotePairer_h
+#define MidiNotePairer_h
+
+#include <Arduino.h>
+#include <MidiFileStream.h>
+
+/*
+ * Pairs Note On and Note Off events into notes with durations.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ *
+ * A MidiNotePairer is fed the channel events of a file, in time order,
+ * and returns a MidiNote for each note once it ends: when its Note Off
+ * (or Note On of velocity 0) arrives, or when the same key is struck
+ * again on the same channel before then.
+ *
+ * It keeps one bit per key of each channel, so testing whether a key
+ * is held (isNoteOn()) takes one array lookup, and a Note Off
+ * of a key that isn't held costs nothing more.  The start of each
+ * held note is kept in a pool supplied by the caller, a small hash table,
+ * so finding it at the Note Off takes about constant time.  Nothing
+ * is allocated.  If the pool is full, a Note On is dropped
+ * (see getDroppedCount()).
+ *
+ * To use:
+ *    MidiPendingNote pool[32];  // at most 32 notes held at once.
+ *    MidiNotePairer pairer;
+ *    MidiNote note;
+ *
+ *    pairer.begin(pool, 32);
+ *    ...for each event of the file (e.g., after beginMerge())...
+ *    if (pairer.addEvent(midiFile, &note)) {
+ *      draw the note: note.startTicks, note.durationTicks, note.key...
+ *    }
+ *    ...at the end of the file...
+ *    while (pairer.flush(endTicks, &note)) {
+ *      draw the note.
+ *    }
+ */
+
+/*
+ * A note, from its Note On to its Note Off.
+ *  startTicks = absolute ticks of the Note On.
+ *  durationTicks = ticks from the Note On to the Note Off.
+ *  chan = the channel (0..15).
+ *  key = the note number (0..127).
+ *  velocity = the velocity of the Note On (1..127).
+ */
+struct MidiNote {
+  unsigned long startTicks;
+  unsigned long durationTicks;
+  byte chan;
+  byte key;
+  byte velocity;
+};
+
+/*
+ * A note that is being held: one element of the pool
+ * given to MidiNotePairer::begin().
+ *  startTicks = absolute ticks of the Note On.
+ *  chan, key = the note.
+ *  velocity = the velocity of the Note On, or 0 if this element is free.
+ */
+struct MidiPendingNote {
+  unsigned long startTicks;
+  byte chan;
+  byte key;
+  byte velocity;
+};
+
+class MidiNotePairer {
+  private:
+    byte _isOn[16][16];         // a bit per key of each channel: if set, the key is held.
+    MidiPendingNote *_pPool;    // the held notes, hashed by chan and key.
+    int _poolSize;              // the number of elements in _pPool[].
+    int _numPending;            // the number of held notes.
+    int _flushIndex;            // index in _pPool[] that flush() looks at next.
+    unsigned int _numDropped;   // Note Ons dropped because the pool was full.
+
+    int hashIndex(byte chan, byte key);
+    int findPending(byte chan, byte key);
+    void removePending(int i);
+    void setOn(byte chan, byte key, boolean isOn);
+    void endNote(int i, unsigned long ticks, MidiNote *pNote);
+
+  public:
+    MidiNotePairer();
+    void begin(MidiPendingNote *pPool, int poolSize);
+    boolean addEvent(unsigned long ticks, byte status, byte param1, byte param2, MidiNote *pNote);
+    boolean addEvent(MidiFileStream& midiFile, MidiNote *pNote);
+    boolean flush(unsigned long ticks, MidiNote *pNote);
+    boolean isNoteOn(byte chan, byte key);
+    int getPendingCount();
+    unsigned int getDroppedCount();
+};
+
+#endif
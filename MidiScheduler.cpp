@@ -0,0 +1,179 @@
+/*
+ * Real-time event scheduler for MidiFileStream.
+ * 
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ */
+
+#include <MidiScheduler.h>
+
+MidiScheduler::MidiScheduler() {
+  _pMidiFile = 0;
+  _clock = 0;
+  _pQueue = 0;
+  _queueSize = 0;
+  _queueHead = 0;
+  _queueCount = 0;
+  _startMicros = 0;
+  _isStarted = false;
+  _isEnded = true;
+  _isError = false;
+}
+
+/*
+ * Prepares to play events from the given MidiFileStream,
+ * which must already be positioned at its first event.
+ *  midiFile = the source of events.
+ *  pQueue = the read-ahead queue. The caller owns this array.
+ *  queueSize = the number of elements in pQueue[].
+ *    A few events is enough to cover a slow SD card read.
+ *  clock = the playback clock, in microseconds.
+ *
+ * Reads ahead to fill the queue, so that start() can be
+ * called right away.
+ */
+void MidiScheduler::begin(MidiFileStream& midiFile, MidiTimedEvent *pQueue, int queueSize,
+    clockMicros_t clock) {
+  _pMidiFile = &midiFile;
+  _clock = clock;
+  _pQueue = pQueue;
+  _queueSize = queueSize;
+  _queueHead = 0;
+  _queueCount = 0;
+  _startMicros = 0;
+  _isStarted = false;
+  _isEnded = false;
+  _isError = false;
+  
+  while (_queueCount < _queueSize && readAhead()) {
+  }
+}
+
+/*
+ * Stops playing.
+ * Note: the caller is responsible for ending the MidiFileStream.
+ */
+void MidiScheduler::end() {
+  _pMidiFile = 0;
+  _queueHead = 0;
+  _queueCount = 0;
+  _isStarted = false;
+  _isEnded = true;
+}
+
+/*
+ * Starts the playback clock: time 0 of the file is now.
+ */
+void MidiScheduler::start() {
+  _startMicros = (*_clock)();
+  _isStarted = true;
+}
+
+/*
+ * Returns the next event whose time has arrived, if there is one.
+ * Call this often, e.g., in a loop each time through loop().
+ *  pEvent = where to store the event.
+ * Returns true if an event was stored in pEvent;
+ * false if no event is due yet (or playback has finished).
+ *
+ * While no event is due, reads ahead at most one event per call,
+ * so each call takes at most one readEvent() call.
+ */
+boolean MidiScheduler::poll(MidiTimedEvent *pEvent) {
+  unsigned long now;
+
+  if (!_isStarted) {
+    return false;
+  }
+  
+  // If nothing is due, use the idle time to read ahead.
+  now = getPlayMicros();
+  if (_queueCount == 0 || (long) (now - _pQueue[_queueHead].time) < 0) {
+    readAhead();
+    now = getPlayMicros();
+  }
+  
+  if (_queueCount == 0) {
+    return false;
+  }
+  if ((long) (now - _pQueue[_queueHead].time) < 0) {
+    return false;  // not time yet.
+  }
+  
+  *pEvent = _pQueue[_queueHead];
+  ++_queueHead;
+  if (_queueHead >= _queueSize) {
+    _queueHead = 0;
+  }
+  --_queueCount;
+  
+  return true;
+}
+
+/*
+ * Reads one event from the MidiFileStream into the queue.
+ * Returns true if an event was queued;
+ * false if the queue is full or there are no more events.
+ */
+boolean MidiScheduler::readAhead() {
+  event_t eventType;
+  int tail;
+
+  if (_isEnded || _queueCount >= _queueSize) {
+    return false;
+  }
+  
+  do {
+    eventType = _pMidiFile->readEvent();
+  } while (eventType == ET_NO_OP);
+  
+  if (eventType == ET_END || eventType == ET_UNK) {
+    _isEnded = true;
+    _isError = (eventType == ET_UNK);
+    return false;
+  }
+  
+  tail = _queueHead + _queueCount;
+  if (tail >= _queueSize) {
+    tail -= _queueSize;
+  }
+  _pMidiFile->getTimedEvent(&_pQueue[tail]);
+  ++_queueCount;
+  
+  return true;
+}
+
+/*
+ * Returns the current playback time, in microseconds
+ * from the start of the file.
+ */
+unsigned long MidiScheduler::getPlayMicros() {
+  if (!_isStarted) {
+    return 0;
+  }
+  return (*_clock)() - _startMicros;
+}
+
+/*
+ * Returns the number of events read ahead and waiting to be played.
+ */
+int MidiScheduler::getQueueCount() {
+  return _queueCount;
+}
+
+/*
+ * Returns true if all the events have been returned by poll().
+ */
+boolean MidiScheduler::isFinished() {
+  return _isEnded && _queueCount == 0;
+}
+
+/*
+ * Returns true if playback ended because of an error
+ * reading the file.
+ */
+boolean MidiScheduler::isError() {
+  return _isError;
+}
@@ -0,0 +1,77 @@
+#ifndef MidiScheduler_h
+#define MidiScheduler_h
+
+#include <Arduino.h>
+#include <MidiFileStream.h>
+
+/*
+ * Real-time event scheduler for MidiFileStream.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ *
+ * A MidiScheduler owns the playback clock.
+ * Call poll() each time through loop(); it returns each event
+ * when its time arrives.  While no event is due, poll() reads
+ * ahead into a queue of events supplied by the caller,
+ * so that reading the file (e.g., waiting for the SD card)
+ * happens between events rather than when a note is due.
+ *
+ * The MidiFileStream must deliver events in time order:
+ * a format 0 file, or tracks merged by beginMerge().
+ *
+ * To use:
+ *    MidiTimedEvent queue[8];
+ *    MidiScheduler scheduler;
+ *
+ *    ...open the file and call midiFile.beginMerge()...
+ *    scheduler.begin(midiFile, queue, 8);
+ *    scheduler.start();
+ *
+ *    ...in loop()...
+ *    MidiTimedEvent event;
+ *    while (scheduler.poll(&event)) {
+ *      play the event.
+ *    }
+ *    if (scheduler.isFinished()) ...
+ */
+
+/*
+ * A function that returns the current time in microseconds,
+ * such as micros().
+ */
+typedef unsigned long (*clockMicros_t)();
+
+class MidiScheduler {
+  private:
+    MidiFileStream *_pMidiFile; // the source of events.
+    clockMicros_t _clock;       // the playback clock.
+    
+    MidiTimedEvent *_pQueue;   // events read but not yet returned by poll().
+    int _queueSize;            // number of elements in _pQueue[].
+    int _queueHead;            // index in _pQueue[] of the next event to return.
+    int _queueCount;           // number of events in _pQueue[].
+    
+    unsigned long _startMicros; // clock time of the start of the file.
+    boolean _isStarted;  // if true, start() has been called.
+    boolean _isEnded;    // if true, the MidiFileStream has no more events.
+    boolean _isError;    // if true, the MidiFileStream reported an error.
+    
+    boolean readAhead();
+    
+  public:
+    MidiScheduler();
+    void begin(MidiFileStream& midiFile, MidiTimedEvent *pQueue, int queueSize,
+      clockMicros_t clock = micros);
+    void end();
+    void start();
+    boolean poll(MidiTimedEvent *pEvent);
+    
+    unsigned long getPlayMicros();
+    int getQueueCount();
+    boolean isFinished();
+    boolean isError();
+};
+#endif
@@ -0,0 +1,322 @@
+/*
+ * Fast scanner of the events of a Midi track in memory.
+ * See MidiTrackScanner.h.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ */
+
+#include <MidiTrackScanner.h>
+
+/*
+ * Choose how to read variable-length numbers. See MidiTrackScanner.h.
+ */
+#ifndef MIDIFILESTREAM_SCAN
+#define MIDIFILESTREAM_SCAN 0
+#endif
+
+#if MIDIFILESTREAM_SCAN > 0 && !(defined(__GNUC__) && defined(__BYTE_ORDER__) \
+    && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#error "MIDIFILESTREAM_SCAN 1 and 2 need GCC or Clang, on a little-endian processor."
+#endif
+#if MIDIFILESTREAM_SCAN == 2 && !defined(__SSE2__)
+#error "MIDIFILESTREAM_SCAN 2 needs SSE2."
+#endif
+
+#if MIDIFILESTREAM_SCAN == 2
+#include <emmintrin.h>
+#endif
+#if MIDIFILESTREAM_SCAN > 0
+#include <stdint.h>
+#endif
+
+/*
+ * Largest number of bytes in a variable-length number.
+ * As in MidiFileStream::readVariableLong(), this allows one more
+ * than the 4 the standard does.
+ */
+static const int MAX_VARIABLE_BYTES = 5;
+
+/*
+ * Reads a variable-length number a byte at a time.
+ *  p = the first byte of the number.
+ *  left = number of bytes from p to the end of the track.
+ *  pValue = where to store the number.
+ * Returns the number of bytes in the number, or 0 if it's
+ * cut off by the end of the track or longer than MAX_VARIABLE_BYTES.
+ */
+static int scanVariableBytes(const byte *p, unsigned long left, unsigned long *pValue) {
+  unsigned long value;
+  int n;
+
+  value = 0;
+  for (n = 0; n < MAX_VARIABLE_BYTES && (unsigned long) n < left; ++n) {
+    value = (value << 7) | (p[n] & 0x7F);
+    if ((p[n] & 0x80) == 0) {
+      *pValue = value;
+      return n + 1;
+    }
+  }
+  return 0;
+}
+
+#if MIDIFILESTREAM_SCAN > 0
+/*
+ * Returns the value of a variable-length number of n bytes (1..4),
+ * given its first four bytes as loaded from memory
+ * on a little-endian processor.
+ * Packs the 7-bit groups together without a loop.
+ */
+static inline unsigned long packVariable(uint32_t bytes, int n) {
+  uint32_t x;
+
+  x = __builtin_bswap32(bytes) >> (8 * (4 - n)); // last byte in bits 0..7.
+  return (x & 0x7FUL)
+      | ((x >> 1) & 0x3F80UL)
+      | ((x >> 2) & 0x1FC000UL)
+      | ((x >> 3) & 0xFE00000UL);
+}
+#endif
+
+/*
+ * Reads a variable-length number, as scanVariableBytes() does,
+ * several bytes at a time when there are enough bytes left to load.
+ * Numbers of MAX_VARIABLE_BYTES, and any near the end of the track,
+ * are left to scanVariableBytes().
+ */
+static inline int scanVariable(const byte *p, unsigned long left, unsigned long *pValue) {
+  // Nearly all are one byte.
+  if (left > 0 && (p[0] & 0x80) == 0) {
+    *pValue = p[0];
+    return 1;
+  }
+
+#if MIDIFILESTREAM_SCAN == 2
+  if (left >= 16) {
+    uint32_t first4;
+    unsigned int stops;  // a bit set for each byte without its top bit set.
+    int n;
+
+    stops = ~(unsigned int) _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) p)) & 0xFFFFU;
+    n = (stops == 0) ? 17 : __builtin_ctz(stops) + 1;
+    if (n <= 4) {
+      memcpy(&first4, p, 4);
+      *pValue = packVariable(first4, n);
+      return n;
+    }
+    if (n > MAX_VARIABLE_BYTES) {
+      return 0;
+    }
+  }
+#elif MIDIFILESTREAM_SCAN == 1
+  if (left >= 8) {
+    uint64_t word;
+    uint64_t stops;  // the top bit set for each byte without its top bit set.
+    int n;
+
+    memcpy(&word, p, 8);
+    stops = ~word & 0x8080808080808080ULL;
+    n = (stops == 0) ? 9 : __builtin_ctzll(stops) / 8 + 1;
+    if (n <= 4) {
+      *pValue = packVariable((uint32_t) word, n);
+      return n;
+    }
+    if (n > MAX_VARIABLE_BYTES) {
+      return 0;
+    }
+  }
+#endif
+
+  return scanVariableBytes(p, left, pValue);
+}
+
+/*
+ * Finds a track (MTrk chunk) of a Midi file in memory.
+ *  pFile = the whole file.
+ *  fileLength = size (bytes) of pFile.
+ *  track = which track to find: 0 = the first MTrk chunk.
+ *  ppTrack = where to store a pointer to the body of the chunk.
+ *  pTrackLength = where to store the size (bytes) of the body.
+ *    If the file ends early, that's the bytes that are there.
+ * Returns true if successful; false if the file has no such track
+ * or isn't a Midi file.
+ */
+boolean MidiTrackScanner::findTrack(const byte *pFile, unsigned long fileLength, int track,
+    const byte **ppTrack, unsigned long *pTrackLength) {
+  unsigned long offset;
+  unsigned long length;
+
+  if (pFile == 0 || fileLength < 8 || memcmp(pFile, "MThd", 4) != 0) {
+    return false;
+  }
+
+  offset = 0;
+  while (fileLength - offset >= 8) {
+    length = ((unsigned long) pFile[offset + 4] << 24)
+        | ((unsigned long) pFile[offset + 5] << 16)
+        | ((unsigned long) pFile[offset + 6] << 8)
+        | (unsigned long) pFile[offset + 7];
+    if (memcmp(pFile + offset, "MTrk", 4) == 0) {
+      if (track == 0) {
+        *ppTrack = pFile + offset + 8;
+        *pTrackLength = length;
+        if (length > fileLength - offset - 8) {
+          *pTrackLength = fileLength - offset - 8;
+        }
+        return true;
+      }
+      --track;
+    }
+    if (length > fileLength - offset - 8) {
+      break;
+    }
+    offset += 8 + length;
+  }
+  return false;
+}
+
+MidiTrackScanner::MidiTrackScanner() {
+  begin(0, 0);
+}
+
+/*
+ * Starts scanning the body of an MTrk chunk.
+ *  pTrack = the body, e.g., from findTrack().  The caller owns
+ *    this memory and must keep it while scanning.
+ *  length = size (bytes) of pTrack.
+ */
+void MidiTrackScanner::begin(const byte *pTrack, unsigned long length) {
+  _pTrack = pTrack;
+  _length = (pTrack != 0) ? length : 0;
+  _offset = 0;
+  _ticks = 0;
+  _runningStatus = 0;
+  _isError = false;
+}
+
+/*
+ * Scans up to maxCount events, storing for each:
+ *  pOffsets[] = the index in the track of the byte after the event's delay:
+ *    its status byte or, for a channel event under running status,
+ *    its first parameter.  For a Meta event (status 0xFF),
+ *    its Meta type is the next byte.
+ *  pTicks[] = absolute ticks of the event, from the start of the track.
+ *  pStatus[] = the status byte of the event (as it is after
+ *    running status): 0x80..0xEF for a channel event,
+ *    0xF0 or 0xF7 for Sysex, 0xFF for Meta.
+ * Any of the arrays may be 0, to not store that field.
+ * Events are found the way MidiFileStream::readEvent() finds them,
+ * including after the End of Track event, until the track's bytes
+ * run out; but the scanner checks only the structure of the events,
+ * not the contents of Meta events.
+ * Returns the number of events stored: 0 at the end of the track;
+ * -1 if the track is malformed.
+ */
+int MidiTrackScanner::scan(unsigned long *pOffsets, unsigned long *pTicks, byte *pStatus,
+    int maxCount) {
+  const byte *p;
+  unsigned long offset;
+  unsigned long length;
+  unsigned long delta;
+  unsigned long dataLength;
+  unsigned long eventOffset;
+  byte status;
+  boolean isBad;  // if true, the track is malformed.
+  int count;
+  int n;
+
+  if (_isError) {
+    return -1;
+  }
+
+  p = _pTrack;
+  offset = _offset;
+  length = _length;
+  isBad = false;
+  for (count = 0; count < maxCount && offset < length; ++count) {
+    n = scanVariable(p + offset, length - offset, &delta);
+    if (n == 0) {
+      offset = length;  // as readEvent(): a bad delay ends the track.
+      break;
+    }
+    offset += n;
+    if (offset >= length) {
+      isBad = true;  // no event after the delay.
+      break;
+    }
+
+    eventOffset = offset;
+    status = p[offset];
+    if (status == 0xFF || status == 0xF0 || status == 0xF7) {
+      // A Meta or Sysex event: skip its data.  That clears running status.
+      _runningStatus = 0;
+      ++offset;
+      if (status == 0xFF) {
+        ++offset;  // the Meta type.
+      }
+      n = (offset < length) ? scanVariable(p + offset, length - offset, &dataLength) : 0;
+      if (n == 0 || dataLength > length - offset - n
+          || (status == 0xFF && p[eventOffset + 1] == 0x2F && dataLength != 0)) {
+        isBad = true;  // bad length, or End of Track with data.
+        break;
+      }
+      offset += n + dataLength;
+    } else {
+      // A channel event (as readEvent(), anything else counts as one).
+      if ((status & 0x80) != 0) {
+        ++offset;
+      } else if (_runningStatus != 0) {
+        status = _runningStatus;
+      } else {
+        isBad = true;  // running status used, but not active.
+        break;
+      }
+      _runningStatus = status;
+      n = ((status & 0xE0) == 0xC0) ? 1 : 2;  // Program Change and Channel Aftertouch have 1.
+      if (length - offset < (unsigned long) n) {
+        isBad = true;
+        break;
+      }
+      offset += n;
+    }
+
+    _ticks += delta;
+    if (pOffsets != 0) {
+      pOffsets[count] = eventOffset;
+    }
+    if (pTicks != 0) {
+      pTicks[count] = _ticks;
+    }
+    if (pStatus != 0) {
+      pStatus[count] = status;
+    }
+  }
+  _offset = offset;
+
+  // Return the events before a malformed one first,
+  // and -1 on the next call.
+  if (isBad) {
+    _isError = true;
+    if (count == 0) {
+      return -1;
+    }
+  }
+  return count;
+}
+
+/*
+ * Returns the absolute ticks of the last event scanned.
+ * At the end of the track, that's the length of the track in ticks.
+ */
+unsigned long MidiTrackScanner::getTicks() {
+  return _ticks;
+}
+
+/*
+ * Returns true if the track was found to be malformed.
+ */
+boolean MidiTrackScanner::isError() {
+  return _isError;
+}
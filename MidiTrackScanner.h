@@ -0,0 +1,75 @@
+#ifndef MidiTrackScanner_h
+#define MidiTrackScanner_h
+
+#include <Arduino.h>
+#include <MidiFileStream.h>
+
+/*
+ * Fast scanner of the events of a Midi track in memory.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ *
+ * A MidiTrackScanner skims the body of an MTrk chunk that's in memory
+ * and reports where each event starts, its absolute ticks, and its
+ * status byte, without decoding the event data.  It's meant for
+ * jobs over many files, such as indexing or probing a collection
+ * on a computer, where that's all that's needed.
+ *
+ * How the scanner reads variable-length numbers (delays and
+ * Sysex/Meta lengths) is chosen when the library is compiled,
+ * by #define MIDIFILESTREAM_SCAN (e.g., -DMIDIFILESTREAM_SCAN=1):
+ *  0 = a byte at a time, as MidiFileStream::readVariableLong() does.
+ *    The default.
+ *  1 = 8 bytes at a time, in a 64-bit word.
+ *    Needs GCC or Clang, on a little-endian processor.
+ *  2 = 16 bytes at a time, with SSE2 instructions.
+ *    Needs GCC or Clang, with SSE2 (e.g., any x86-64).
+ * All three give the same results.  On the x86-64 computers tried,
+ * 0 was the fastest, even for files of long delays: where each event
+ * starts depends on the length of the number before it, and the
+ * processor can guess ahead through the byte loop, but must wait
+ * for the result of a wide load before it knows where to go next.
+ * 1 and 2 are there to measure on other processors
+ * (see extras/host/benchmark.cpp, option -a).  extras/host/fuzz.cpp
+ * checks each mode's events against readEvent().
+ *
+ * To use:
+ *    const byte *pTrack;
+ *    unsigned long trackLength;
+ *    MidiTrackScanner scanner;
+ *    unsigned long offsets[256], ticks[256];
+ *    byte status[256];
+ *    int n;
+ *
+ *    MidiTrackScanner::findTrack(pFile, fileLength, 0, &pTrack, &trackLength);
+ *    scanner.begin(pTrack, trackLength);
+ *    while ((n = scanner.scan(offsets, ticks, status, 256)) > 0) {
+ *      ...
+ *    }
+ *    if (n < 0) ...the track is malformed...
+ */
+
+class MidiTrackScanner {
+  private:
+    const byte *_pTrack;    // the MTrk chunk body.
+    unsigned long _length;  // size (bytes) of _pTrack.
+    unsigned long _offset;  // index in _pTrack of the next event.
+    unsigned long _ticks;   // absolute ticks of the last event scanned.
+    byte _runningStatus;    // the current running status, or 0 if none.
+    boolean _isError;       // if true, the track is malformed.
+
+  public:
+    static boolean findTrack(const byte *pFile, unsigned long fileLength, int track,
+        const byte **ppTrack, unsigned long *pTrackLength);
+
+    MidiTrackScanner();
+    void begin(const byte *pTrack, unsigned long length);
+    int scan(unsigned long *pOffsets, unsigned long *pTicks, byte *pStatus, int maxCount);
+    unsigned long getTicks();
+    boolean isError();
+};
+
+#endif
@@ -147,6 +147,14 @@ void loop() {
         return;
       }
       
+      // A chunk type we don't know about: skip it.
+      if (chunkType == CT_UNK && midiFile.getChunkBytesLeft() >= 0) {
+        if (midiFile.skipChunk()) {
+          Serial.println("Skipped an unknown chunk.");
+          return;
+        }
+      }
+      
       // File error: Chunk is not a track.
       Serial.println("Failed to open file track.");
     
@@ -0,0 +1,46 @@
+/*
+ * The Arduino core functions declared in the host Arduino.h.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ */
+
+#include <Arduino.h>
+#include <time.h>
+
+HardwareSerial Serial;
+
+static thread_local Print *pSerialCapture = 0; // see HardwareSerial::setCapture().
+
+/*
+ * Sends what the calling thread writes to Serial to pCapture,
+ * or to stdout if pCapture is 0.
+ */
+void HardwareSerial::setCapture(Print *pCapture) {
+  pSerialCapture = pCapture;
+}
+
+size_t HardwareSerial::write(uint8_t b) {
+  if (pSerialCapture != 0) {
+    return pSerialCapture->write(b);
+  }
+  return putchar(b) == EOF ? 0 : 1;
+}
+
+/*
+ * Microseconds since an arbitrary start; wraps as on an Arduino
+ * only if unsigned long is 32 bits.
+ */
+unsigned long micros() {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (unsigned long) now.tv_sec * 1000000UL
+      + (unsigned long) (now.tv_nsec / 1000);
+}
+
+unsigned long millis() {
+  return micros() / 1000UL;
+}
@@ -0,0 +1,124 @@
+#ifndef Arduino_h
+#define Arduino_h
+
+/*
+ * Just enough of the Arduino core to build MidiFileStream
+ * on a computer, for benchmarking and debugging.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ *
+ * Stream::readBytes() calls read() once per byte, as the
+ * Arduino core does, so that counts of read() calls
+ * match what a sketch would do.
+ * Note: int is 32 bits here, not 16 bits as on an AVR.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define DEC 10
+#define HEX 16
+
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *) (p))
+
+unsigned long micros();
+unsigned long millis();
+
+class Print {
+  private:
+    int _writeError;
+
+  public:
+    Print() : _writeError(0) {}
+    virtual ~Print() {}
+
+    virtual size_t write(uint8_t b) = 0;
+    virtual size_t write(const uint8_t *pBuffer, size_t size) {
+      size_t i;
+      for (i = 0; i < size; ++i) {
+        if (write(pBuffer[i]) != 1) {
+          break;
+        }
+      }
+      return i;
+    }
+
+    int getWriteError() { return _writeError; }
+    void clearWriteError() { _writeError = 0; }
+
+    size_t print(const char *s) { return write((const uint8_t *) s, strlen(s)); }
+    size_t print(char c) { return write((uint8_t) c); }
+    size_t print(long n, int base = DEC) { return printNumber(base == HEX ? "%lX" : "%ld", n); }
+    size_t print(unsigned long n, int base = DEC) { return printNumber(base == HEX ? "%lX" : "%lu", n); }
+    size_t print(int n, int base = DEC) { return print((long) n, base); }
+    size_t print(unsigned int n, int base = DEC) { return print((unsigned long) n, base); }
+    size_t print(unsigned char n, int base = DEC) { return print((unsigned long) n, base); }
+
+    size_t println() { return print("\r\n"); }
+    template<class T> size_t println(T value) { return print(value) + println(); }
+    template<class T> size_t println(T value, int base) { return print(value, base) + println(); }
+
+  protected:
+    void setWriteError() { _writeError = 1; }
+
+  private:
+    template<class T> size_t printNumber(const char *pFormat, T n) {
+      char text[24];
+      snprintf(text, sizeof(text), pFormat, n);
+      return print(text);
+    }
+};
+
+class Stream : public Print {
+  public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+
+    void setTimeout(unsigned long) {}
+
+    size_t readBytes(char *pBuffer, size_t length) {
+      size_t count;
+      int c;
+      for (count = 0; count < length; ++count) {
+        c = read();
+        if (c < 0) {
+          break;
+        }
+        pBuffer[count] = (char) c;
+      }
+      return count;
+    }
+    size_t readBytes(uint8_t *pBuffer, size_t length) {
+      return readBytes((char *) pBuffer, length);
+    }
+};
+
+/*
+ * Serial writes to stdout, or to the Print set by setCapture()
+ * for the calling thread: e.g., to collect the MIDIFILESTREAM_DEBUG
+ * messages about each file when reading files in parallel.
+ */
+class HardwareSerial : public Stream {
+  public:
+    static void setCapture(Print *pCapture);
+    void begin(unsigned long) {}
+    size_t write(uint8_t b);
+    int available() { return 0; }
+    int read() { return -1; }
+    int peek() { return -1; }
+    operator bool() { return true; }
+};
+
+extern HardwareSerial Serial;
+
+#endif
@@ -0,0 +1,396 @@
+#ifndef HostStream_h
+#define HostStream_h
+
+/*
+ * Streams for running MidiFileStream on a computer:
+ * MemoryStream reads from memory (e.g., a whole file, loaded once);
+ * PosixFileStream reads from an open file, through stdio;
+ * PosixFileWriter writes a file, through stdio;
+ * MemoryWriter writes into memory.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ *
+ * Both count their read() calls and block reads,
+ * to compare the work different settings of a MidiFileStream
+ * ask of the stream.  Both support seeking and block reads,
+ * in the same form as the SD library's File, so that
+ * hostSeekStream() and hostReadBlock() can be passed to
+ * MidiFileStream::setSeekFunction() and setReadBuffer().
+ * Both can also read a block on a thread of its own, as a DMA
+ * transfer would, for hostStartRead() and hostFinishRead()
+ * (see MidiFileStream::setPrefetch()).
+ */
+
+#include <Arduino.h>
+#include <stdlib.h>
+#include <thread>
+#include <vector>
+
+class HostStream : public Stream {
+  public:
+    unsigned long numReads;      // calls to read().
+    unsigned long numBlockReads; // calls to read(pBuffer, size).
+    unsigned long numSeeks;      // calls to seek().
+
+    HostStream() : numReads(0), numBlockReads(0), numSeeks(0), _readResult(0) {}
+
+    virtual int read(byte *pBuffer, int size) = 0;
+    virtual boolean seek(unsigned long position) = 0;
+    virtual unsigned long size() = 0;
+
+    // Read-only: writes fail.
+    size_t write(uint8_t) { setWriteError(); return 0; }
+
+    void resetCounts() {
+      numReads = 0;
+      numBlockReads = 0;
+      numSeeks = 0;
+    }
+
+    /*
+     * Starts reading a block on another thread, and returns
+     * without waiting.  Nothing else may use the stream
+     * until finishRead() is called.
+     */
+    boolean startRead(byte *pBuffer, int size) {
+      _reader = std::thread([this, pBuffer, size]() {
+        _readResult = read(pBuffer, size);
+      });
+      return true;
+    }
+
+    /*
+     * Waits for the read started by startRead().
+     * Returns the number of bytes read.
+     */
+    int finishRead() {
+      _reader.join();
+      return _readResult;
+    }
+
+  private:
+    std::thread _reader;  // the thread of startRead().
+    int _readResult;      // what the read started by startRead() returned.
+};
+
+class MemoryStream : public HostStream {
+  private:
+    std::vector<byte> _data;
+    unsigned long _position;
+
+  public:
+    MemoryStream() : _position(0) {}
+
+    /*
+     * Reads the whole of the given file into memory.
+     * Returns true if successful; false if not.
+     */
+    boolean load(const char *pPath) {
+      FILE *pFile;
+      byte block[4096];
+      size_t length;
+
+      _data.clear();
+      _position = 0;
+      pFile = fopen(pPath, "rb");
+      if (pFile == 0) {
+        return false;
+      }
+      while ((length = fread(block, 1, sizeof(block), pFile)) > 0) {
+        _data.insert(_data.end(), block, block + length);
+      }
+      boolean isOk = !ferror(pFile);
+      fclose(pFile);
+      return isOk;
+    }
+
+    /*
+     * Uses a copy of the given bytes as the stream contents.
+     */
+    void setData(const byte *pData, unsigned long length) {
+      _data.assign(pData, pData + length);
+      _position = 0;
+    }
+
+    int available() {
+      unsigned long left = _data.size() - _position;
+      return (left > 0x7FFF) ? 0x7FFF : (int) left;
+    }
+
+    int read() {
+      ++numReads;
+      return (_position < _data.size()) ? _data[_position++] : -1;
+    }
+
+    int peek() {
+      return (_position < _data.size()) ? _data[_position] : -1;
+    }
+
+    int read(byte *pBuffer, int size) {
+      unsigned long left;
+
+      ++numBlockReads;
+      left = _data.size() - _position;
+      if ((unsigned long) size > left) {
+        size = (int) left;
+      }
+      if (size > 0) {
+        memcpy(pBuffer, &_data[0] + _position, (size_t) size);
+        _position += (unsigned long) size;
+      }
+      return size;
+    }
+
+    boolean seek(unsigned long position) {
+      ++numSeeks;
+      if (position > _data.size()) {
+        return false;
+      }
+      _position = position;
+      return true;
+    }
+
+    unsigned long size() {
+      return (unsigned long) _data.size();
+    }
+
+    /*
+     * Returns the index of the next byte read() will return.
+     */
+    unsigned long position() {
+      return _position;
+    }
+
+    /*
+     * Returns the stream contents, e.g., for MidiFileStream::begin(pData, length).
+     */
+    const byte *data() {
+      return _data.empty() ? 0 : &_data[0];
+    }
+};
+
+class PosixFileStream : public HostStream {
+  private:
+    FILE *_pFile;
+    unsigned long _size;
+
+  public:
+    PosixFileStream() : _pFile(0), _size(0) {}
+    ~PosixFileStream() { close(); }
+
+    /*
+     * Opens the given file for reading.
+     * Returns true if successful; false if not.
+     */
+    boolean open(const char *pPath) {
+      close();
+      _pFile = fopen(pPath, "rb");
+      if (_pFile == 0) {
+        return false;
+      }
+      fseek(_pFile, 0L, SEEK_END);
+      _size = (unsigned long) ftell(_pFile);
+      fseek(_pFile, 0L, SEEK_SET);
+      return true;
+    }
+
+    void close() {
+      if (_pFile != 0) {
+        fclose(_pFile);
+        _pFile = 0;
+      }
+      _size = 0;
+    }
+
+    int available() {
+      unsigned long left = _size - (unsigned long) ftell(_pFile);
+      return (left > 0x7FFF) ? 0x7FFF : (int) left;
+    }
+
+    int read() {
+      ++numReads;
+      return getc(_pFile);
+    }
+
+    int peek() {
+      int c = getc(_pFile);
+      if (c != EOF) {
+        ungetc(c, _pFile);
+      }
+      return c;
+    }
+
+    int read(byte *pBuffer, int size) {
+      ++numBlockReads;
+      return (int) fread(pBuffer, 1, (size_t) size, _pFile);
+    }
+
+    boolean seek(unsigned long position) {
+      ++numSeeks;
+      return position <= _size && fseek(_pFile, (long) position, SEEK_SET) == 0;
+    }
+
+    unsigned long size() {
+      return _size;
+    }
+};
+
+class PosixFileWriter : public Print {
+  private:
+    FILE *_pFile;
+
+  public:
+    PosixFileWriter() : _pFile(0) {}
+    ~PosixFileWriter() { close(); }
+
+    /*
+     * Creates (or empties) the given file for writing.
+     * Returns true if successful; false if not.
+     */
+    boolean open(const char *pPath) {
+      close();
+      clearWriteError();
+      _pFile = fopen(pPath, "wb");
+      return _pFile != 0;
+    }
+
+    /*
+     * Closes the file.
+     * Returns true if everything was written; false if not.
+     */
+    boolean close() {
+      boolean isOk;
+
+      if (_pFile == 0) {
+        return true;
+      }
+      isOk = fclose(_pFile) == 0;
+      _pFile = 0;
+      if (!isOk) {
+        setWriteError();
+      }
+      return isOk && !getWriteError();
+    }
+
+    size_t write(uint8_t b) {
+      return write(&b, 1);
+    }
+
+    size_t write(const uint8_t *pBuffer, size_t size) {
+      size_t length;
+
+      length = (_pFile != 0) ? fwrite(pBuffer, 1, size, _pFile) : 0;
+      if (length != size) {
+        setWriteError();
+      }
+      return length;
+    }
+
+    boolean seek(unsigned long position) {
+      return _pFile != 0 && fseek(_pFile, (long) position, SEEK_SET) == 0;
+    }
+};
+
+class MemoryWriter : public Print {
+  private:
+    std::vector<byte> _data;
+    unsigned long _position;
+
+  public:
+    unsigned long numWrites; // calls to write(), of either form.
+    unsigned long numSeeks;  // calls to seek().
+
+    MemoryWriter() : _position(0), numWrites(0), numSeeks(0) {}
+
+    /*
+     * Empties the memory, to write another file.
+     */
+    void clear() {
+      _data.clear();
+      _position = 0;
+      clearWriteError();
+    }
+
+    void resetCounts() {
+      numWrites = 0;
+      numSeeks = 0;
+    }
+
+    size_t write(uint8_t b) {
+      return write(&b, 1);
+    }
+
+    size_t write(const uint8_t *pBuffer, size_t size) {
+      ++numWrites;
+      if (_position + size > _data.size()) {
+        _data.resize(_position + size);
+      }
+      memcpy(&_data[0] + _position, pBuffer, size);
+      _position += (unsigned long) size;
+      return size;
+    }
+
+    boolean seek(unsigned long position) {
+      ++numSeeks;
+      if (position > _data.size()) {
+        return false;
+      }
+      _position = position;
+      return true;
+    }
+
+    const byte *data() {
+      return _data.empty() ? 0 : &_data[0];
+    }
+
+    unsigned long size() {
+      return (unsigned long) _data.size();
+    }
+};
+
+/*
+ * A MidiFileStream seek function (see setSeekFunction()) for HostStreams.
+ */
+inline boolean hostSeekStream(Stream& stream, unsigned long position) {
+  return ((HostStream &) stream).seek(position);
+}
+
+/*
+ * A MidiFileWriter seek function (see setSeekFunction())
+ * for PosixFileWriters.
+ */
+inline boolean hostSeekFileWriter(Print& out, unsigned long position) {
+  return ((PosixFileWriter &) out).seek(position);
+}
+
+/*
+ * A MidiFileWriter seek function (see setSeekFunction())
+ * for MemoryWriters.
+ */
+inline boolean hostSeekMemoryWriter(Print& out, unsigned long position) {
+  return ((MemoryWriter &) out).seek(position);
+}
+
+/*
+ * A MidiFileStream block-read function (see setReadBuffer()) for HostStreams.
+ */
+inline int hostReadBlock(Stream& stream, byte *pBuffer, int size) {
+  return ((HostStream &) stream).read(pBuffer, size);
+}
+
+/*
+ * MidiFileStream background-read functions (see setPrefetch())
+ * for HostStreams.
+ */
+inline boolean hostStartRead(Stream& stream, byte *pBuffer, int size) {
+  return ((HostStream &) stream).startRead(pBuffer, size);
+}
+
+inline int hostFinishRead(Stream& stream) {
+  return ((HostStream &) stream).finishRead();
+}
+
+#endif
@@ -0,0 +1,340 @@
+/*
+ * Parser benchmark: times reading every event of a set of Midi files.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ *
+ * Usage: midifile_benchmark [options] file.mid...
+ *  -b size = use a read-ahead buffer of size bytes (default 512; 0 = none).
+ *  -k = fill the buffer with block reads (see setReadBuffer()).
+ *  -f = fill the buffer in the background, a half at a time,
+ *   on a thread of its own (see setPrefetch()).
+ *  -s = set a seek function (see setSeekFunction()).
+ *  -m = read the tracks merged (see beginMerge()); implies -s.
+ *  -p = read from the file through stdio, instead of from memory.
+ *  -n count = read each file count times (default 100).
+ *  -c count = read events in batches of count (see readEvents())
+ *   instead of one at a time (not with -w).
+ *  -a = scan the tracks with a MidiTrackScanner instead of reading
+ *   them with a MidiFileStream (needs none of the other options).
+ *  -w = also write each event read to a copy of the file in memory,
+ *   through a MidiFileWriter with a read-ahead-sized write buffer
+ *   (not with -m).
+ *
+ * For each file, and in total, reports events per second,
+ * bytes per second, and the stream read() and block read calls
+ * per event.  Bytes are those of the whole file, including any
+ * that were skipped.  With -w, also reports the writes per event.
+ */
+
+#include <Arduino.h>
+#include <MidiFileStream.h>
+#include <MidiFileWriter.h>
+#include <MidiTrackScanner.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "HostStream.h"
+
+const int MAX_TRACKS = 64;
+
+static byte readBuffer[32768];
+static byte writeBuffer[32768];
+
+/*
+ * The arrays for -c.
+ */
+const int MAX_BATCH = 4096;
+static unsigned long batchTicks[MAX_BATCH];
+static event_t batchTypes[MAX_BATCH];
+static byte batchStatus[MAX_BATCH];
+static byte batchParam1[MAX_BATCH];
+static byte batchParam2[MAX_BATCH];
+static MidiEventBatch batch = { batchTicks, batchTypes, batchStatus, batchParam1, batchParam2 };
+
+/*
+ * Scans every track of a file in memory with a MidiTrackScanner.
+ * Returns the number of events found, or -1 if an error occurs.
+ */
+static long scanAllEvents(MemoryStream& stream) {
+  MidiTrackScanner scanner;
+  const byte *pTrack;
+  unsigned long trackLength;
+  long numEvents;
+  int track;
+  int n;
+
+  numEvents = 0;
+  for (track = 0; MidiTrackScanner::findTrack(stream.data(), stream.size(), track,
+      &pTrack, &trackLength); ++track) {
+    scanner.begin(pTrack, trackLength);
+    while ((n = scanner.scan(0, batchTicks, batchStatus, MAX_BATCH)) > 0) {
+      numEvents += n;
+    }
+    if (n < 0) {
+      return -1;
+    }
+  }
+  return numEvents;
+}
+
+/*
+ * Totals for one file, or for all of them.
+ */
+struct BenchResult {
+  unsigned long numEvents;
+  unsigned long long numBytes;
+  unsigned long long elapsedMicros;
+  unsigned long long numReads;
+  unsigned long long numBlockReads;
+  unsigned long long numWrites;
+};
+
+/*
+ * Starts writing a copy of the file whose header midiFile has read.
+ * Returns true if successful; false otherwise.
+ */
+static boolean beginCopy(MidiFileStream& midiFile, MidiFileWriter& writer, MemoryWriter& out) {
+  int division;
+
+  if (midiFile.getTicksPerBeat() > 0) {
+    division = midiFile.getTicksPerBeat();
+  } else {
+    division = -256 * midiFile.getFramesPerSecond() + midiFile.getTicksPerFrame();
+  }
+  out.clear();
+  return writer.begin(out, midiFile.getFormat(), midiFile.getNumTracks(), division);
+}
+
+/*
+ * Reads the events of the current track (or merged tracks),
+ * batchSize at a time if batchSize > 0, else one at a time.
+ * Returns the number of events read, or -1 if an error occurs.
+ */
+static long readTrackEvents(MidiFileStream& midiFile, int batchSize,
+    MidiFileWriter *pWriter) {
+  event_t eventType;
+  long numEvents;
+  int n;
+
+  numEvents = 0;
+  if (batchSize > 0) {
+    while ((n = midiFile.readEvents(&batch, batchSize)) > 0) {
+      numEvents += n;
+    }
+    return (midiFile.getEventType() == ET_END) ? numEvents : -1;
+  }
+
+  while ((eventType = midiFile.readEvent()) != ET_END) {
+    if (eventType == ET_UNK) {
+      return -1;
+    }
+    ++numEvents;
+    if (pWriter != 0 && !pWriter->writeEvent(midiFile.getEventDeltaTicks(),
+        eventType, midiFile.getEventDataP())) {
+      return -1;
+    }
+  }
+  return numEvents;
+}
+
+/*
+ * Reads every event of the file once.
+ * Returns the number of events read, or -1 if an error occurs.
+ */
+static long readAllEvents(MidiFileStream& midiFile, HostStream& stream, boolean isMerged,
+    int batchSize, MidiFileWriter *pWriter, MemoryWriter& out) {
+  MidiTrackCursor tracks[MAX_TRACKS];
+  chunk_t chunkType;
+  int numTracks;
+  long numEvents;
+  long n;
+
+  if (!stream.seek(0) || !midiFile.begin(stream)) {
+    return -1;
+  }
+
+  if (isMerged) {
+    numTracks = midiFile.openTracks(tracks, MAX_TRACKS);
+    if (numTracks < 0 || !midiFile.beginMerge(tracks, numTracks)) {
+      return -1;
+    }
+    numEvents = readTrackEvents(midiFile, batchSize, 0);
+    midiFile.end();
+    return numEvents;
+  }
+
+  if (pWriter != 0 && !beginCopy(midiFile, *pWriter, out)) {
+    return -1;
+  }
+  numEvents = 0;
+  while ((chunkType = midiFile.openChunk()) != CT_END) {
+    if (chunkType != CT_MTRK) {
+      if (!midiFile.skipChunk()) {
+        return -1;
+      }
+      continue;
+    }
+    if (pWriter != 0 && !pWriter->beginTrack()) {
+      return -1;
+    }
+    n = readTrackEvents(midiFile, batchSize, pWriter);
+    if (n < 0) {
+      return -1;
+    }
+    numEvents += n;
+  }
+  midiFile.end();
+  if (pWriter != 0 && !pWriter->end()) {
+    return -1;
+  }
+  return numEvents;
+}
+
+static void printResult(const char *pName, BenchResult *pResult) {
+  double seconds;
+  double numEvents;
+
+  seconds = pResult->elapsedMicros / 1e6;
+  if (seconds <= 0.0) {
+    seconds = 1e-6;
+  }
+  numEvents = (pResult->numEvents > 0) ? (double) pResult->numEvents : 1.0;
+  printf("%-32s %10lu events %12.0f events/s %8.2f MB/s %8.3f reads/event %8.4f block reads/event",
+      pName, pResult->numEvents,
+      pResult->numEvents / seconds,
+      pResult->numBytes / seconds / 1e6,
+      pResult->numReads / numEvents,
+      pResult->numBlockReads / numEvents);
+  if (pResult->numWrites > 0) {
+    printf(" %8.4f writes/event", pResult->numWrites / numEvents);
+  }
+  printf("\n");
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: midifile_benchmark [-b size] [-k] [-f] [-s] [-m] [-p] [-n count] [-c count] [-w] [-a] file.mid...\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  MidiFileStream midiFile;
+  MidiFileWriter writer;
+  MemoryWriter copy;
+  MemoryStream memoryStream;
+  PosixFileStream fileStream;
+  HostStream *pStream;
+  BenchResult total;
+  BenchResult result;
+  unsigned long start;
+  long numEvents;
+  int bufferSize;
+  boolean isBlockRead;
+  boolean isPrefetch;
+  boolean isSeek;
+  boolean isMerged;
+  boolean isPosix;
+  boolean isWrite;
+  boolean isScan;
+  int batchSize;
+  int repeat;
+  int option;
+  int i;
+  int file;
+
+  bufferSize = 512;
+  isBlockRead = false;
+  isPrefetch = false;
+  isSeek = false;
+  isMerged = false;
+  isPosix = false;
+  isWrite = false;
+  isScan = false;
+  batchSize = 0;
+  repeat = 100;
+  while ((option = getopt(argc, argv, "b:kfsmpn:c:wa")) != -1) {
+    switch (option) {
+    case 'b': bufferSize = atoi(optarg); break;
+    case 'k': isBlockRead = true; break;
+    case 'f': isPrefetch = true; break;
+    case 's': isSeek = true; break;
+    case 'm': isMerged = true; isSeek = true; break;
+    case 'p': isPosix = true; break;
+    case 'n': repeat = atoi(optarg); break;
+    case 'c': batchSize = atoi(optarg); break;
+    case 'w': isWrite = true; break;
+    case 'a': isScan = true; break;
+    default: usage();
+    }
+  }
+  if (optind >= argc || bufferSize < 0 || bufferSize > (int) sizeof(readBuffer) || repeat < 1
+      || batchSize < 0 || batchSize > MAX_BATCH
+      || (isWrite && (isMerged || batchSize > 0))
+      || (isScan && (isWrite || isMerged || isPosix))
+      || (isPrefetch && bufferSize < 2)) {
+    usage();
+  }
+
+  if (bufferSize > 0) {
+    midiFile.setReadBuffer(readBuffer, bufferSize, isBlockRead ? hostReadBlock : 0);
+  }
+  if (isSeek) {
+    midiFile.setSeekFunction(hostSeekStream);
+  }
+  if (isPrefetch) {
+    midiFile.setPrefetch(hostStartRead, hostFinishRead);
+  }
+  if (isWrite) {
+    writer.setWriteBuffer(writeBuffer, (bufferSize > 0) ? bufferSize : (int) sizeof(writeBuffer));
+    writer.setSeekFunction(hostSeekMemoryWriter);
+  }
+
+  memset(&total, 0, sizeof(total));
+  for (file = optind; file < argc; ++file) {
+    if (isPosix) {
+      if (!fileStream.open(argv[file])) {
+        fprintf(stderr, "Can't open %s\n", argv[file]);
+        return 1;
+      }
+      pStream = &fileStream;
+    } else {
+      if (!memoryStream.load(argv[file])) {
+        fprintf(stderr, "Can't read %s\n", argv[file]);
+        return 1;
+      }
+      pStream = &memoryStream;
+    }
+
+    memset(&result, 0, sizeof(result));
+    pStream->resetCounts();
+    copy.resetCounts();
+    start = micros();
+    for (i = 0; i < repeat; ++i) {
+      numEvents = isScan ? scanAllEvents(memoryStream) : readAllEvents(midiFile, *pStream, isMerged, batchSize, isWrite ? &writer : 0, copy);
+      if (numEvents < 0) {
+        fprintf(stderr, "Error reading %s\n", argv[file]);
+        return 1;
+      }
+      result.numEvents += (unsigned long) numEvents;
+    }
+    result.elapsedMicros = micros() - start;
+    result.numBytes = (unsigned long long) pStream->size() * repeat;
+    result.numReads = pStream->numReads;
+    result.numBlockReads = pStream->numBlockReads;
+    result.numWrites = copy.numWrites;
+    printResult(argv[file], &result);
+
+    total.numEvents += result.numEvents;
+    total.numBytes += result.numBytes;
+    total.elapsedMicros += result.elapsedMicros;
+    total.numReads += result.numReads;
+    total.numBlockReads += result.numBlockReads;
+    total.numWrites += result.numWrites;
+  }
+
+  if (argc - optind > 1) {
+    printResult("total", &total);
+  }
+  return 0;
+}
@@ -0,0 +1,387 @@
+/*
+ * Behavior checks of the helper classes that don't read files:
+ * MidiNotePairer, MidiBufferPool, MidiEventRing and MidiScheduler.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ *
+ * Usage: midifile_check
+ *
+ * Prints each check that fails, then the number of checks and failures.
+ * Exits with status 1 if any check fails.  ctest runs it
+ * (see CMakeLists.txt).
+ */
+
+#include <Arduino.h>
+#include <MidiFileStream.h>
+#include <MidiNotePairer.h>
+#include <MidiBufferPool.h>
+#include <MidiEventRing.h>
+#include <MidiScheduler.h>
+
+static int numChecks;
+static int numFailures;
+
+/*
+ * Counts a check, and reports it if it failed.
+ *  isOk = true if the check passed.
+ *  pWhat = what was checked.
+ */
+static void check(boolean isOk, const char *pWhat) {
+  ++numChecks;
+  if (!isOk) {
+    fprintf(stderr, "failed: %s\n", pWhat);
+    ++numFailures;
+  }
+}
+
+/*
+ * Returns true if the note is the given one.
+ */
+static boolean isNote(const MidiNote& note, unsigned long startTicks,
+    unsigned long durationTicks, byte chan, byte key, byte velocity) {
+  return note.startTicks == startTicks && note.durationTicks == durationTicks
+      && note.chan == chan && note.key == key && note.velocity == velocity;
+}
+
+/*
+ * MidiNotePairer: Note Offs, Note Ons of velocity 0, restrikes,
+ * a full pool and flush().
+ */
+static void checkNotePairer() {
+  const byte noteOn = (byte) (CH_NOTE_ON << 4);
+  const byte noteOff = (byte) (CH_NOTE_OFF << 4);
+  MidiPendingNote pool[4];
+  MidiNotePairer pairer;
+  MidiNote note;
+  int numFlushed;
+
+  pairer.begin(pool, 4);
+  check(!pairer.addEvent(0, noteOn | 1, 60, 100, &note), "a Note On ends no note");
+  check(pairer.isNoteOn(1, 60), "a Note On holds its key");
+  check(!pairer.isNoteOn(0, 60), "a Note On holds only its own channel");
+  check(pairer.addEvent(10, noteOff | 1, 60, 0, &note) && isNote(note, 0, 10, 1, 60, 100),
+      "a Note Off ends the held note");
+  check(!pairer.isNoteOn(1, 60) && pairer.getPendingCount() == 0,
+      "a Note Off frees its key");
+  check(!pairer.addEvent(20, noteOff | 1, 60, 0, &note), "a Note Off of a free key ends nothing");
+
+  pairer.addEvent(30, noteOn | 2, 64, 90, &note);
+  check(pairer.addEvent(35, noteOn | 2, 64, 0, &note) && isNote(note, 30, 5, 2, 64, 90),
+      "a Note On of velocity 0 ends the held note");
+  check(pairer.getPendingCount() == 0, "a Note On of velocity 0 holds no note");
+
+  pairer.addEvent(40, noteOn | 3, 67, 80, &note);
+  check(pairer.addEvent(50, noteOn | 3, 67, 70, &note) && isNote(note, 40, 10, 3, 67, 80),
+      "a restrike ends the held note");
+  check(pairer.isNoteOn(3, 67) && pairer.getPendingCount() == 1, "a restrike holds the new note");
+  check(pairer.addEvent(55, noteOff | 3, 67, 0, &note) && isNote(note, 50, 5, 3, 67, 70),
+      "the Note Off of a restrike ends the new note");
+
+  // A full pool drops the Note On, and ignores its Note Off.
+  pairer.begin(pool, 4);
+  pairer.addEvent(0, noteOn, 60, 100, &note);
+  pairer.addEvent(0, noteOn, 61, 100, &note);
+  pairer.addEvent(0, noteOn, 62, 100, &note);
+  pairer.addEvent(0, noteOn, 63, 100, &note);
+  check(!pairer.addEvent(1, noteOn, 64, 100, &note) && pairer.getDroppedCount() == 1,
+      "a Note On is dropped when the pool is full");
+  check(!pairer.isNoteOn(0, 64) && pairer.getPendingCount() == 4,
+      "a dropped Note On holds no key");
+  check(!pairer.addEvent(2, noteOff, 64, 0, &note), "the Note Off of a dropped note ends nothing");
+
+  numFlushed = 0;
+  while (numFlushed < 5 && pairer.flush(100, &note)) {
+    check(note.startTicks == 0 && note.durationTicks == 100 && note.key >= 60 && note.key <= 63,
+        "flush() ends a held note at the given ticks");
+    ++numFlushed;
+  }
+  check(numFlushed == 4 && pairer.getPendingCount() == 0, "flush() ends every held note once");
+  check(!pairer.isNoteOn(0, 60) && !pairer.isNoteOn(0, 63), "flush() frees the keys");
+
+  // A damaged file: parameters with the top bit set.
+  pairer.begin(pool, 4);
+  pairer.addEvent(0, noteOn, 60 | 0x80, 0x80, &note);
+  check(pairer.getPendingCount() == 0 && !pairer.isNoteOn(0, 60),
+      "a Note On of velocity 0x80 is a Note On of velocity 0");
+  pairer.addEvent(10, noteOn, 61, 0x80 | 100, &note);
+  check(pairer.addEvent(20, noteOff, 61 | 0x80, 0, &note) && isNote(note, 10, 10, 0, 61, 100),
+      "parameters are masked to 7 bits");
+  check(!pairer.flush(30, &note) && pairer.getPendingCount() == 0, "flush() ends with nothing held");
+}
+
+/*
+ * MidiBufferPool: borrow() and giveBack(), fragmentation,
+ * and the MIDI_POOL_MAX_BLOCKS limit.
+ */
+static void checkBufferPool() {
+  const int BLOCK = 2 * (int) sizeof(unsigned long);
+  static unsigned long memory[(MIDI_POOL_MAX_BLOCKS + 8) * 2];
+  MidiBufferPool pool;
+  byte *pBase;
+  byte *pA;
+  byte *pB;
+  byte *pC;
+  byte *pD;
+  byte *pAll;
+
+  pBase = (byte *) memory;
+  pool.begin(memory, sizeof(memory), BLOCK - 1);
+  check(pool.getBlockSize() == BLOCK, "the block size is rounded up to a whole unsigned long");
+  check(pool.getFreeBytes() == MIDI_POOL_MAX_BLOCKS * BLOCK,
+      "blocks past MIDI_POOL_MAX_BLOCKS are not used");
+
+  pA = (byte *) pool.borrow(1);
+  pB = (byte *) pool.borrow(2 * BLOCK);
+  pC = (byte *) pool.borrow(BLOCK);
+  check(pA == pBase && pB == pBase + BLOCK && pC == pBase + 3 * BLOCK,
+      "borrow() lends whole blocks, first fit");
+  check(pool.getFreeBytes() == (MIDI_POOL_MAX_BLOCKS - 4) * BLOCK, "borrow() uses the blocks");
+
+  // A hole of 2 blocks: a larger buffer goes past it, a smaller one into it.
+  pool.giveBack(pB + BLOCK);
+  check(pool.getFreeBytes() == (MIDI_POOL_MAX_BLOCKS - 4) * BLOCK,
+      "giveBack() ignores a pointer into the middle of a buffer");
+  pool.giveBack(pB);
+  pool.giveBack(pB);
+  check(pool.getFreeBytes() == (MIDI_POOL_MAX_BLOCKS - 2) * BLOCK,
+      "giveBack() frees the buffer's blocks once");
+  pD = (byte *) pool.borrow(3 * BLOCK);
+  check(pD == pBase + 4 * BLOCK, "borrow() skips a hole that's too small");
+  pB = (byte *) pool.borrow(BLOCK + 1);
+  check(pB == pBase + BLOCK, "borrow() fills a hole that's large enough");
+  check(pool.getHighWater() == 7 * BLOCK, "getHighWater() is the most bytes lent at once");
+
+  pool.giveBack(pD);
+  pool.giveBack(pC);
+  pAll = (byte *) pool.borrow((MIDI_POOL_MAX_BLOCKS - 3) * BLOCK);
+  check(pAll == pBase + 3 * BLOCK, "the blocks of buffers given back are lent again as one run");
+  pool.giveBack(pAll);
+
+  // Fragmented: enough free blocks in all, but no run long enough.
+  pC = (byte *) pool.borrow(BLOCK);
+  pool.giveBack(pB);
+  check(pC == pBase + 3 * BLOCK && pool.getFreeBytes() == (MIDI_POOL_MAX_BLOCKS - 2) * BLOCK,
+      "a buffer given back leaves a hole");
+  check(pool.borrow((MIDI_POOL_MAX_BLOCKS - 3) * BLOCK) == 0 && pool.getFailures() == 1,
+      "borrow() fails when the free blocks aren't in one run");
+  check(pool.getFreeBytes() == (MIDI_POOL_MAX_BLOCKS - 2) * BLOCK,
+      "a failed borrow() uses no blocks");
+  check(pool.borrow(0) == 0 && pool.getFailures() == 2, "borrow() of 0 bytes fails");
+  pool.giveBack(pA);
+  pool.giveBack(pC);
+  pool.giveBack(pBase + MIDI_POOL_MAX_BLOCKS * BLOCK);
+  pool.giveBack(0);
+  check(pool.getFreeBytes() == MIDI_POOL_MAX_BLOCKS * BLOCK, "giveBack() of each buffer frees them all");
+
+  // A buffer of every block: the widest run of bits.
+  pAll = (byte *) pool.borrow(MIDI_POOL_MAX_BLOCKS * BLOCK);
+  check(pAll == pBase && pool.getFreeBytes() == 0, "borrow() can lend every block at once");
+  check(pool.borrow(1) == 0, "borrow() fails when every block is lent");
+  pool.giveBack(pAll);
+  check(pool.getFreeBytes() == MIDI_POOL_MAX_BLOCKS * BLOCK, "giveBack() frees every block");
+  check(pool.borrow(MIDI_POOL_MAX_BLOCKS * BLOCK + 1) == 0, "borrow() fails for more than the pool holds");
+
+  // A pool smaller than MIDI_POOL_MAX_BLOCKS.
+  pool.begin(memory, 3 * BLOCK + 1, BLOCK);
+  check(pool.getFreeBytes() == 3 * BLOCK && pool.getHighWater() == 0 && pool.getFailures() == 0,
+      "begin() uses only whole blocks, and resets the counts");
+  check(pool.borrow(4 * BLOCK) == 0 && pool.borrow(3 * BLOCK) == pBase,
+      "borrow() lends no more blocks than the pool has");
+}
+
+/*
+ * Returns an event whose time is the given number.
+ */
+static MidiTimedEvent numberedEvent(unsigned long number) {
+  MidiTimedEvent event;
+
+  event.time = number;
+  event.type = ET_CHANNEL;
+  event.track = 0;
+  event.data[0] = (byte) (CH_NOTE_ON << 4);
+  event.data[1] = (byte) (number & 0x7F);
+  event.data[2] = 100;
+  return event;
+}
+
+/*
+ * MidiEventRing: push() and pop() across the wrap of the indexes,
+ * a full ring, getHighWater(), getUnderruns(), close() and isFinished().
+ */
+static void checkEventRing() {
+  static MidiEventRing<4> ring;
+  static MidiEventRing<128> bigRing;
+  MidiTimedEvent event;
+  const MidiTimedEvent *pEvent;
+  unsigned long nextPushed;
+  unsigned long nextPopped;
+  boolean isInOrder;
+  int i;
+
+  check(ring.isEmpty() && ring.getSize() == 4 && ring.peek() == 0 && !ring.pop(&event),
+      "a new ring is empty");
+  check(ring.getUnderruns() == 0, "an empty ring before the first event is no underrun");
+
+  // Push and pop a few at a time, so the byte indexes wrap past 255.
+  nextPushed = 0;
+  nextPopped = 0;
+  isInOrder = true;
+  for (i = 0; i < 300; ++i) {
+    while (nextPushed - nextPopped < (unsigned long) (i % 4) + 1) {
+      if (!ring.push(numberedEvent(nextPushed))) {
+        isInOrder = false;
+      }
+      ++nextPushed;
+    }
+    while (nextPopped + (i % 3) < nextPushed) {
+      pEvent = ring.peek();
+      if (pEvent == 0 || pEvent->time != nextPopped || !ring.pop(&event)
+          || event.time != nextPopped || event.data[1] != (byte) (nextPopped & 0x7F)) {
+        isInOrder = false;
+      }
+      ++nextPopped;
+    }
+  }
+  check(isInOrder, "events come out in order across the wrap of the indexes");
+  check(ring.getCount() == (int) (nextPushed - nextPopped), "getCount() across the wrap");
+  check(ring.getUnderruns() == 0, "a ring that never runs dry has no underruns");
+  check(ring.getHighWater() == 4, "getHighWater() is the most events in the ring");
+
+  while (ring.push(numberedEvent(nextPushed))) {
+    ++nextPushed;
+  }
+  check(ring.isFull() && ring.getCount() == 4, "push() fails when the ring is full");
+  while (ring.pop(&event)) {
+    check(event.time == nextPopped++, "a full ring empties in order");
+  }
+
+  // Polled dry: many empty peek() and pop() calls are one underrun.
+  for (i = 0; i < 10; ++i) {
+    ring.peek();
+    ring.pop();
+  }
+  check(ring.getUnderruns() == 1, "running dry once is one underrun, however often it's polled");
+  ring.push(numberedEvent(nextPushed++));
+  ring.pop();
+  ring.peek();
+  ring.peek();
+  check(ring.getUnderruns() == 2, "running dry again is another underrun");
+
+  // close(): the last event, then finished, with no more underruns.
+  ring.push(numberedEvent(nextPushed++));
+  ring.close();
+  check(!ring.isFinished(), "a closed ring with an event isn't finished");
+  check(ring.pop(&event) && event.time == nextPushed - 1, "a closed ring gives its last event");
+  check(ring.isFinished() && ring.peek() == 0, "a closed, empty ring is finished");
+  check(ring.getUnderruns() == 2, "an empty ring after close() is no underrun");
+
+  ring.clear();
+  check(ring.isEmpty() && !ring.isFinished() && ring.getHighWater() == 0
+      && ring.getUnderruns() == 0, "clear() empties the ring and resets the counts");
+
+  // The largest ring: the count still fits the byte indexes.
+  for (i = 0; i < 200; ++i) {
+    bigRing.push(numberedEvent((unsigned long) i));
+    bigRing.pop();
+  }
+  for (i = 0; bigRing.push(numberedEvent((unsigned long) i)); ++i) {
+  }
+  check(i == 128 && bigRing.isFull() && bigRing.getCount() == 128 && bigRing.getHighWater() == 128,
+      "a ring of 128 holds 128 events across the wrap of the indexes");
+  check(bigRing.pop(&event) && event.time == 0, "a ring of 128 gives its oldest event");
+}
+
+/*
+ * A format 0 file of 500 ticks per beat at the default tempo,
+ * so that a tick is 1000 microseconds:
+ * a note at 0 to 10 ticks, and a second note at 10 to 210 ticks.
+ */
+static const byte scheduledFile[] = {
+  'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0x01, 0xF4,
+  'M', 'T', 'r', 'k', 0, 0, 0, 21,
+  0x00, 0x90, 60, 100,
+  0x0A, 0x80, 60, 0,
+  0x00, 0x90, 62, 100,
+  0x81, 0x48, 0x80, 62, 0,
+  0x00, 0xFF, 0x2F, 0x00,
+};
+
+static unsigned long fakeMicros;  // the time of fakeClock().
+
+/*
+ * The playback clock of checkScheduler().
+ */
+static unsigned long fakeClock() {
+  return fakeMicros;
+}
+
+/*
+ * Returns true if the scheduler returns an event now,
+ * a Note On or Off of the given key, at the given time.
+ */
+static boolean isReleased(MidiScheduler& scheduler, unsigned long time, byte key) {
+  MidiTimedEvent event;
+
+  return scheduler.poll(&event) && event.type == ET_CHANNEL
+      && event.time == time && event.data[1] == key;
+}
+
+/*
+ * MidiScheduler: each event is returned once its time has come,
+ * not before, including when the clock wraps.
+ */
+static void checkScheduler() {
+  MidiFileStream midiFile;
+  MidiTimedEvent queue[2];
+  MidiTimedEvent event;
+  MidiScheduler scheduler;
+  unsigned long start;
+
+  if (!midiFile.begin(scheduledFile, sizeof(scheduledFile)) || midiFile.openChunk() != CT_MTRK) {
+    check(false, "the scheduler's file opens");
+    return;
+  }
+
+  // Start just before the clock wraps around.
+  start = 0xFFFFFFFFUL - 50000UL;
+  fakeMicros = start - 1000;
+  scheduler.begin(midiFile, queue, 2, fakeClock);
+  check(scheduler.getQueueCount() == 2, "begin() fills the queue");
+  check(!scheduler.poll(&event), "poll() returns nothing before start()");
+
+  fakeMicros = start;
+  scheduler.start();
+  check(isReleased(scheduler, 0, 60), "an event at time 0 is due at start()");
+  check(!scheduler.poll(&event), "an event isn't returned before its time");
+
+  fakeMicros = start + 9999;
+  check(!scheduler.poll(&event), "an event isn't returned a microsecond early");
+  fakeMicros = start + 10000;
+  check(isReleased(scheduler, 10000, 60), "an event is returned at its time");
+  check(isReleased(scheduler, 10000, 62), "events at the same time are returned together");
+  check(!scheduler.poll(&event), "the next event waits for its time");
+
+  fakeMicros = start + 209999;  // past the wrap of the clock.
+  check(!scheduler.poll(&event) && scheduler.getPlayMicros() == 209999,
+      "the play time counts on across the wrap of the clock");
+  fakeMicros = start + 250000;
+  check(isReleased(scheduler, 210000, 62), "a late event is returned as soon as it's polled");
+  check(scheduler.poll(&event) && event.type == ET_END_TRACK && event.time == 210000,
+      "the End of Track is returned at its time");
+  check(!scheduler.poll(&event) && scheduler.isFinished() && !scheduler.isError(),
+      "the scheduler finishes after the last event");
+  midiFile.end();
+}
+
+int main() {
+  checkNotePairer();
+  checkBufferPool();
+  checkEventRing();
+  checkScheduler();
+
+  printf("%d checks, %d failures\n", numChecks, numFailures);
+  return (numFailures == 0) ? 0 : 1;
+}
@@ -0,0 +1,337 @@
+/*
+ * Corpus driver: probes and validates many Midi files in parallel.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ *
+ * Usage: midifile_corpus [-j threads] [-l list] [-q] [file.mid...]
+ *  -j threads = the number of worker threads
+ *   (default: the number of processors).
+ *  -l list = also process the files named in list, one per line
+ *   ("-" = standard input).
+ *  -q = print only the files with errors, and the totals.
+ *
+ * Each file is read with a full probe() (see MidiFileStream::probe()),
+ * which reads every event.  For each file, prints a tab-separated line:
+ *  path, "ok", format, tracks, notes, seconds, name
+ * or
+ *  path, "error", the MIDIFILESTREAM_DEBUG messages about the file.
+ * Then prints the totals, and the MidiFileStats of all the files,
+ * to standard error.
+ *
+ * The files are split into one contiguous shard per thread.
+ * A thread takes files from the front of its own shard and,
+ * once that is empty, from the fronts of the others' (work stealing).
+ * Taking a file is an atomic increment, so no thread waits for another,
+ * and each thread has its own MidiFileStream, stream and buffer.
+ * Each file's result goes in its own slot, and the totals are atomic,
+ * so nothing is locked; results print in file order once all are done.
+ */
+
+#include <Arduino.h>
+#include <MidiFileStream.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "HostStream.h"
+
+#ifndef MIDIFILESTREAM_STATS
+#error "Build midifile_corpus with MIDIFILESTREAM_STATS (see CMakeLists.txt)."
+#endif
+
+const int READ_BUFFER_SIZE = 4096;
+
+/*
+ * A Print that appends to a string, to capture Serial messages.
+ */
+class StringPrint : public Print {
+  public:
+    std::string text;
+
+    size_t write(uint8_t b) {
+      text += (char) b;
+      return 1;
+    }
+};
+
+/*
+ * What was found about one file.
+ */
+struct FileResult {
+  boolean isOk;
+  MidiFileSummary summary;
+  std::string messages;  // Serial output while reading the file.
+};
+
+/*
+ * The files still to take, of one thread's shard.
+ * Padded so that threads taking from different shards
+ * don't share a cache line.
+ */
+struct Shard {
+  std::atomic<size_t> next;
+  size_t end;
+  char padding[64];
+};
+
+/*
+ * Totals over all files, added to by every thread.
+ */
+struct Totals {
+  std::atomic<unsigned long long> numFiles;
+  std::atomic<unsigned long long> numErrors;
+  std::atomic<unsigned long long> numBytes;
+  std::atomic<unsigned long long> numNotes;
+  std::atomic<unsigned long long> bytesRead;
+  std::atomic<unsigned long long> numReads;
+  std::atomic<unsigned long long> numBlockReads;
+  std::atomic<unsigned long long> numSeeks;
+  std::atomic<unsigned long long> bytesSkipped;
+  std::atomic<unsigned long long> numTruncated;
+  std::atomic<unsigned long long> numEvents[ET_NUM_TYPES];
+  std::atomic<unsigned long> maxEventMicros;
+};
+
+static std::vector<std::string> paths;
+static std::vector<FileResult> results;
+static std::vector<Shard> shards;
+static Totals totals;
+
+/*
+ * Probes one file, storing what's found in its result slot.
+ */
+static void processFile(MidiFileStream& midiFile, PosixFileStream& stream, size_t file) {
+  FileResult *pResult;
+  StringPrint messages;
+
+  pResult = &results[file];
+  memset(&pResult->summary, 0, sizeof(pResult->summary));
+  HardwareSerial::setCapture(&messages);
+  if (!stream.open(paths[file].c_str())) {
+    messages.println("Can't open the file.");
+    pResult->isOk = false;
+  } else {
+    pResult->isOk = midiFile.probe(stream, &pResult->summary, true) >= 0;
+    midiFile.end();
+    totals.numBytes.fetch_add(stream.size(), std::memory_order_relaxed);
+    stream.close();
+  }
+  HardwareSerial::setCapture(0);
+  pResult->messages = messages.text;
+
+  totals.numFiles.fetch_add(1, std::memory_order_relaxed);
+  if (pResult->isOk) {
+    totals.numNotes.fetch_add(pResult->summary.numNotes, std::memory_order_relaxed);
+  } else {
+    totals.numErrors.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+/*
+ * Adds the stats of one thread's MidiFileStream to the totals.
+ */
+static void addStats(const MidiFileStats *pStats) {
+  unsigned long max;
+  int i;
+
+  totals.bytesRead.fetch_add(pStats->bytesRead, std::memory_order_relaxed);
+  totals.numReads.fetch_add(pStats->numReads, std::memory_order_relaxed);
+  totals.numBlockReads.fetch_add(pStats->numBlockReads, std::memory_order_relaxed);
+  totals.numSeeks.fetch_add(pStats->numSeeks, std::memory_order_relaxed);
+  totals.bytesSkipped.fetch_add(pStats->bytesSkipped, std::memory_order_relaxed);
+  totals.numTruncated.fetch_add(pStats->numTruncated, std::memory_order_relaxed);
+  for (i = 0; i < ET_NUM_TYPES; ++i) {
+    totals.numEvents[i].fetch_add(pStats->numEvents[i], std::memory_order_relaxed);
+  }
+  max = totals.maxEventMicros.load(std::memory_order_relaxed);
+  while (pStats->maxEventMicros > max
+      && !totals.maxEventMicros.compare_exchange_weak(max, pStats->maxEventMicros)) {
+  }
+}
+
+/*
+ * The work of one thread: its own shard, then the others'.
+ */
+static void worker(int self) {
+  MidiFileStream midiFile;
+  PosixFileStream stream;
+  std::vector<byte> readBuffer(READ_BUFFER_SIZE);
+  int numShards;
+  int victim;
+  int i;
+  size_t file;
+
+  midiFile.setReadBuffer(&readBuffer[0], READ_BUFFER_SIZE, hostReadBlock);
+  midiFile.setSeekFunction(hostSeekStream);
+
+  numShards = (int) shards.size();
+  for (i = 0; i < numShards; ++i) {
+    victim = (self + i) % numShards;
+    for (;;) {
+      file = shards[victim].next.fetch_add(1, std::memory_order_relaxed);
+      if (file >= shards[victim].end) {
+        break;
+      }
+      processFile(midiFile, stream, file);
+    }
+  }
+
+  addStats(midiFile.getStats());
+}
+
+/*
+ * Adds the paths listed in the given file, one per line.
+ * Returns true if successful; false if the file can't be read.
+ */
+static boolean readList(const char *pListPath) {
+  FILE *pList;
+  char line[4096];
+  size_t length;
+
+  pList = (strcmp(pListPath, "-") == 0) ? stdin : fopen(pListPath, "r");
+  if (pList == 0) {
+    return false;
+  }
+  while (fgets(line, sizeof(line), pList) != 0) {
+    length = strlen(line);
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+      line[--length] = '\0';
+    }
+    if (length > 0) {
+      paths.push_back(line);
+    }
+  }
+  if (pList != stdin) {
+    fclose(pList);
+  }
+  return true;
+}
+
+/*
+ * Prints the result of one file, as described at the top of this file.
+ */
+static void printResult(size_t file, boolean isQuiet) {
+  const FileResult *pResult;
+  std::string messages;
+  size_t i;
+
+  pResult = &results[file];
+  if (pResult->isOk) {
+    if (!isQuiet) {
+      printf("%s\tok\t%d\t%d\t%lu\t%lu.%03lu\t%s\n", paths[file].c_str(),
+          pResult->summary.format, pResult->summary.numTrackChunks,
+          pResult->summary.numNotes,
+          pResult->summary.durationMicros / 1000000UL,
+          (pResult->summary.durationMicros / 1000UL) % 1000UL,
+          pResult->summary.name);
+    }
+    return;
+  }
+
+  // One line per file: join the messages with "; ".
+  for (i = 0; i < pResult->messages.size(); ++i) {
+    char c = pResult->messages[i];
+    if (c == '\r') {
+      continue;
+    }
+    if (c == '\n') {
+      if (i + 1 < pResult->messages.size()) {
+        messages += "; ";
+      }
+      continue;
+    }
+    messages += c;
+  }
+  printf("%s\terror\t%s\n", paths[file].c_str(), messages.c_str());
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: midifile_corpus [-j threads] [-l list] [-q] [file.mid...]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::thread> threads;
+  unsigned long start;
+  double seconds;
+  boolean isQuiet;
+  int numThreads;
+  int option;
+  int i;
+  size_t file;
+  size_t shardSize;
+
+  numThreads = (int) std::thread::hardware_concurrency();
+  isQuiet = false;
+  while ((option = getopt(argc, argv, "j:l:q")) != -1) {
+    switch (option) {
+    case 'j': numThreads = atoi(optarg); break;
+    case 'l':
+      if (!readList(optarg)) {
+        fprintf(stderr, "Can't read %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'q': isQuiet = true; break;
+    default: usage();
+    }
+  }
+  for (i = optind; i < argc; ++i) {
+    paths.push_back(argv[i]);
+  }
+  if (paths.empty()) {
+    usage();
+  }
+  if (numThreads < 1) {
+    numThreads = 1;
+  }
+  if ((size_t) numThreads > paths.size()) {
+    numThreads = (int) paths.size();
+  }
+
+  results.resize(paths.size());
+  shards = std::vector<Shard>((size_t) numThreads);
+  shardSize = (paths.size() + numThreads - 1) / numThreads;
+  for (i = 0; i < numThreads; ++i) {
+    shards[i].next = (size_t) i * shardSize;
+    shards[i].end = ((size_t) (i + 1) * shardSize < paths.size())
+        ? (size_t) (i + 1) * shardSize : paths.size();
+  }
+
+  start = micros();
+  for (i = 0; i < numThreads; ++i) {
+    threads.push_back(std::thread(worker, i));
+  }
+  for (i = 0; i < numThreads; ++i) {
+    threads[i].join();
+  }
+  seconds = (micros() - start) / 1e6;
+  if (seconds <= 0.0) {
+    seconds = 1e-6;
+  }
+
+  for (file = 0; file < paths.size(); ++file) {
+    printResult(file, isQuiet);
+  }
+
+  fprintf(stderr, "%llu files, %llu errors, %llu notes, %d threads: %.3f s, %.0f files/s, %.2f MB/s\n",
+      totals.numFiles.load(), totals.numErrors.load(), totals.numNotes.load(),
+      numThreads, seconds, totals.numFiles.load() / seconds,
+      totals.numBytes.load() / seconds / 1e6);
+  fprintf(stderr, "stats: %llu bytes read, %llu skipped, %llu reads, %llu block reads, %llu seeks, %llu truncated, %lu us longest event\n",
+      totals.bytesRead.load(), totals.bytesSkipped.load(), totals.numReads.load(),
+      totals.numBlockReads.load(), totals.numSeeks.load(), totals.numTruncated.load(),
+      totals.maxEventMicros.load());
+  fprintf(stderr, "events:");
+  for (i = 0; i < ET_NUM_TYPES; ++i) {
+    fprintf(stderr, " %llu", totals.numEvents[i].load());
+  }
+  fprintf(stderr, " (by ET_* type)\n");
+
+  return (totals.numErrors.load() > 0) ? 1 : 0;
+}
@@ -0,0 +1,309 @@
+/*
+ * Parallel track decoder: decodes each track of a Midi file
+ * on its own thread, then merges them into one timeline.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ *
+ * Usage: midifile_decode [-j threads] [-n count] file.mid...
+ *  -j threads = the number of decoding threads
+ *   (default: the number of processors).
+ *  -n count = decode each file count times (default 100).
+ *
+ * For each file, and in total, reports the events per second of
+ *  serial = beginMerge(), then readEvent() and getTimedEvent() per event;
+ *  parallel = decodeTrack() of each track on one of the threads,
+ *    then mergeTracks(),
+ * and checks that both give the same events.
+ *
+ * The file is loaded into memory once, and each thread has its own
+ * MidiFileStream begun on that memory.  The threads share the cursors
+ * set by one openTracks() and take the next track to decode
+ * by an atomic increment, so a long track doesn't hold up the rest.
+ */
+
+#include <Arduino.h>
+#include <MidiFileStream.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "HostStream.h"
+
+const int MAX_TRACKS = 255;
+
+/*
+ * Events decoded at a time by decodeTrack();
+ * the event list of a track grows by this much.
+ */
+const int DECODE_BLOCK = 4096;
+
+/*
+ * One run of the parallel decode, shared by its threads.
+ */
+struct DecodeJob {
+  const byte *pData;                 // the Midi file.
+  unsigned long length;              // size (bytes) of pData.
+  MidiTrackCursor cursors[MAX_TRACKS]; // set by openTracks().
+  int numTracks;
+  std::vector<MidiTimedEvent> events[MAX_TRACKS]; // decoded, per track.
+  std::atomic<int> nextTrack;        // the next track to decode.
+  std::atomic<boolean> isError;
+};
+
+/*
+ * Decodes all of one track into its event list.
+ * Returns true if successful; false otherwise.
+ */
+static boolean decodeOneTrack(MidiFileStream& midiFile, DecodeJob *pJob, int track) {
+  std::vector<MidiTimedEvent>& events = pJob->events[track];
+  MidiTrackCursor cursor;
+  size_t count;
+  int n;
+
+  cursor = pJob->cursors[track];  // decodeTrack() moves the cursor.
+  count = 0;
+  do {
+    if (events.size() < count + DECODE_BLOCK) {
+      events.resize(count + DECODE_BLOCK);
+    }
+    n = midiFile.decodeTrack(&cursor, &events[count], DECODE_BLOCK);
+    if (n < 0) {
+      return false;
+    }
+    count += n;
+  } while (n == DECODE_BLOCK);
+  events.resize(count);
+  return true;
+}
+
+/*
+ * The work of one thread: decode tracks until there are none left.
+ */
+static void worker(DecodeJob *pJob) {
+  MidiFileStream midiFile;
+  int track;
+
+  if (!midiFile.begin(pJob->pData, pJob->length)) {
+    pJob->isError = true;
+    return;
+  }
+  for (;;) {
+    track = pJob->nextTrack.fetch_add(1, std::memory_order_relaxed);
+    if (track >= pJob->numTracks) {
+      break;
+    }
+    if (!decodeOneTrack(midiFile, pJob, track)) {
+      pJob->isError = true;
+    }
+  }
+  midiFile.end();
+}
+
+/*
+ * Decodes the file on numThreads threads and merges the tracks.
+ * Returns true if successful; false otherwise.
+ */
+static boolean decodeParallel(DecodeJob *pJob, int numThreads,
+    std::vector<MidiTimedEvent>& out) {
+  MidiFileStream midiFile;
+  MidiDecodedTrack decoded[MAX_TRACKS];
+  std::vector<std::thread> threads;
+  size_t numEvents;
+  int track;
+  int i;
+
+  if (!midiFile.begin(pJob->pData, pJob->length)) {
+    return false;
+  }
+  pJob->numTracks = midiFile.openTracks(pJob->cursors, MAX_TRACKS);
+  if (pJob->numTracks < 0) {
+    return false;
+  }
+  pJob->nextTrack = 0;
+  pJob->isError = false;
+
+  if (numThreads > pJob->numTracks) {
+    numThreads = pJob->numTracks;
+  }
+  for (i = 0; i < numThreads; ++i) {
+    threads.push_back(std::thread(worker, pJob));
+  }
+  for (i = 0; i < numThreads; ++i) {
+    threads[i].join();
+  }
+  if (pJob->isError) {
+    return false;
+  }
+
+  numEvents = 0;
+  for (track = 0; track < pJob->numTracks; ++track) {
+    decoded[track].pEvents = pJob->events[track].empty() ? 0 : &pJob->events[track][0];
+    decoded[track].numEvents = (int) pJob->events[track].size();
+    numEvents += pJob->events[track].size();
+  }
+  out.resize(numEvents);
+  if (numEvents > 0) {
+    out.resize(midiFile.mergeTracks(decoded, pJob->numTracks, &out[0], (int) numEvents));
+  }
+  midiFile.end();
+  return true;
+}
+
+/*
+ * Reads the file with beginMerge(), one event at a time.
+ * Returns true if successful; false otherwise.
+ */
+static boolean decodeSerial(const byte *pData, unsigned long length,
+    std::vector<MidiTimedEvent>& out) {
+  MidiFileStream midiFile;
+  MidiTrackCursor cursors[MAX_TRACKS];
+  MidiTimedEvent event;
+  event_t eventType;
+  int numTracks;
+
+  out.clear();
+  if (!midiFile.begin(pData, length)) {
+    return false;
+  }
+  numTracks = midiFile.openTracks(cursors, MAX_TRACKS);
+  if (numTracks < 0 || !midiFile.beginMerge(cursors, numTracks)) {
+    return false;
+  }
+  while ((eventType = midiFile.readEvent()) != ET_END) {
+    if (eventType == ET_UNK) {
+      return false;
+    }
+    midiFile.getTimedEvent(&event);
+    out.push_back(event);
+  }
+  midiFile.end();
+  return true;
+}
+
+/*
+ * Returns true if the two event lists are the same.
+ */
+static boolean isSame(const std::vector<MidiTimedEvent>& a, const std::vector<MidiTimedEvent>& b) {
+  size_t i;
+
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (i = 0; i < a.size(); ++i) {
+    if (a[i].time != b[i].time || a[i].type != b[i].type || a[i].track != b[i].track
+        || memcmp(a[i].data, b[i].data, sizeof(a[i].data)) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void printResult(const char *pName, unsigned long long numEvents,
+    unsigned long long serialMicros, unsigned long long parallelMicros) {
+  double serialSeconds;
+  double parallelSeconds;
+
+  serialSeconds = (serialMicros > 0) ? serialMicros / 1e6 : 1e-6;
+  parallelSeconds = (parallelMicros > 0) ? parallelMicros / 1e6 : 1e-6;
+  printf("%s: %llu events, serial %.0f events/s, parallel %.0f events/s (%.2fx)\n",
+      pName, numEvents, numEvents / serialSeconds, numEvents / parallelSeconds,
+      serialSeconds / parallelSeconds);
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: midifile_decode [-j threads] [-n count] file.mid...\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  static DecodeJob job;
+  MemoryStream stream;
+  std::vector<MidiTimedEvent> serial;
+  std::vector<MidiTimedEvent> parallel;
+  unsigned long long totalEvents;
+  unsigned long long totalSerial;
+  unsigned long long totalParallel;
+  unsigned long long serialMicros;
+  unsigned long long parallelMicros;
+  unsigned long start;
+  int numThreads;
+  int repeat;
+  int option;
+  int numErrors;
+  int i;
+  int r;
+
+  numThreads = (int) std::thread::hardware_concurrency();
+  repeat = 100;
+  while ((option = getopt(argc, argv, "j:n:")) != -1) {
+    switch (option) {
+    case 'j': numThreads = atoi(optarg); break;
+    case 'n': repeat = atoi(optarg); break;
+    default: usage();
+    }
+  }
+  if (optind >= argc || repeat < 1) {
+    usage();
+  }
+  if (numThreads < 1) {
+    numThreads = 1;
+  }
+
+  totalEvents = 0;
+  totalSerial = 0;
+  totalParallel = 0;
+  numErrors = 0;
+  for (i = optind; i < argc; ++i) {
+    if (!stream.load(argv[i])) {
+      fprintf(stderr, "%s: can't read the file.\n", argv[i]);
+      ++numErrors;
+      continue;
+    }
+    job.pData = stream.data();
+    job.length = stream.size();
+
+    start = micros();
+    for (r = 0; r < repeat; ++r) {
+      if (!decodeSerial(job.pData, job.length, serial)) {
+        break;
+      }
+    }
+    serialMicros = micros() - start;
+    if (r < repeat) {
+      fprintf(stderr, "%s: error reading the file.\n", argv[i]);
+      ++numErrors;
+      continue;
+    }
+
+    start = micros();
+    for (r = 0; r < repeat; ++r) {
+      if (!decodeParallel(&job, numThreads, parallel)) {
+        break;
+      }
+    }
+    parallelMicros = micros() - start;
+    if (r < repeat) {
+      fprintf(stderr, "%s: error decoding the tracks.\n", argv[i]);
+      ++numErrors;
+      continue;
+    }
+    if (!isSame(serial, parallel)) {
+      fprintf(stderr, "%s: the merged tracks differ from beginMerge().\n", argv[i]);
+      ++numErrors;
+      continue;
+    }
+
+    printResult(argv[i], serial.size(), serialMicros, parallelMicros);
+    totalEvents += serial.size();
+    totalSerial += serialMicros;
+    totalParallel += parallelMicros;
+  }
+
+  printf("%d threads\n", numThreads);
+  printResult("total", totalEvents, totalSerial, totalParallel);
+  return (numErrors > 0) ? 1 : 0;
+}
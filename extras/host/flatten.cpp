@@ -0,0 +1,99 @@
+/*
+ * Converts a Midi file to the flat playback format (see MidiFlatFile.h).
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ *
+ * Usage: midifile_flatten [-n] in.mid out.mfs
+ *  -n = keep only Note On and Note Off events (and tempo changes).
+ *
+ * Reports the number of events written and the size of each file.
+ * The converted file can be copied to an SD card and played with
+ * MidiFlatReader, or compiled into a sketch and read from memory.
+ */
+
+#include <Arduino.h>
+#include <MidiFileStream.h>
+#include <MidiFlatFile.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "HostStream.h"
+
+const int MAX_TRACKS = 64;
+
+static void usage() {
+  fprintf(stderr, "Usage: midifile_flatten [-n] in.mid out.mfs\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  MidiFileStream midiFile;
+  MidiFlatReader flatFile;
+  MidiTrackCursor tracks[MAX_TRACKS];
+  MemoryStream inStream;
+  MemoryStream flatStream;
+  PosixFileWriter outFile;
+  MidiTimedEvent event;
+  unsigned long numEvents;
+  event_t eventType;
+  boolean isNotesOnly;
+  int option;
+
+  isNotesOnly = false;
+  while ((option = getopt(argc, argv, "n")) != -1) {
+    switch (option) {
+    case 'n': isNotesOnly = true; break;
+    default: usage();
+    }
+  }
+  if (argc - optind != 2) {
+    usage();
+  }
+
+  if (!inStream.load(argv[optind])) {
+    fprintf(stderr, "Can't read %s\n", argv[optind]);
+    return 1;
+  }
+  if (!outFile.open(argv[optind + 1])) {
+    fprintf(stderr, "Can't create %s\n", argv[optind + 1]);
+    return 1;
+  }
+
+  midiFile.setSeekFunction(hostSeekStream);
+  if (isNotesOnly) {
+    midiFile.setEventFilter(ET_MASK(ET_CHANNEL) | ET_MASK(ET_TEMPO) | ET_MASK(ET_END_TRACK),
+        CH_MASK(CH_NOTE_OFF) | CH_MASK(CH_NOTE_ON));
+  }
+  if (!midiFile.begin(inStream)
+      || !MidiFlatFile::convert(midiFile, tracks, MAX_TRACKS, outFile)) {
+    fprintf(stderr, "Error converting %s\n", argv[optind]);
+    return 1;
+  }
+  midiFile.end();
+  if (!outFile.close()) {
+    fprintf(stderr, "Error writing %s\n", argv[optind + 1]);
+    return 1;
+  }
+
+  // Read the result back, to check it and count its events.
+  if (!flatStream.load(argv[optind + 1]) || !flatFile.begin(flatStream)) {
+    fprintf(stderr, "Can't read back %s\n", argv[optind + 1]);
+    return 1;
+  }
+  numEvents = 0;
+  while ((eventType = flatFile.readEvent(&event)) != ET_END) {
+    if (eventType == ET_UNK) {
+      fprintf(stderr, "Error reading back %s\n", argv[optind + 1]);
+      return 1;
+    }
+    ++numEvents;
+  }
+  flatFile.end();
+
+  printf("%s: %lu bytes; %s: %lu bytes, %lu events, %lu.%06lu seconds\n",
+      argv[optind], inStream.size(), argv[optind + 1], flatStream.size(),
+      numEvents, event.time / 1000000UL, event.time % 1000000UL);
+  return 0;
+}
@@ -0,0 +1,669 @@
+/*
+ * Fuzz test: reads damaged and random Midi files, checking that
+ * the work per event stays bounded, however hostile the file.
+ *
+ * Copyright (c) 2014 Bradford Needham
+ * (@bneedhamia, https://www.needhamia.com)
+ * Licensed under the LGPL version 2.1
+ * a version of which should be supplied with this file.
+ *
+ * Usage: midifile_fuzz [-n count] [-r seed] [-t micros] [-o worst.mid] [file.mid...]
+ *  -n count = the number of damaged files to read (default 100000).
+ *  -r seed = the seed of the random damage (default 1).
+ *  -t micros = fail if a readEvent() takes longer than this
+ *   (default 0: only report the longest).
+ *  -o worst.mid = save the damaged file that read the most bytes
+ *   for one event.
+ *
+ * Each damaged file is a copy of one of the given files (or of a small
+ * built-in file that has most kinds of event), with a few random flips,
+ * overwrites, insertions, deletions and cuts.  It's read
+ *  - from memory, a chunk at a time (begin(pData, length), openChunk(),
+ *    readEvent()), with and without setResync();
+ *  - from a stream, through a small read-ahead buffer, with the tracks
+ *    merged and resynced, reading the payload of each text
+ *    and Sysex event with readPayload(), and checking that the merge
+ *    keeps every track's cursor;
+ *  - with decodeTrack() and mergeTracks();
+ *  - with a MidiTrackScanner, alongside readEvent() from a stream
+ *    with no read-ahead buffer, checking that each event has the same
+ *    offset, ticks and status byte both ways, up to the first event
+ *    readEvent() rejects (the scanner doesn't check Meta data).
+ *    The midifile_fuzz_scan1 and _scan2 builds check the scanner's
+ *    MIDIFILESTREAM_SCAN 1 and 2 (see CMakeLists.txt);
+ *  - with readEvents(), alongside readEvent(), with and without
+ *    an event filter, checking that both read the same events.
+ * For each way, it checks that
+ *  - readEvent() returns ET_END or ET_UNK within (bytes + 2 * tracks + 4)
+ *    calls: every event but the End of Track takes at least one byte,
+ *    so no file can keep the reader busy without reading it;
+ *  - no more bytes are read from the stream than the file has,
+ *    plus a read-ahead buffer for each seek.
+ * It reports the most bytes read, and the longest time taken,
+ * by one readEvent().  Exits with status 1 if a check fails.
+ *
+ * Out-of-bounds reads and writes are caught by building with
+ * -DMIDIFILESTREAM_SANITIZE=ON (see CMakeLists.txt).  With
+ * -DMIDIFILESTREAM_LIBFUZZER=ON (Clang), the checks run under libFuzzer
+ * instead, through LLVMFuzzerTestOneInput().
+ */
+
+#include <Arduino.h>
+#include <MidiFileStream.h>
+#include <MidiTrackScanner.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+#include "HostStream.h"
+
+#ifndef MIDIFILESTREAM_STATS
+#error "Build midifile_fuzz with MIDIFILESTREAM_STATS (see CMakeLists.txt)."
+#endif
+
+const int MAX_TRACKS = 16;
+const int READ_BUFFER_SIZE = 64;   // small, so that reads cross buffer boundaries.
+const int DECODE_BLOCK = 32;       // events per decodeTrack() call.
+const int MAX_DECODED = 4096;      // events decoded per track, at most.
+
+/*
+ * A small format 1 file: a tempo track with the header Meta events,
+ * and a track of notes under running status, text and Sysex.
+ */
+static const byte builtInFile[] = {
+  'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 1, 0, 2, 0x01, 0xE0,
+  'M', 'T', 'r', 'k', 0, 0, 0, 50,
+  0x00, 0xFF, 0x03, 0x04, 'S', 'o', 'n', 'g',
+  0x00, 0xFF, 0x51, 0x03, 0x07, 0xA1, 0x20,
+  0x00, 0xFF, 0x54, 0x05, 0x60, 0x00, 0x03, 0x00, 0x00,
+  0x00, 0xFF, 0x58, 0x04, 0x04, 0x02, 0x18, 0x08,
+  0x00, 0xFF, 0x59, 0x02, 0xFE, 0x01,
+  0x83, 0x60, 0xFF, 0x51, 0x03, 0x06, 0x1A, 0x80,
+  0x00, 0xFF, 0x2F, 0x00,
+  'M', 'T', 'r', 'k', 0, 0, 0, 47,
+  0x00, 0xC0, 0x05,
+  0x00, 0x90, 0x3C, 0x40,
+  0x60, 0x3E, 0x40,
+  0x60, 0x3C, 0x00,
+  0x00, 0x80, 0x3E, 0x40,
+  0x00, 0xFF, 0x01, 0x05, 'h', 'e', 'l', 'l', 'o',
+  0x00, 0xF0, 0x05, 0x7E, 0x7F, 0x09, 0x01, 0xF7,
+  0x81, 0x00, 0xE0, 0x00, 0x40,
+  0x00, 0xB0, 0x07, 0x64,
+  0x00, 0xFF, 0x2F, 0x00
+};
+
+/*
+ * Bytes that are often special to the decoder.
+ */
+static const byte interestingBytes[] = {
+  0x00, 0x01, 0x7F, 0x80, 0x81, 0xC0, 0xF0, 0xF7, 0xFE, 0xFF, 0x2F, 0x51, 0x58
+};
+
+/*
+ * A Print that throws away what's written,
+ * for the MIDIFILESTREAM_DEBUG messages.
+ */
+class NullPrint : public Print {
+  public:
+    size_t write(uint8_t) {
+      return 1;
+    }
+};
+
+/*
+ * The worst seen so far, over all files.
+ */
+struct Worst {
+  unsigned long eventBytes;   // most bytes read by one readEvent().
+  unsigned long eventMicros;  // longest time taken by one readEvent().
+  std::vector<byte> file;     // the file of eventBytes.
+  unsigned long numFailures;  // checks failed.
+};
+
+static Worst worst;
+static unsigned long maxMicrosAllowed;
+static unsigned long randomState;
+
+/*
+ * Returns a pseudo-random number (xorshift), the same on every computer.
+ */
+static unsigned long nextRandom() {
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  randomState &= 0xFFFFFFFFUL;
+  return randomState;
+}
+
+/*
+ * Reports a failed check.
+ */
+static void fail(const char *pWay, const char *pWhat, const std::vector<byte>& file) {
+  fprintf(stderr, "%s: %s (file of %lu bytes)\n", pWay, pWhat, (unsigned long) file.size());
+  if (worst.file.empty()) {
+    worst.file = file;  // save a failing file, if nothing else.
+  }
+  ++worst.numFailures;
+}
+
+/*
+ * Reads the events of the current track or merge, checking
+ * the number of calls and recording the cost of each.
+ *  pMaxCalls = the calls left, for this file.
+ * Returns the type of the last event: ET_END or ET_UNK.
+ */
+static event_t readEvents(MidiFileStream& midiFile, const std::vector<byte>& file,
+    long *pMaxCalls, const char *pWay, boolean isPayload) {
+  char payload[16];
+  unsigned long bytes;
+  unsigned long start;
+  unsigned long eventMicros;
+  event_t eventType;
+
+  for (;;) {
+    if (--*pMaxCalls < 0) {
+      fail(pWay, "readEvent() returned too many events", file);
+      return ET_UNK;
+    }
+    bytes = midiFile.getStats()->bytesRead;
+    start = micros();
+    eventType = midiFile.readEvent();
+    eventMicros = micros() - start;
+    bytes = midiFile.getStats()->bytesRead - bytes;
+
+    if (bytes > worst.eventBytes) {
+      worst.eventBytes = bytes;
+      worst.file = file;
+    }
+    if (eventMicros > worst.eventMicros) {
+      worst.eventMicros = eventMicros;
+    }
+    if (maxMicrosAllowed > 0 && eventMicros > maxMicrosAllowed) {
+      fail(pWay, "readEvent() took too long", file);
+    }
+
+    if (eventType == ET_END || eventType == ET_UNK) {
+      return eventType;
+    }
+    if (isPayload && midiFile.getPayloadLength() > 0) {
+      midiFile.readPayload(payload, sizeof(payload), midiFile.getPayloadLength() / 2);
+    }
+  }
+}
+
+/*
+ * Reads the file from memory a chunk at a time.
+ */
+static void readChunks(const std::vector<byte>& file, boolean isResync) {
+  MidiFileStream midiFile;
+  const char *pWay;
+  chunk_t chunkType;
+  long maxCalls;
+
+  pWay = isResync ? "chunks, resync" : "chunks";
+  midiFile.setResync(isResync);
+  if (!midiFile.begin(&file[0], file.size())) {
+    return;
+  }
+  maxCalls = (long) file.size() + 4;
+  while ((chunkType = midiFile.openChunk()) != CT_END) {
+    if (chunkType != CT_MTRK) {
+      if (!midiFile.skipChunk()) {
+        break;
+      }
+      continue;
+    }
+    maxCalls += 2;  // the End of Track, and the call that finds it.
+    if (readEvents(midiFile, file, &maxCalls, pWay, false) == ET_UNK) {
+      break;
+    }
+  }
+  midiFile.end();
+}
+
+/*
+ * Reads the file from a stream with the tracks merged,
+ * and checks the bytes read against the file's size.
+ */
+static void readMerged(const std::vector<byte>& file) {
+  static const char *pWay = "merged";
+  MidiFileStream midiFile;
+  MemoryStream stream;
+  MidiTrackCursor cursors[MAX_TRACKS];
+  byte readBuffer[READ_BUFFER_SIZE];
+  const MidiFileStats *pStats;
+  long maxCalls;
+  int numTracks;
+  int track;
+  int i;
+
+  stream.setData(&file[0], file.size());
+  midiFile.setReadBuffer(readBuffer, READ_BUFFER_SIZE, hostReadBlock);
+  midiFile.setSeekFunction(hostSeekStream);
+  midiFile.setResync(true);
+  if (!midiFile.begin(stream)) {
+    return;
+  }
+  numTracks = midiFile.openTracks(cursors, MAX_TRACKS);
+  if (numTracks >= 0 && midiFile.beginMerge(cursors, numTracks)) {
+    maxCalls = (long) file.size() + 2 * numTracks + 4;
+    if (readEvents(midiFile, file, &maxCalls, pWay, true) == ET_END) {
+      // The merge reorders the cursors, but must keep each one.
+      for (track = 0; track < numTracks; ++track) {
+        for (i = 0; i < numTracks && cursors[i].track != track; ++i) {
+        }
+        if (i >= numTracks) {
+          fail(pWay, "a track's cursor was lost by the merge", file);
+          break;
+        }
+      }
+    }
+  }
+
+  pStats = midiFile.getStats();
+  if (pStats->bytesRead > file.size() + (pStats->numSeeks + 1) * READ_BUFFER_SIZE) {
+    fail(pWay, "read more bytes than the file has", file);
+  }
+  midiFile.end();
+}
+
+/*
+ * Decodes each track with decodeTrack(), then merges them.
+ */
+static void decodeTracks(const std::vector<byte>& file) {
+  static MidiTimedEvent events[MAX_TRACKS][MAX_DECODED];
+  static MidiTimedEvent merged[MAX_TRACKS * MAX_DECODED];
+  MidiFileStream midiFile;
+  MidiTrackCursor cursors[MAX_TRACKS];
+  MidiDecodedTrack decoded[MAX_TRACKS];
+  int numTracks;
+  int count;
+  int track;
+  int n;
+
+  if (!midiFile.begin(&file[0], file.size())) {
+    return;
+  }
+  numTracks = midiFile.openTracks(cursors, MAX_TRACKS);
+  for (track = 0; track < numTracks; ++track) {
+    count = 0;
+    do {
+      n = midiFile.decodeTrack(&cursors[track], &events[track][count], DECODE_BLOCK);
+      if (n > 0) {
+        count += n;
+      }
+    } while (n == DECODE_BLOCK && count + DECODE_BLOCK <= MAX_DECODED);
+    decoded[track].pEvents = events[track];
+    decoded[track].numEvents = count;
+  }
+  if (numTracks > 0) {
+    midiFile.mergeTracks(decoded, numTracks, merged, MAX_TRACKS * MAX_DECODED);
+  }
+  midiFile.end();
+}
+
+/*
+ * Returns the status byte that MidiTrackScanner::scan() reports
+ * for the current event of midiFile.
+ */
+static byte statusOf(MidiFileStream& midiFile) {
+  MidiTimedEvent event;
+
+  switch (midiFile.getEventType()) {
+  case ET_CHANNEL:
+    midiFile.getTimedEvent(&event);
+    return event.data[0];
+  case ET_SYSEX_F0:
+    return 0xF0;
+  case ET_SYSEX_ESC:
+    return 0xF7;
+  default:
+    return 0xFF;  // a Meta event.
+  }
+}
+
+/*
+ * Returns the number of bytes in the variable-length number at p,
+ * as far as the end of the file.
+ */
+static unsigned long variableLength(const byte *p, unsigned long left) {
+  unsigned long n;
+
+  for (n = 0; n < left && (p[n] & 0x80) != 0; ++n) {
+  }
+  return (n < left) ? n + 1 : n;
+}
+
+/*
+ * Scans each track with a MidiTrackScanner, and checks its events
+ * against those readEvent() reads from a stream, a byte at a time,
+ * so that the stream position is where each event starts.
+ */
+static void scanTracks(const std::vector<byte>& file) {
+  static const char *pWay = "scanned";
+  static unsigned long offsets[DECODE_BLOCK];
+  static unsigned long ticks[DECODE_BLOCK];
+  static byte status[DECODE_BLOCK];
+  MidiFileStream midiFile;
+  MidiTrackScanner scanner;
+  MemoryStream stream;
+  const byte *pTrack;
+  unsigned long trackLength;
+  unsigned long trackStart;  // offset in the file of the track body.
+  unsigned long eventStart;  // offset in the file of the event's delay.
+  unsigned long offset;      // offset in the track of the event after its delay.
+  event_t eventType;
+  chunk_t chunkType;
+  long maxCalls;
+  int track;
+  int numScanned;
+  int i;
+
+  stream.setData(&file[0], file.size());
+  if (!midiFile.begin(stream)) {
+    return;
+  }
+  maxCalls = (long) file.size() + 4;
+  track = 0;
+  while ((chunkType = midiFile.openChunk()) != CT_END) {
+    if (chunkType != CT_MTRK) {
+      if (!midiFile.skipChunk()) {
+        break;
+      }
+      continue;
+    }
+    if (!MidiTrackScanner::findTrack(&file[0], file.size(), track++, &pTrack, &trackLength)) {
+      fail(pWay, "findTrack() didn't find a track that openChunk() did", file);
+      break;
+    }
+    trackStart = (unsigned long) (pTrack - &file[0]);
+    scanner.begin(pTrack, trackLength);
+    numScanned = 0;
+    i = 0;
+    maxCalls += 2;
+    eventType = ET_UNK;
+
+    for (;;) {
+      if (--maxCalls < 0) {
+        fail(pWay, "readEvent() returned too many events", file);
+        break;
+      }
+      eventStart = stream.position();
+      eventType = midiFile.readEvent();
+      if (eventType == ET_UNK) {
+        break;  // from here, the two may disagree.
+      }
+      if (i == numScanned) {
+        numScanned = scanner.scan(offsets, ticks, status, DECODE_BLOCK);
+        i = 0;
+      }
+      if (eventType == ET_END) {
+        if (numScanned != 0) {
+          fail(pWay, "the scanner found events after the end of the track", file);
+        }
+        break;
+      }
+      if (numScanned <= 0) {
+        fail(pWay, "the scanner ended the track early", file);
+        break;
+      }
+      offset = eventStart - trackStart + variableLength(&file[eventStart], file.size() - eventStart);
+      if (offsets[i] != offset || ticks[i] != midiFile.getEventTicks()
+          || status[i] != statusOf(midiFile)) {
+        fail(pWay, "the scanner and readEvent() found different events", file);
+        break;
+      }
+      ++i;
+    }
+    if (eventType == ET_UNK) {
+      break;
+    }
+  }
+  midiFile.end();
+}
+
+/*
+ * Reads each track twice, from streams through small read-ahead buffers:
+ * with readEvents() in batches, and with readEvent(), checking that
+ * both read the same events, and end the same way.
+ *  isFiltered = if true, read only notes and tempo changes,
+ *    so that readEvents() skips events too.
+ */
+static void batchTracks(const std::vector<byte>& file, boolean isFiltered) {
+  static unsigned long ticks[DECODE_BLOCK];
+  static event_t types[DECODE_BLOCK];
+  static byte status[DECODE_BLOCK];
+  static byte param1[DECODE_BLOCK];
+  static byte param2[DECODE_BLOCK];
+  MidiEventBatch batch = { ticks, types, status, param1, param2 };
+  const char *pWay;
+  MidiFileStream batchFile;
+  MidiFileStream eventFile;
+  MemoryStream batchStream;
+  MemoryStream eventStream;
+  byte batchBuffer[READ_BUFFER_SIZE];
+  byte eventBuffer[READ_BUFFER_SIZE];
+  MidiTimedEvent event;
+  event_t eventType;
+  chunk_t chunkType;
+  long maxCalls;
+  int batchSize;
+  int numRead;
+  int i;
+
+  pWay = isFiltered ? "batches, filtered" : "batches";
+  batchStream.setData(&file[0], file.size());
+  eventStream.setData(&file[0], file.size());
+  batchFile.setReadBuffer(batchBuffer, READ_BUFFER_SIZE, hostReadBlock);
+  eventFile.setReadBuffer(eventBuffer, READ_BUFFER_SIZE, hostReadBlock);
+  batchFile.setResync(true);
+  eventFile.setResync(true);
+  if (isFiltered) {
+    batchFile.setEventFilter(ET_MASK(ET_TEMPO) | ET_MASK(ET_CHANNEL),
+        CH_MASK(CH_NOTE_ON) | CH_MASK(CH_NOTE_OFF));
+    eventFile.setEventFilter(ET_MASK(ET_TEMPO) | ET_MASK(ET_CHANNEL),
+        CH_MASK(CH_NOTE_ON) | CH_MASK(CH_NOTE_OFF));
+  }
+  if (!batchFile.begin(batchStream) || !eventFile.begin(eventStream)) {
+    batchFile.end();
+    eventFile.end();
+    return;
+  }
+  maxCalls = (long) file.size() + 4;
+  batchSize = 1;
+  eventType = ET_END;
+  while (eventType == ET_END && (chunkType = eventFile.openChunk()) != CT_END) {
+    if (batchFile.openChunk() != chunkType) {
+      fail(pWay, "the two reads found different chunks", file);
+      break;
+    }
+    if (chunkType != CT_MTRK) {
+      if (!eventFile.skipChunk() || !batchFile.skipChunk()) {
+        break;
+      }
+      continue;
+    }
+    maxCalls += 2;
+
+    numRead = batchSize;
+    while (numRead == batchSize) {
+      batchSize = batchSize % DECODE_BLOCK + 1;  // so that batches end at different events.
+      if (--maxCalls < 0) {
+        fail(pWay, "readEvents() returned too many batches", file);
+        return;
+      }
+      numRead = batchFile.readEvents(&batch, batchSize);
+      for (i = 0; i < numRead; ++i) {
+        eventType = eventFile.readEvent();
+        eventFile.getTimedEvent(&event);
+        if (eventType != types[i] || eventFile.getEventTicks() != ticks[i]
+            || event.data[0] != status[i] || event.data[1] != param1[i]
+            || event.data[2] != param2[i]) {
+          fail(pWay, "readEvents() and readEvent() found different events", file);
+          return;
+        }
+      }
+      if (numRead == batchSize
+          && batchFile.getEventDeltaTicks() != eventFile.getEventDeltaTicks()) {
+        fail(pWay, "readEvents() and readEvent() left different delta ticks", file);
+        return;
+      }
+    }
+    eventType = eventFile.readEvent();
+    if (eventType != batchFile.getEventType()
+        || eventFile.getLastError() != batchFile.getLastError()) {
+      fail(pWay, "readEvents() and readEvent() ended differently", file);
+      return;
+    }
+  }
+  batchFile.end();
+  eventFile.end();
+}
+
+/*
+ * Reads one file every way.
+ */
+static void fuzzOne(const std::vector<byte>& file) {
+  if (file.empty()) {
+    return;
+  }
+  readChunks(file, false);
+  readChunks(file, true);
+  readMerged(file);
+  decodeTracks(file);
+  scanTracks(file);
+  batchTracks(file, false);
+  batchTracks(file, true);
+}
+
+/*
+ * Damages the file with a few random changes.
+ */
+static void damage(std::vector<byte>& file) {
+  unsigned long i;
+  unsigned long n;
+  int numChanges;
+  int change;
+
+  numChanges = 1 + (int) (nextRandom() % 8);
+  for (change = 0; change < numChanges && !file.empty(); ++change) {
+    i = nextRandom() % file.size();
+    switch (nextRandom() % 7) {
+    case 0:  // flip a bit.
+      file[i] ^= (byte) (1 << (nextRandom() % 8));
+      break;
+    case 1:  // overwrite a byte.
+      file[i] = (byte) nextRandom();
+      break;
+    case 2:  // overwrite a byte with one the decoder looks for.
+      file[i] = interestingBytes[nextRandom() % sizeof(interestingBytes)];
+      break;
+    case 3:  // insert a few bytes.
+      n = 1 + nextRandom() % 4;
+      file.insert(file.begin() + i, (size_t) n, (byte) nextRandom());
+      break;
+    case 4:  // delete a few bytes.
+      n = 1 + nextRandom() % 4;
+      if (n > file.size() - i) {
+        n = file.size() - i;
+      }
+      file.erase(file.begin() + i, file.begin() + i + n);
+      break;
+    case 5:  // cut off the end.
+      file.resize(i);
+      break;
+    default:  // overwrite a length or delay with a huge one.
+      for (n = 0; n < 4 && i + n < file.size(); ++n) {
+        file[i + n] = (n < 3) ? 0xFF : 0x7F;
+      }
+      break;
+    }
+  }
+}
+
+#ifdef MIDIFILESTREAM_LIBFUZZER
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *pData, size_t size) {
+  static NullPrint messages;
+  std::vector<byte> file(pData, pData + size);
+
+  HardwareSerial::setCapture(&messages);
+  fuzzOne(file);
+  HardwareSerial::setCapture(0);
+  if (worst.numFailures > 0) {
+    abort();  // so that libFuzzer saves the file.
+  }
+  return 0;
+}
+
+#else
+
+static void usage() {
+  fprintf(stderr, "Usage: midifile_fuzz [-n count] [-r seed] [-t micros] [-o worst.mid] [file.mid...]\n");
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::vector<byte> > seeds;
+  std::vector<byte> file;
+  NullPrint messages;
+  MemoryStream stream;
+  const char *pWorstPath;
+  FILE *pWorst;
+  unsigned long count;
+  unsigned long i;
+  int option;
+
+  count = 100000;
+  randomState = 1;
+  maxMicrosAllowed = 0;
+  pWorstPath = 0;
+  while ((option = getopt(argc, argv, "n:r:t:o:")) != -1) {
+    switch (option) {
+    case 'n': count = strtoul(optarg, 0, 10); break;
+    case 'r': randomState = strtoul(optarg, 0, 10); break;
+    case 't': maxMicrosAllowed = strtoul(optarg, 0, 10); break;
+    case 'o': pWorstPath = optarg; break;
+    default: usage();
+    }
+  }
+  if (randomState == 0) {
+    randomState = 1;  // xorshift never leaves 0.
+  }
+  for (; optind < argc; ++optind) {
+    if (!stream.load(argv[optind]) || stream.size() == 0) {
+      fprintf(stderr, "%s: can't read the file.\n", argv[optind]);
+      return 2;
+    }
+    seeds.push_back(std::vector<byte>(stream.data(), stream.data() + stream.size()));
+  }
+  if (seeds.empty()) {
+    seeds.push_back(std::vector<byte>(builtInFile, builtInFile + sizeof(builtInFile)));
+  }
+
+  HardwareSerial::setCapture(&messages);
+  for (i = 0; i < seeds.size(); ++i) {
+    fuzzOne(seeds[i]);
+  }
+  for (i = 0; i < count; ++i) {
+    file = seeds[nextRandom() % seeds.size()];
+    damage(file);
+    fuzzOne(file);
+  }
+  HardwareSerial::setCapture(0);
+
+  printf("%lu files, %lu failures; most bytes read by one event: %lu; longest event: %lu us\n",
+      count, worst.numFailures, worst.eventBytes, worst.eventMicros);
+  if (pWorstPath != 0 && !worst.file.empty()) {
+    pWorst = fopen(pWorstPath, "wb");
+    if (pWorst == 0 || fwrite(&worst.file[0], 1, worst.file.size(), pWorst) != worst.file.size()) {
+      fprintf(stderr, "%s: can't write the file.\n", pWorstPath);
+    }
+    if (pWorst != 0) {
+      fclose(pWorst);
+    }
+  }
+  return (worst.numFailures > 0) ? 1 : 0;
+}
+
+#endif